@@ -0,0 +1,246 @@
+/* admission.c: Admission Control */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define ADMISSION_INITIAL_LIMIT 32      /* Adaptive limit without -L */
+#define ADMISSION_TOLERANCE     2       /* Latency over this many times the minimum is congestion */
+#define ADMISSION_MIN_WINDOW    1000    /* Samples before the minimum latency is re-learned */
+
+/* Rejections are pre-rendered so shedding costs one send and no parsing */
+
+static const char ServiceUnavailableResponse[] =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 20\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Service Unavailable\n";
+
+static const char TooManyRequestsResponse[] =
+    "HTTP/1.0 429 Too Many Requests\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 18\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "Too Many Requests\n";
+
+/* State shared by the server and its workers */
+
+typedef struct {
+    _Atomic int64_t     inflight;       /*< Requests admitted but not released */
+    _Atomic int64_t     limit;          /*< Current in-flight limit */
+    _Atomic int64_t     successes;      /*< Uncongested completions since last increase */
+    _Atomic int64_t     min_latency;    /*< Smallest recent latency (ns) */
+    _Atomic int64_t     samples;        /*< Samples since minimum was reset */
+} AdmissionState;
+
+/* Internal Variables */
+
+AdmissionState *Admission = NULL;
+
+/* Internal Declarations */
+int64_t admission_queue_time(Request *r);
+void    admission_adapt(int64_t latency);
+
+/**
+ * Initialize admission control.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked, since the counters are
+ * allocated as anonymous shared memory.  Nothing is allocated if neither a
+ * limit nor a queue-time budget is configured.
+ **/
+int admission_init(void) {
+    if (MaxInflight == 0 && QueueBudget == 0 && !AdaptiveLimit) {
+        return 0;
+    }
+
+    Admission = mmap(NULL, sizeof(AdmissionState), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (Admission == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        Admission = NULL;
+        return -1;
+    }
+
+    if (AdaptiveLimit) {
+        atomic_store(&Admission->limit, MaxInflight ? MaxInflight : ADMISSION_INITIAL_LIMIT);
+    } else {
+        atomic_store(&Admission->limit, MaxInflight);
+    }
+    return 0;
+}
+
+/**
+ * Estimate how long connection waited before being accepted.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Queue time in milliseconds (0 if unknown).
+ *
+ * The kernel records when data last arrived on the connection (or when it was
+ * established), so for a freshly accepted connection tcpi_last_data_recv is
+ * roughly the time it spent in the listen backlog.
+ **/
+int64_t admission_queue_time(Request *r) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+
+    if (getsockopt(r->fd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0) {
+        return 0;
+    }
+    return info.tcpi_last_data_recv;
+}
+
+/**
+ * Decide whether to admit accepted request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether or not the request may be handled.
+ *
+ * A request is shed if it waited longer than QueueBudget or if the in-flight
+ * limit is reached.  Admitted requests must be released with
+ * admission_release once handled.
+ **/
+bool admission_admit(Request *r) {
+    if (Admission == NULL) {
+        return true;
+    }
+
+    if (QueueBudget > 0 && admission_queue_time(r) > QueueBudget) {
+        debug("Shedding request: queue time over %u ms", QueueBudget);
+        return false;
+    }
+
+    int64_t limit    = atomic_load_explicit(&Admission->limit, memory_order_relaxed);
+    int64_t inflight = atomic_fetch_add_explicit(&Admission->inflight, 1, memory_order_relaxed);
+    if (limit > 0 && inflight >= limit) {
+        atomic_fetch_sub_explicit(&Admission->inflight, 1, memory_order_relaxed);
+        debug("Shedding request: %lld in flight", (long long)inflight);
+        return false;
+    }
+    r->admitted = true;
+    return true;
+}
+
+/**
+ * Reject request with pre-rendered response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      HTTP_STATUS_SERVICE_UNAVAILABLE or
+ *                      HTTP_STATUS_TOO_MANY_REQUESTS.
+ *
+ * The response is written with a single non-blocking send.  Whatever part of
+ * the request has already arrived is read and discarded first, since closing
+ * a socket with unread data resets the connection and may lose the response.
+ * TLS clients are only disconnected: a response would cost the handshake
+ * that shedding is meant to save.
+ **/
+void admission_reject(Request *r, HTTPStatus status) {
+    const char *response = ServiceUnavailableResponse;
+    size_t      length   = sizeof(ServiceUnavailableResponse) - 1;
+    char        discard[BUFSIZ];
+
+    if (status == HTTP_STATUS_TOO_MANY_REQUESTS) {
+        response = TooManyRequestsResponse;
+        length   = sizeof(TooManyRequestsResponse) - 1;
+    }
+
+    while (recv(r->fd, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+
+    if (!r->secure) {
+        ssize_t nwritten = send(r->fd, response, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (nwritten > 0) {
+            r->response.sent = nwritten;
+        }
+    }
+    accesslog_record(r, status);
+    metrics_request(http_status_code(status), METRICS_HANDLER_ERROR);
+}
+
+/**
+ * Release admitted request.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * This does nothing if the request holds no slot (e.g. it was handed to a
+ * worker, see worker_fork), so it may be called more than once.
+ **/
+void admission_release(Request *r) {
+    if (!r->admitted) {
+        return;
+    }
+
+    r->admitted = false;
+    admission_finish(&r->start);
+}
+
+/**
+ * Give back admission slot of completed request.
+ *
+ * @param   start       Time the request was accepted.
+ *
+ * With AdaptiveLimit, the request latency also feeds the limit.
+ **/
+void admission_finish(const struct timespec *start) {
+    if (Admission == NULL) {
+        return;
+    }
+
+    atomic_fetch_sub_explicit(&Admission->inflight, 1, memory_order_relaxed);
+    if (AdaptiveLimit) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        admission_adapt((now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec));
+    }
+}
+
+/**
+ * Adjust in-flight limit (AIMD on latency gradient).
+ *
+ * @param   latency     Latency of completed request (ns).
+ *
+ * The limit grows by one after a full limit's worth of requests completes
+ * near the minimum observed latency, and shrinks by 10% when a request takes
+ * more than ADMISSION_TOLERANCE times the minimum (queueing is building up).
+ * The minimum is re-learned periodically so it can follow the workload.
+ * Updates are single compare-and-swaps; losing a race only skips a step.
+ **/
+void admission_adapt(int64_t latency) {
+    int64_t minimum = atomic_load_explicit(&Admission->min_latency, memory_order_relaxed);
+    int64_t samples = atomic_fetch_add_explicit(&Admission->samples, 1, memory_order_relaxed);
+
+    if (minimum == 0 || latency < minimum || samples >= ADMISSION_MIN_WINDOW) {
+        if (atomic_compare_exchange_strong(&Admission->min_latency, &minimum, latency) && samples >= ADMISSION_MIN_WINDOW) {
+            atomic_store_explicit(&Admission->samples, 0, memory_order_relaxed);
+        }
+        return;
+    }
+
+    int64_t limit   = atomic_load_explicit(&Admission->limit, memory_order_relaxed);
+    int64_t ceiling = MaxInflight ? (int64_t)MaxInflight : INT32_MAX;
+    if (latency > ADMISSION_TOLERANCE * minimum) {
+        int64_t lower = limit * 9 / 10;
+        atomic_store_explicit(&Admission->successes, 0, memory_order_relaxed);
+        atomic_compare_exchange_strong(&Admission->limit, &limit, lower > 1 ? lower : 1);
+    } else if (atomic_fetch_add_explicit(&Admission->successes, 1, memory_order_relaxed) + 1 >= limit && limit < ceiling) {
+        atomic_store_explicit(&Admission->successes, 0, memory_order_relaxed);
+        atomic_compare_exchange_strong(&Admission->limit, &limit, limit + 1);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,565 @@
+/* bench.c: spidey microbenchmarks */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define BATCH_SIZE  1024                /* Operations set up at a time */
+#define DEEP_LEVELS 12                  /* Directory depth of deep URIs */
+
+/* Benchmark
+ *
+ * Each benchmark times run() over a batch of operations prepared by setup()
+ * and released by teardown(), so only the operation itself is measured. */
+
+typedef struct {
+    const char *name;
+    void      (*setup)(size_t n, const void *arg);
+    void      (*run)(size_t n, const void *arg);
+    void      (*teardown)(size_t n, const void *arg);
+    const void *arg;
+} Benchmark;
+
+/* Allocation counters (see malloc below) */
+
+bool     Counting    = false;
+uint64_t Allocations = 0;
+uint64_t AllocatedBytes = 0;
+
+/* Request corpus: recorded request heads from common clients */
+
+const char *CorpusCurl =
+    "GET /text/1kb.txt HTTP/1.1\r\n"
+    "Host: localhost:9898\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+const char *CorpusFirefox =
+    "GET /html/index.html?lang=en&theme=dark HTTP/1.1\r\n"
+    "Host: student00.cse.nd.edu:9898\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://student00.cse.nd.edu:9898/html/\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; csrftoken=c9f0f895fb98ab9159f51fd0297e236d\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "\r\n";
+
+const char *CorpusThor =
+    "GET / HTTP/1.0\r\n"
+    "Host: localhost:9898\r\n"
+    "User-Agent: thor\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+const char *CorpusPost =
+    "POST /scripts/env.sh?debug=1 HTTP/1.1\r\n"
+    "Host: localhost:9898\r\n"
+    "User-Agent: python-requests/2.31.0\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n"
+    "Content-Length: 27\r\n"
+    "Content-Type: application/x-www-form-urlencoded\r\n"
+    "\r\n";
+
+/* HTTP/2 header block of the same curl request (Huffman coded, with
+ * incremental indexing) */
+
+const uint8_t CorpusCurlHPACK[] = {
+    0x82, 0x84, 0x86, 0x41, 0x8a, 0x08, 0x9d, 0x5c, 0x0b, 0x81, 0x70, 0xdc,
+    0x7d, 0xe6, 0x9e, 0x7a, 0x88, 0x25, 0xb6, 0x50, 0xc3, 0xab, 0xbc, 0xf2,
+    0xe1, 0x53, 0x03, 0x2a, 0x2f, 0x2a,
+};
+
+/* Extension mix roughly following a static site (html, assets, media) */
+
+const char *MimetypePaths[] = {
+    "/index.html", "/about.html", "/style.css", "/app.js", "/logo.png",
+    "/photo.jpg", "/icon.svg", "/data.json", "/font.woff2", "/paper.pdf",
+    "/archive.tar.gz", "/README", "/notes.txt", "/video.mp4", "/unknown.xyz",
+    NULL,
+};
+
+/* URIs relative to the generated document root (see root_create) */
+
+const char *ShallowUris[] = {"/", "/index.html", "/text/1kb.txt", NULL};
+const char *DeepUris[]    = {
+    "/a/b/c/d/e/f/g/h/i/j/k/l/",
+    "/a/b/c/d/e/f/g/h/i/j/k/l/file.txt",
+    "/a/b/c/../c/d/e/f/./g/h/i/j/k/l/file.txt",
+    NULL,
+};
+const char *MissingUris[] = {"/missing.html", "/../../etc/passwd", NULL};
+
+/* Batch state */
+
+Request *Requests[BATCH_SIZE];
+char     RootBuffer[PATH_MAX];
+
+/* Internal Declarations (request.c) */
+int     parse_request_method(Request *r);
+int     parse_request_headers(Request *r);
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [ht] [filter]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -t seconds    Minimum time per benchmark (default: 0.5)\n");
+    exit(status);
+}
+
+/* Allocation Counting
+ *
+ * malloc and friends are interposed to count allocations while a benchmark
+ * is running, forwarding to the glibc implementations. */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+
+void * malloc(size_t size) {
+    if (Counting) {
+        Allocations++;
+        AllocatedBytes += size;
+    }
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t nmemb, size_t size) {
+    if (Counting) {
+        Allocations++;
+        AllocatedBytes += nmemb * size;
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void * realloc(void *ptr, size_t size) {
+    if (Counting) {
+        Allocations++;
+        AllocatedBytes += size;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+/**
+ * Return current monotonic time.
+ *
+ * @return  Time in nanoseconds.
+ **/
+int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Request Parsing */
+
+/**
+ * Prepare requests reading from corpus.
+ *
+ * @param   n           Number of requests.
+ * @param   arg         Request head.
+ **/
+void parse_setup(size_t n, const void *arg) {
+    const char *corpus = arg;
+
+    for (size_t i = 0; i < n; i++) {
+        Request *r = calloc(1, sizeof(Request));
+        r->fd           = -1;
+        r->input        = (char *)corpus;
+        r->input_end    = strlen(corpus);
+        r->input_closed = true;
+        r->content_length = -1;
+        Requests[i] = r;
+    }
+}
+
+/**
+ * Parse request line of each request.
+ **/
+void parse_method_run(size_t n, const void *arg) {
+    for (size_t i = 0; i < n; i++) {
+        if (parse_request_method(Requests[i]) != 0) {
+            fprintf(stderr, "parse_request_method failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Prepare requests with request line already parsed.
+ **/
+void parse_headers_setup(size_t n, const void *arg) {
+    parse_setup(n, arg);
+    parse_method_run(n, arg);
+}
+
+/**
+ * Parse headers of each request.
+ **/
+void parse_headers_run(size_t n, const void *arg) {
+    for (size_t i = 0; i < n; i++) {
+        if (parse_request_headers(Requests[i]) != 0) {
+            fprintf(stderr, "parse_request_headers failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Release requests.
+ **/
+void parse_teardown(size_t n, const void *arg) {
+    for (size_t i = 0; i < n; i++) {
+        free_request(Requests[i]);
+    }
+}
+
+/* Utilities */
+
+/**
+ * Determine mimetype of every path in mix.
+ **/
+void mimetype_run(size_t n, const void *arg) {
+    for (size_t i = 0; i < n; ) {
+        for (const char **path = MimetypePaths; *path && i < n; path++, i++) {
+            free(determine_mimetype(*path));
+        }
+    }
+}
+
+/**
+ * Look up mime-type table entry of every path in mix.
+ **/
+void mimetype_lookup_run(size_t n, const void *arg) {
+    volatile const MimeType *sink;
+
+    for (size_t i = 0; i < n; ) {
+        for (const char **path = MimetypePaths; *path && i < n; path++, i++) {
+            sink = mimetype_lookup(*path);
+        }
+    }
+    (void)sink;
+}
+
+/**
+ * Resolve every URI in list.
+ **/
+void request_path_run(size_t n, const void *arg) {
+    const char **uris = (const char **)arg;
+
+    for (size_t i = 0; i < n; ) {
+        for (const char **uri = uris; *uri && i < n; uri++, i++) {
+            free(determine_request_path(*uri));
+        }
+    }
+}
+
+/**
+ * Look up every status string.
+ **/
+void status_string_run(size_t n, const void *arg) {
+    volatile const char *sink;
+
+    for (size_t i = 0; i < n; i++) {
+        sink = http_status_string(i % HTTP_STATUS_COUNT);
+    }
+    (void)sink;
+}
+
+/**
+ * Format integers of growing size.
+ **/
+void utoa_run(size_t n, const void *arg) {
+    volatile size_t sink;
+    char buffer[20];
+
+    for (size_t i = 0; i < n; i++) {
+        sink = utoa((uint64_t)i * 7919, buffer);
+    }
+    (void)sink;
+}
+
+/* Responses */
+
+/**
+ * Assemble status line, Date, Content-Type and Content-Length headers of a
+ * file response (written to /dev/null).
+ **/
+void response_headers_run(size_t n, const void *arg) {
+    static Response response;
+    int fd = open("/dev/null", O_WRONLY);
+
+    for (size_t i = 0; i < n; ) {
+        for (const char **path = MimetypePaths; *path && i < n; path++, i++) {
+            const MimeType *type = mimetype_lookup(*path);
+            response_init(&response, fd, false);
+            response_status(&response, HTTP_STATUS_OK);
+            response_append(&response, type->header, type->header_length);
+            response_content_length(&response, i);
+            response_literal(&response, "\r\n");
+            response_flush(&response);
+        }
+    }
+    close(fd);
+}
+
+/* HTTP/2 */
+
+/**
+ * Decode header block of a new connection.
+ **/
+void hpack_decode_run(size_t n, const void *arg) {
+    static HPACKTable table;
+
+    for (size_t i = 0; i < n; i++) {
+        Header *headers = NULL;
+        hpack_init(&table);
+        hpack_decode(&table, CorpusCurlHPACK, sizeof(CorpusCurlHPACK), &headers);
+        for (Header *header = headers, *next; header != NULL; header = next) {
+            next = header->next;
+            free(header->name);
+            free(header->value);
+            free(header);
+        }
+        hpack_free(&table);
+    }
+}
+
+/**
+ * Encode headers of a file response.
+ **/
+void hpack_encode_run(size_t n, const void *arg) {
+    volatile size_t sink;
+    uint8_t block[BUFSIZ];
+
+    for (size_t i = 0; i < n; i++) {
+        size_t length = hpack_encode(block, sizeof(block), ":status", "200");
+        length += hpack_encode(block + length, sizeof(block) - length, "date", "Sun, 06 Nov 1994 08:49:37 GMT");
+        length += hpack_encode(block + length, sizeof(block) - length, "content-type", "text/html");
+        length += hpack_encode(block + length, sizeof(block) - length, "content-length", "1024");
+        sink = length;
+    }
+    (void)sink;
+}
+
+/* Harness */
+
+/**
+ * Time benchmark over a number of operations.
+ *
+ * @param   b           Benchmark.
+ * @param   n           Number of operations.
+ * @param   allocations Allocations made by the operations (output).
+ * @param   bytes       Bytes allocated by the operations (output).
+ * @return  Nanoseconds spent in the operations.
+ **/
+int64_t bench_time(Benchmark *b, size_t n, uint64_t *allocations, uint64_t *bytes) {
+    int64_t elapsed = 0;
+
+    *allocations = 0;
+    *bytes       = 0;
+    for (size_t done = 0; done < n; ) {
+        size_t batch = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+
+        if (b->setup) {
+            b->setup(batch, b->arg);
+        }
+
+        Allocations    = 0;
+        AllocatedBytes = 0;
+        Counting       = true;
+        int64_t start  = now_ns();
+        b->run(batch, b->arg);
+        elapsed       += now_ns() - start;
+        Counting       = false;
+        *allocations  += Allocations;
+        *bytes        += AllocatedBytes;
+
+        if (b->teardown) {
+            b->teardown(batch, b->arg);
+        }
+        done += batch;
+    }
+    return elapsed;
+}
+
+/**
+ * Run benchmark, growing the number of operations until it takes at least
+ * the minimum time, and report the per-operation cost.
+ *
+ * @param   b           Benchmark.
+ * @param   minimum     Minimum time (ns).
+ **/
+void bench_run(Benchmark *b, int64_t minimum) {
+    uint64_t allocations, bytes;
+    size_t   n       = 1;
+    int64_t  elapsed = bench_time(b, n, &allocations, &bytes);
+
+    while (elapsed < minimum && n < (1UL << 30)) {
+        /* Aim past the minimum, but grow at most 100x per round */
+        size_t next = elapsed > 0 ? (size_t)((double)n * minimum * 1.2 / elapsed) : n * 100;
+        n       = next > n * 100 ? n * 100 : (next <= n ? n + 1 : next);
+        elapsed = bench_time(b, n, &allocations, &bytes);
+    }
+
+    printf("%-40s %12zu %12.1f %12.2f %12.1f\n", b->name, n,
+        (double)elapsed / n, (double)allocations / n, (double)bytes / n);
+}
+
+/**
+ * Create empty file.
+ *
+ * @param   path        Path of file.
+ **/
+void root_touch(const char *path) {
+    FILE *fs = fopen(path, "w");
+    if (fs == NULL) {
+        fprintf(stderr, "fopen %s failed: %s\n", path, strerror(errno));
+        return;
+    }
+    fclose(fs);
+}
+
+/**
+ * Create document root with shallow and deep paths.
+ *
+ * @return  Real path of document root (or NULL on error).
+ **/
+char * root_create(void) {
+    char template[] = "/tmp/spidey-bench.XXXXXX";
+    char path[PATH_MAX];
+
+    if (mkdtemp(template) == NULL) {
+        fprintf(stderr, "mkdtemp failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    /* Shallow: /index.html, /text/1kb.txt */
+    snprintf(path, sizeof(path), "%s/text", template);
+    mkdir(path, 0755);
+    const char *files[] = {"/index.html", "/text/1kb.txt", NULL};
+    for (const char **file = files; *file; file++) {
+        snprintf(path, sizeof(path), "%s%s", template, *file);
+        root_touch(path);
+    }
+
+    /* Deep: /a/b/.../l/file.txt */
+    size_t length = snprintf(path, sizeof(path), "%s", template);
+    for (int level = 0; level < DEEP_LEVELS; level++) {
+        length += snprintf(path + length, sizeof(path) - length, "/%c", 'a' + level);
+        mkdir(path, 0755);
+    }
+    snprintf(path + length, sizeof(path) - length, "/file.txt");
+    root_touch(path);
+
+    return realpath(template, RootBuffer);
+}
+
+/**
+ * Remove generated document root.
+ **/
+void root_remove(void) {
+    char command[PATH_MAX + 16];
+
+    if (RootPath != NULL && strncmp(RootPath, "/tmp/spidey-bench.", 18) == 0) {
+        snprintf(command, sizeof(command), "rm -rf '%s'", RootPath);
+        if (system(command) != 0) {
+            fprintf(stderr, "Unable to remove %s\n", RootPath);
+        }
+    }
+}
+
+/**
+ * Parses command line options and runs matching benchmarks
+ **/
+int main(int argc, char *argv[]) {
+    double seconds = 0.5;
+    char  *filter  = NULL;
+    int    argind  = 1;
+
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(argv[0], 0);
+        } else if (streq(arg, "-t") && argind < argc) {
+            seconds = strtod(argv[argind++], NULL);
+        } else {
+            usage(argv[0], 1);
+        }
+    }
+    if (argind < argc) {
+        filter = argv[argind];
+    }
+
+    /* Parse from memory without the server's read deadlines */
+    HeaderTimeout = 0;
+    BodyTimeout   = 0;
+    MinBodyRate   = 0;
+
+    if ((RootPath = root_create()) == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    Benchmark benchmarks[] = {
+        {"parse_request_method/curl",       parse_setup, parse_method_run, parse_teardown, CorpusCurl},
+        {"parse_request_method/firefox",    parse_setup, parse_method_run, parse_teardown, CorpusFirefox},
+        {"parse_request_method/thor",       parse_setup, parse_method_run, parse_teardown, CorpusThor},
+        {"parse_request_method/post",       parse_setup, parse_method_run, parse_teardown, CorpusPost},
+        {"parse_request_headers/curl",      parse_headers_setup, parse_headers_run, parse_teardown, CorpusCurl},
+        {"parse_request_headers/firefox",   parse_headers_setup, parse_headers_run, parse_teardown, CorpusFirefox},
+        {"parse_request_headers/thor",      parse_headers_setup, parse_headers_run, parse_teardown, CorpusThor},
+        {"parse_request_headers/post",      parse_headers_setup, parse_headers_run, parse_teardown, CorpusPost},
+        {"determine_mimetype/mix",          NULL, mimetype_run, NULL, NULL},
+        {"mimetype_lookup/mix",             NULL, mimetype_lookup_run, NULL, NULL},
+        {"determine_request_path/shallow",  NULL, request_path_run, NULL, ShallowUris},
+        {"determine_request_path/deep",     NULL, request_path_run, NULL, DeepUris},
+        {"determine_request_path/missing",  NULL, request_path_run, NULL, MissingUris},
+        {"http_status_string",              NULL, status_string_run, NULL, NULL},
+        {"utoa",                            NULL, utoa_run, NULL, NULL},
+        {"response_headers/file",           NULL, response_headers_run, NULL, NULL},
+        {"hpack_decode/curl",               NULL, hpack_decode_run, NULL, NULL},
+        {"hpack_encode/file",               NULL, hpack_encode_run, NULL, NULL},
+    };
+
+    printf("%-40s %12s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        if (filter == NULL || strstr(benchmarks[i].name, filter) != NULL) {
+            bench_run(&benchmarks[i], (int64_t)(seconds * 1e9));
+        }
+    }
+
+    root_remove();
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
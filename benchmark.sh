@@ -0,0 +1,138 @@
+#!/bin/bash
+
+# benchmark.sh: Run spidey benchmark suite with thor
+#
+# Starts spidey in each concurrency mode and runs thor against a fixed matrix
+# of workloads and client concurrencies.  Results are written as CSV and JSON
+# to $RESULTS, named after the current commit.
+#
+# Environment:
+#
+#   DURATION        Seconds per run (5)
+#   CONCURRENCY     Client connections to test ("1 4 16 64")
+#   MODES           Server modes to test ("Single Forking")
+#   PORT            First port to listen on (9900, one per mode)
+#   RESULTS         Output directory (benchmarks)
+
+SPIDEY=./spidey
+THOR=./thor
+WORKSPACE=/tmp/spidey-benchmark.$(id -u)
+DURATION=${DURATION:-5}
+CONCURRENCY=${CONCURRENCY:-"1 4 16 64"}
+MODES=${MODES:-"Single Forking"}
+PORT=${PORT:-9900}
+RESULTS=${RESULTS:-benchmarks}
+
+# Workloads: name and path
+
+WORKLOADS="
+text_1kb        /text/1kb.txt
+text_1mb        /text/1mb.txt
+browse          /
+cgi_env         /scripts/env.sh
+cgi_cowsay      /scripts/cowsay.sh?message=hello
+"
+
+# Functions
+
+cleanup() {
+    STATUS=${1:-0}
+    [ -n "$SERVER" ] && kill $SERVER 2> /dev/null && wait $SERVER 2> /dev/null
+    rm -fr $WORKSPACE
+    exit $STATUS
+}
+
+# Extract number from flat JSON object
+json_number() {
+    echo "$2" | sed -E "s/.*\"$1\":([-0-9.]+).*/\1/"
+}
+
+# Extract nested JSON object
+json_object() {
+    echo "$2" | grep -o "\"$1\":{[^}]*}"
+}
+
+start_server() {
+    $SPIDEY -r $WORKSPACE/www -p $1 -c $2 -l $WORKSPACE/access.log 2> $WORKSPACE/spidey.log &
+    SERVER=$!
+    for attempt in $(seq 50); do
+    	if $THOR -n 1 -t 1 http://localhost:$1/ > /dev/null 2>&1; then
+    	    return 0
+	fi
+	sleep 0.1
+    done
+    echo "Unable to start $SPIDEY in $2 mode on port $1"
+    cat $WORKSPACE/spidey.log
+    return 1
+}
+
+stop_server() {
+    kill $SERVER 2> /dev/null
+    wait $SERVER 2> /dev/null
+    SERVER=
+}
+
+# Setup
+
+if [ ! -x $SPIDEY ] || [ ! -x $THOR ]; then
+    echo "Build $SPIDEY and $THOR first (make benchmark)"
+    exit 1
+fi
+
+rm -fr $WORKSPACE
+mkdir -p $WORKSPACE $RESULTS
+
+trap "cleanup" EXIT
+trap "cleanup 1" INT TERM
+
+# Serve a copy of www where only the scripts are executable (CGI)
+cp -r www $WORKSPACE/www
+find $WORKSPACE/www -type f ! -path "*/scripts/*" -exec chmod a-x {} +
+
+COMMIT=$(git rev-parse --short HEAD 2> /dev/null || echo unknown)
+if [ -n "$(git status --porcelain -- '*.c' '*.h' Makefile 2> /dev/null)" ]; then
+    COMMIT=$COMMIT-dirty
+fi
+DATE=$(date -u +%Y-%m-%dT%H:%M:%SZ)
+CSV=$RESULTS/$COMMIT.csv
+JSON=$RESULTS/$COMMIT.json
+
+echo "commit,date,mode,workload,path,connections,duration,requests,errors,throughput,bytes,p50_us,p90_us,p99_us,p99.9_us,max_us" > $CSV
+printf '{"commit":"%s","date":"%s","cpus":%d,"kernel":"%s","results":[' "$COMMIT" "$DATE" $(nproc) "$(uname -r)" > $JSON
+
+# Benchmark
+
+echo "Benchmarking spidey $COMMIT ($DURATION s per run)..."
+
+for mode in $MODES; do
+    start_server $PORT $mode || cleanup 1
+
+    echo "$WORKLOADS" | while read workload path; do
+    	[ -z "$workload" ] && continue
+	for connections in $CONCURRENCY; do
+	    printf " %-8s %-12s %4d connections ... " $mode $workload $connections
+	    result=$($THOR -j -c $connections -d $DURATION http://localhost:$PORT$path 2> /dev/null)
+	    if [ -z "$result" ]; then
+		echo "Failure"
+		continue
+	    fi
+
+	    latency=$(json_object latency_us "$result")
+	    printf "%10.1f req/s  p99 %10.1f us\n" $(json_number throughput "$result") $(json_number p99 "$latency")
+
+	    echo "$COMMIT,$DATE,$mode,$workload,$path,$connections,$(json_number duration "$result"),$(json_number requests "$result"),$(json_number errors "$result"),$(json_number throughput "$result"),$(json_number bytes "$result"),$(json_number p50 "$latency"),$(json_number p90 "$latency"),$(json_number p99 "$latency"),$(json_number p99.9 "$latency"),$(json_number max "$latency")" >> $CSV
+	    printf '%s\n{"mode":"%s","workload":"%s","path":"%s","result":%s}' "$(cat $WORKSPACE/separator 2> /dev/null)" $mode $workload "$path" "$result" >> $JSON
+	    echo -n "," > $WORKSPACE/separator
+	done
+    done
+
+    stop_server
+    PORT=$((PORT + 1))
+done
+
+echo "]}" >> $JSON
+
+echo
+echo "Results: $CSV $JSON"
+
+# vim: set sts=4 sw=4 ts=8 ft=sh:
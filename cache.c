@@ -0,0 +1,465 @@
+/* cache.c: CGI Response Cache */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CACHE_MAGIC     "SPDYCGI4"
+#define CACHE_PASS_TTL  10              /* Seconds to remember uncacheable responses */
+#define CACHE_KEY_MAX   4096            /* Longest cache key (longer requests are not cached) */
+#define CACHE_SWEEP_INTERVAL 60         /* Seconds between sweeps of CacheDir */
+#define CACHE_LOCK_TIMEOUT 5000         /* Milliseconds to wait for a concurrent fill */
+#define CACHE_LOCK_POLL    10           /* Milliseconds between attempts to take a fill lock */
+
+/* Cache entry header */
+
+typedef struct {
+    char    magic[8];                   /*< CACHE_MAGIC */
+    int64_t expires;                    /*< Expiration time (seconds since epoch) */
+    int64_t pass;                       /*< Response is not cacheable */
+    int64_t key_length;                 /*< Length of key (stored after header) */
+    int64_t status_code;                /*< Status code sent by script (0 if 200) */
+    char    content_type[64];           /*< Content-Type of response */
+} CacheHeader;
+
+/* Internal Declarations */
+ssize_t     cache_key(Request *request, char *buffer, size_t size);
+void        cache_path(Request *request, const char *suffix, char *buffer);
+off_t       cache_write_header(Request *request, int fd, time_t ttl, bool pass);
+
+/* Internal Variables */
+time_t      CacheSwept = 0;             /* Time of last sweep (see cache_sweep) */
+
+/**
+ * Determine if request is eligible for the response cache.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether or not response to request may be cached.
+ *
+ * Only GET requests without a body are cached, and only if CacheDir is set
+ * and the cache key fits in CACHE_KEY_MAX bytes.
+ **/
+bool cache_enabled(Request *r) {
+    char key[CACHE_KEY_MAX];
+
+    return CacheDir != NULL && streq(r->method, "GET") && !request_has_body(r) &&
+           cache_key(r, key, sizeof(key)) >= 0;
+}
+
+/**
+ * Construct cache key of request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   buffer      Buffer to store key in.
+ * @param   size        Size of buffer.
+ * @return  Length of key (or -1 if it does not fit).
+ *
+ * The key is the method, script path, query string, and the values of the
+ * headers named in CacheKeyHeaders, each on a line of its own.
+ **/
+ssize_t cache_key(Request *r, char *buffer, size_t size) {
+    size_t length = snprintf(buffer, size, "%s\n%s\n%s\n", r->method, r->path, r->query ? r->query : "");
+
+    /* Append comma-separated list of selected header values */
+    for (const char *name = CacheKeyHeaders; name && *name && length < size; ){
+        size_t n = strcspn(name, ",");
+        for (Header *header = r->headers; header != NULL && length < size; header = header->next){
+            if (strlen(header->name) == n && strncasecmp(header->name, name, n) == 0){
+                length += snprintf(buffer + length, size - length, "%s", header->value);
+            }
+        }
+        if (length < size){
+            length += snprintf(buffer + length, size - length, "\n");
+        }
+        name += n + (name[n] == ',');
+    }
+
+    return length < size ? (ssize_t)length : -1;
+}
+
+/**
+ * Construct path of cache file for request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   suffix      Suffix to append to key (entry, lock, or temporary).
+ * @param   buffer      Buffer of PATH_MAX bytes to store path.
+ *
+ * Files are named by the 64-bit FNV-1a hash of the cache key.  Keys that
+ * collide share a file, but each entry stores its full key, so one key is
+ * never served the other's response.
+ **/
+void cache_path(Request *r, const char *suffix, char *buffer) {
+    char     key[CACHE_KEY_MAX];
+    ssize_t  length = cache_key(r, key, sizeof(key));
+    uint64_t hash   = 14695981039346656037ULL;
+
+    for (ssize_t i = 0; i < length; i++){
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    snprintf(buffer, PATH_MAX, "%s/%016llx%s", CacheDir, (unsigned long long)hash, suffix);
+}
+
+/**
+ * Serve fresh cache entry.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  0 if response was served, 1 if a fresh entry marks the response as
+ * uncacheable, and -1 if there is no fresh entry.
+ *
+ * An entry only counts if its stored key equals the request's.  The cached
+ * response is sent to the socket with sendfile(2) (see response_sendfile).
+ **/
+int cache_serve(Request *r) {
+    char        path[PATH_MAX];
+    char        key[CACHE_KEY_MAX];
+    char        stored[CACHE_KEY_MAX];
+    CacheHeader header;
+    ssize_t     length;
+    int         fd;
+
+    if ((length = cache_key(r, key, sizeof(key))) < 0){
+        return -1;
+    }
+    cache_path(r, "", path);
+    if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0){
+        return -1;
+    }
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.key_length != length ||
+        pread(fd, stored, length, sizeof(header)) != length ||
+        memcmp(stored, key, length) != 0 ||
+        header.expires <= time(NULL)){
+        close(fd);
+        return -1;
+    }
+    if (header.pass){
+        close(fd);
+        return 1;
+    }
+
+    debug("CACHE HIT: %s", path);
+    r->status_code = header.status_code;
+    memcpy(r->content_type, header.content_type, sizeof(r->content_type));
+    r->content_type[sizeof(r->content_type) - 1] = '\0';
+    response_sendfile(&r->response, fd, sizeof(header) + length);
+    close(fd);
+    return 0;
+}
+
+/**
+ * Acquire fill lock for request's cache key.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Lock file descriptor (or -1 on error or timeout).
+ *
+ * This waits while another process holds the lock, which coalesces
+ * concurrent misses for the same key onto a single script execution.  A
+ * fill that takes longer than CACHE_LOCK_TIMEOUT (e.g. a hung script) is
+ * not waited for any longer: the caller then runs the script uncached.
+ *
+ * The holder removes the lock file when it is done (see cache_unlock), so a
+ * lock is only taken once it is on the file that is still in place.
+ **/
+int cache_lock(Request *r) {
+    char        path[PATH_MAX];
+    struct stat locked;
+    struct stat current;
+    int         fd;
+    int         waited = 0;
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = CACHE_LOCK_POLL * 1000000L};
+
+    cache_path(r, ".lock", path);
+    while (true){
+        if ((fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) < 0){
+            fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+            return -1;
+        }
+        while (flock(fd, LOCK_EX|LOCK_NB) < 0){
+            if (errno == EWOULDBLOCK && waited < CACHE_LOCK_TIMEOUT){
+                nanosleep(&interval, NULL);
+                waited += CACHE_LOCK_POLL;
+            } else if (errno != EINTR){
+                fprintf(stderr, "flock %s failed: %s\n", path, errno == EWOULDBLOCK ? "timed out" : strerror(errno));
+                close(fd);
+                return -1;
+            }
+        }
+        if (fstat(fd, &locked) == 0 && stat(path, &current) == 0 &&
+            locked.st_dev == current.st_dev && locked.st_ino == current.st_ino){
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Release fill lock.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Lock file descriptor (ignored if negative).
+ *
+ * The lock file is removed before it is unlocked, so lock files do not
+ * accumulate in CacheDir.
+ **/
+void cache_unlock(Request *r, int fd) {
+    char path[PATH_MAX];
+
+    if (fd >= 0){
+        cache_path(r, ".lock", path);
+        unlink(path);
+        close(fd);
+    }
+}
+
+/**
+ * Write cache entry header.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Cache file descriptor.
+ * @param   ttl         Lifetime of entry in seconds.
+ * @param   pass        Whether or not entry marks response as uncacheable.
+ * @return  Offset of response after header and key (or -1 on error).
+ **/
+off_t cache_write_header(Request *r, int fd, time_t ttl, bool pass) {
+    char    key[CACHE_KEY_MAX];
+    ssize_t length = cache_key(r, key, sizeof(key));
+    if (length < 0){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    CacheHeader header = {
+        .expires     = time(NULL) + ttl,
+        .pass        = pass,
+        .key_length  = length,
+        .status_code = r->status_code,
+    };
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    memcpy(header.content_type, r->content_type, sizeof(header.content_type));
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(fd, key, length, sizeof(header)) != length){
+        return -1;
+    }
+    return sizeof(header) + length;
+}
+
+/**
+ * Create temporary cache entry to fill.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  File descriptor positioned after entry header and key (or -1 on
+ * error).
+ **/
+int cache_create(Request *r) {
+    char path[PATH_MAX];
+    char suffix[32];
+    int  fd;
+
+    snprintf(suffix, sizeof(suffix), ".%d", getpid());
+    cache_path(r, suffix, path);
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600)) < 0){
+        fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    off_t offset = cache_write_header(r, fd, 0, false);
+    if (offset < 0 || lseek(fd, offset, SEEK_SET) < 0){
+        fprintf(stderr, "write %s failed: %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Publish filled cache entry and serve it.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Temporary cache file descriptor (from cache_create).
+ * @param   ttl         Lifetime of entry in seconds.
+ * @return  -1 on error and 0 on success.
+ **/
+int cache_commit(Request *r, int fd, time_t ttl) {
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    char suffix[32];
+
+    snprintf(suffix, sizeof(suffix), ".%d", getpid());
+    cache_path(r, suffix, temp);
+    cache_path(r, "", path);
+    if (cache_write_header(r, fd, ttl, false) < 0 || rename(temp, path) < 0){
+        fprintf(stderr, "commit %s failed: %s\n", path, strerror(errno));
+        unlink(temp);
+        return -1;
+    }
+    debug("CACHE FILL: %s (ttl %ld)", path, (long)ttl);
+    return cache_serve(r) == 0 ? 0 : -1;
+}
+
+/**
+ * Discard temporary cache entry.
+ *
+ * @param   r           HTTP Request structure.
+ **/
+void cache_discard(Request *r) {
+    char temp[PATH_MAX];
+    char suffix[32];
+
+    snprintf(suffix, sizeof(suffix), ".%d", getpid());
+    cache_path(r, suffix, temp);
+    unlink(temp);
+}
+
+/**
+ * Record that response to request is not cacheable.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * For CACHE_PASS_TTL seconds, misses for this key run the script directly
+ * rather than queueing behind the fill lock.
+ **/
+void cache_pass(Request *r) {
+    char suffix[32];
+    char temp[PATH_MAX];
+    char path[PATH_MAX];
+    int  fd;
+
+    snprintf(suffix, sizeof(suffix), ".%d", getpid());
+    cache_path(r, suffix, temp);
+    cache_path(r, "", path);
+    if ((fd = open(temp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600)) < 0){
+        return;
+    }
+    if (cache_write_header(r, fd, CACHE_PASS_TTL, true) < 0 || rename(temp, path) < 0){
+        unlink(temp);
+    }
+    close(fd);
+}
+
+/**
+ * Determine cache lifetime from CGI header block.
+ *
+ * @param   s           Start of CGI header block.
+ * @param   end         End of CGI header block.
+ * @return  Lifetime in seconds from Cache-Control s-maxage or max-age (0 if
+ * absent, or if no-store, no-cache, or private is present).
+ **/
+time_t cache_ttl(const char *s, const char *end) {
+    char value[BUFSIZ];
+
+    for (const char *line = s; line < end; ){
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL){
+            eol = end;
+        }
+        if (strncasecmp(line, "Cache-Control:", 14) == 0){
+            size_t length = eol - line - 14;
+            if (length >= sizeof(value)){
+                length = sizeof(value) - 1;
+            }
+            memcpy(value, line + 14, length);
+            value[length] = '\0';
+
+            if (strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private")){
+                return 0;
+            }
+            char *age = strcasestr(value, "s-maxage=");
+            if (age != NULL){
+                return strtol(age + 9, NULL, 10);
+            }
+            age = strcasestr(value, "max-age=");
+            if (age != NULL){
+                return strtol(age + 8, NULL, 10);
+            }
+            return 0;
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
+
+/**
+ * Remove stale files from cache directory.
+ *
+ * Expired entries (and expired uncacheable markers), temporary entries of
+ * processes that no longer exist, and lock files that nobody holds are
+ * removed, so CacheDir only holds the live keys.  This scans CacheDir at most
+ * every CACHE_SWEEP_INTERVAL seconds.
+ **/
+void cache_sweep(void) {
+    time_t now = time(NULL);
+
+    if (CacheDir == NULL || now - CacheSwept < CACHE_SWEEP_INTERVAL){
+        return;
+    }
+    CacheSwept = now;
+
+    DIR *dir = opendir(CacheDir);
+    if (dir == NULL){
+        fprintf(stderr, "opendir %s failed: %s\n", CacheDir, strerror(errno));
+        return;
+    }
+
+    size_t removed = 0;
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)){
+        const char *name   = entry->d_name;
+        const char *suffix = name + 16;
+        bool        stale  = false;
+        int         fd;
+
+        if (strspn(name, "0123456789abcdef") != 16){
+            continue;
+        }
+        if (*suffix == '\0'){
+            /* Entry: stale once expired */
+            CacheHeader header;
+            if ((fd = openat(dirfd(dir), name, O_RDONLY|O_CLOEXEC)) < 0){
+                continue;
+            }
+            stale = pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+                    memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+                    header.expires <= now;
+            close(fd);
+        } else if (streq(suffix, ".lock")){
+            /* Lock: removed while held, like cache_unlock does */
+            if ((fd = openat(dirfd(dir), name, O_RDONLY|O_CLOEXEC)) < 0){
+                continue;
+            }
+            if (flock(fd, LOCK_EX|LOCK_NB) == 0 && unlinkat(dirfd(dir), name, 0) == 0){
+                removed++;
+            }
+            close(fd);
+            continue;
+        } else if (*suffix == '.'){
+            /* Temporary entry: stale once its process is gone */
+            char *end;
+            long  pid = strtol(suffix + 1, &end, 10);
+            stale = end != suffix + 1 && *end == '\0' && kill(pid, 0) < 0 && errno == ESRCH;
+        }
+
+        if (stale && unlinkat(dirfd(dir), name, 0) == 0){
+            removed++;
+        }
+    }
+    closedir(dir);
+    debug("CACHE SWEEP: removed %zu file(s)", removed);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,136 @@
+/* date.c: Cached HTTP Date Header */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Date header of the current second, rendered by the timer thread in the
+ * server process and read by every worker.  The sequence number is odd while
+ * the header is being rewritten. */
+
+typedef struct {
+    _Atomic uint32_t    sequence;       /*< Update sequence number */
+    _Atomic int64_t     second;         /*< Time of header (seconds since epoch) */
+    char                header[DATE_HEADER_SIZE];
+} DateCache;
+
+/* Internal Variables */
+
+DateCache *Date = NULL;
+
+/* Internal Declarations */
+size_t  date_format(time_t now, char *buffer);
+void *  date_timer(void *arg);
+
+/**
+ * Start Date header timer.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked, since the header is
+ * kept in anonymous shared memory.
+ **/
+int date_init(void) {
+    pthread_t thread;
+    sigset_t  all, saved;
+
+    Date = mmap(NULL, sizeof(DateCache), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (Date == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        Date = NULL;
+        return -1;
+    }
+    time_t now = time(NULL);
+    date_format(now, Date->header);
+    atomic_store_explicit(&Date->second, now, memory_order_release);
+
+    /* Timer blocks all signals, like the access log writer */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    if (pthread_create(&thread, NULL, date_timer, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        munmap(Date, sizeof(DateCache));
+        Date = NULL;
+        return -1;
+    }
+    pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return 0;
+}
+
+/**
+ * Format Date header.
+ *
+ * @param   now         Time (seconds since epoch).
+ * @param   buffer      Buffer of DATE_HEADER_SIZE bytes.
+ * @return  Length of header line (e.g. "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n").
+ **/
+size_t date_format(time_t now, char *buffer) {
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    return strftime(buffer, DATE_HEADER_SIZE, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+}
+
+/**
+ * Copy Date header of current second.
+ *
+ * @param   buffer      Buffer of DATE_HEADER_SIZE bytes.
+ * @return  Length of header line.
+ *
+ * Falls back to formatting the header if the timer is not running, is
+ * behind, or is rewriting the header at this very moment.
+ **/
+size_t date_header(char *buffer) {
+    time_t now = time(NULL);
+
+    if (Date != NULL) {
+        uint32_t sequence = atomic_load_explicit(&Date->sequence, memory_order_acquire);
+        if (!(sequence & 1) && atomic_load_explicit(&Date->second, memory_order_relaxed) == now) {
+            memcpy(buffer, Date->header, DATE_HEADER_SIZE);
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&Date->sequence, memory_order_relaxed) == sequence) {
+                return strnlen(buffer, DATE_HEADER_SIZE);
+            }
+        }
+    }
+    return date_format(now, buffer);
+}
+
+/**
+ * Render Date header at the start of every second.
+ *
+ * @param   arg         Unused.
+ * @return  NULL (never returns).
+ **/
+void *date_timer(void *arg) {
+    char header[DATE_HEADER_SIZE];
+
+    while (true) {
+        struct timespec next;
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec  += 1;
+        next.tv_nsec  = 0;
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL) == EINTR);
+
+        time_t now = time(NULL);
+        size_t length = date_format(now, header);
+
+        uint32_t sequence = atomic_load_explicit(&Date->sequence, memory_order_relaxed);
+        atomic_store_explicit(&Date->sequence, sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memset(Date->header, 0, DATE_HEADER_SIZE);
+        memcpy(Date->header, header, length);
+        atomic_store_explicit(&Date->second, now, memory_order_relaxed);
+        atomic_store_explicit(&Date->sequence, sequence + 2, memory_order_release);
+    }
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
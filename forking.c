@@ -2,45 +2,71 @@
 
 #include "spidey.h"
 
-#include <errno.h>
-#include <signal.h>
-#include <string.h>
-
 #include <unistd.h>
 
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
  * The parent should accept a request and then fork off and let the child
  * handle the request.
+ *
+ * Workers are reaped (and their admission slots released) by the parent
+ * whenever SIGCHLD interrupts the accept.
+ *
+ * This returns once Shutdown is set; the server sockets are left open (they
+ * may be handed over to a new instance).
  **/
-int forking_server(int sfd) {
+int forking_server(int *sfds, size_t nsfds) {
+    worker_init(sfds, nsfds);
 
     /* Accept and handle HTTP request */
-    while (true) {
+    while (!Shutdown) {
+        /* Reap finished workers, rotate TLS ticket keys, sweep the CGI
+         * cache, and dump spans if requested */
+        worker_reap();
+        tls_rotate();
+        cache_sweep();
+        trace_poll();
+
       	/* Accept request */
+        int sfd = socket_wait(sfds, nsfds);
+        if (sfd < 0) {
+            continue;
+        }
         Request *client_request = accept_request(sfd);
         if (!client_request) {
             continue;
         }
-  	     /* Ignore children */
-        signal(SIGCHLD, SIG_IGN);
 
+        /* Reject clients over their rate */
+        if (!ratelimit_admit(client_request)) {
+            admission_reject(client_request, HTTP_STATUS_TOO_MANY_REQUESTS);
+            free_request(client_request);
+            continue;
+        }
+
+        /* Shed request if overloaded (before paying for a fork) */
+        if (!admission_admit(client_request)) {
+            admission_reject(client_request, HTTP_STATUS_SERVICE_UNAVAILABLE);
+            free_request(client_request);
+            continue;
+        }
   	    /* Fork off child process to handle request */
-        pid_t pid = fork();
+        pid_t pid = worker_fork(client_request);
         if (pid < 0) {
-            debug("fork failed %s", strerror(errno));
-            close(sfd);
+            admission_release(client_request);
+            free_request(client_request);
             continue;
         }
         if (pid == 0) { // Child
             /* Handle client request */
             debug("Handling client request");
             HTTPStatus status = handle_request(client_request);
-            close(sfd);
+            free_request(client_request);
             exit(status != 0);
         }
         else {        // Parent
@@ -49,8 +75,6 @@ int forking_server(int sfd) {
 
     }
 
-    /* Close server socket */
-    close(sfd);
     return EXIT_SUCCESS;
 }
 
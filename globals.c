@@ -0,0 +1,37 @@
+/* globals.c: Global Variables (shared by spidey and spidey-bench) */
+
+#include "spidey.h"
+
+/* Global Variables (defaults, see parse_options) */
+char *Ports[MAX_LISTENERS] = {"9898"};
+size_t PortsCount     = 0;
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath	      = "www";
+size_t MaxBodySize    = 1<<20;
+char *CacheDir        = NULL;
+char *CacheKeyHeaders = NULL;
+char *AccessLogPath   = NULL;
+bool AccessLogBinary  = false;
+char *TracePath       = NULL;
+unsigned TraceSampleRate = 1;
+unsigned MaxInflight  = 0;
+unsigned QueueBudget  = 0;
+bool AdaptiveLimit    = false;
+unsigned RateLimit    = 0;
+unsigned RateBurst    = 0;
+unsigned HeaderTimeout = 10000;
+unsigned BodyTimeout  = 10000;
+unsigned MinBodyRate  = 1024;
+unsigned HostnameTTL  = 0;
+char *TLSCertificatePath = NULL;
+char *TLSKeyPath      = NULL;
+SocketOptions ListenOptions = {
+    .backlog   = SOMAXCONN,
+    .reuseaddr = 1,
+};
+volatile sig_atomic_t Shutdown = 0;
+unsigned DrainTimeout = 30000;
+volatile sig_atomic_t Restart  = 0;
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,21 +1,43 @@
 /* handler.c: HTTP Request Handlers */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
 #include <limits.h>
+#include <signal.h>
 #include <string.h>
+#include <strings.h>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <libgen.h>
 
+/* Constants */
+
+#define CGI_RELAY_CHUNK         (1<<16)
+#define HTML_CONTENT_TYPE       "Content-Type: text/html\r\n"
+#define METRICS_CONTENT_TYPE    "Content-Type: text/plain; version=0.0.4\r\n"
+
 /* Internal Declarations */
 HTTPStatus handle_browse_request(Request *request);
 HTTPStatus handle_file_request(Request *request);
 HTTPStatus handle_cgi_request(Request *request);
 HTTPStatus handle_error(Request *request, HTTPStatus status);
+HTTPStatus handle_metrics_request(Request *request);
+
+void        cgi_export_environment(Request *request);
+int         cgi_spawn(Request *request, int body_fd, pid_t *pid, pid_t *feeder);
+char *      cgi_header_end(char *s);
+void        cgi_content_type(const char *s, const char *end, char *buffer, size_t size);
+int         cgi_write_headers(Response *response, char *s, char *end);
+ssize_t     cgi_relay(int in_fd, Response *out);
+pid_t       cgi_feed_body(Request *request, int out_fd);
+int         cgi_spool_body(Request *request, HTTPStatus *status);
 
 /**
  * Handle HTTP Request.
@@ -27,13 +49,38 @@ HTTPStatus handle_error(Request *request, HTTPStatus status);
  * type, and then dispatches to the appropriate handler type.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
+ *
+ * The duration of each stage and the final status and handler type are
+ * recorded in the metrics.
  **/
 HTTPStatus  handle_request(Request *r) {
     HTTPStatus result;
+    MetricsHandler handler = METRICS_HANDLER_ERROR;
+    struct timespec mark;
+
+    clock_gettime(CLOCK_MONOTONIC, &mark);
+    metrics_inflight(1);
+
+    /* Finish TLS handshake (here in the worker rather than on the accept
+     * path; it is timed as part of parsing).  A failed handshake gets no
+     * response, but is logged and counted like any other request */
+    if (r->secure && r->tls == NULL && tls_accept(r) < 0){
+        metrics_stage(r, METRICS_STAGE_PARSE, &mark);
+        result = r->timed_out ? HTTP_STATUS_REQUEST_TIMEOUT : HTTP_STATUS_BAD_REQUEST;
+        goto done;
+    }
 
-    /* Parse request */
-    int i = parse_request(r);
-    if (i == -1){
+    /* Parse request (HTTP/2 streams arrive parsed, see http2_stream_request) */
+    probe(parse__start, r->fd);
+    int i = r->method != NULL ? 0 : parse_request(r);
+    metrics_stage(r, METRICS_STAGE_PARSE, &mark);
+    probe(parse__end, r->fd, i);
+    if (r->timed_out){
+        fprintf(stderr, "Parse request timed out: %s:%s\n", request_host(r), request_port(r));
+        result = HTTP_STATUS_REQUEST_TIMEOUT;
+        goto error;
+    }
+    else if (i == -1){
         fprintf(stderr, "Parse request method failed: %s\n", strerror(errno));
         result = HTTP_STATUS_BAD_REQUEST;
         goto error;
@@ -43,9 +90,48 @@ HTTPStatus  handle_request(Request *r) {
         result = HTTP_STATUS_BAD_REQUEST;
         goto error;
     }
+    else if (i == -3){
+        fprintf(stderr, "Parse request body length failed\n");
+        result = HTTP_STATUS_BAD_REQUEST;
+        goto error;
+    }
+
+    /* Switch protocols (the streams are handled and logged on their own).
+     * The connection may stay open indefinitely, so a Single server hands it
+     * to a worker rather than serving it inline */
+    if (http2_requested(r)){
+        metrics_inflight(-1);
+        if (worker_process()){
+            return http2_serve(r);
+        }
+        pid_t pid = worker_fork(r);
+        if (pid != 0){
+            return pid < 0 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_OK;
+        }
+        result = http2_serve(r);
+        free_request(r);
+        exit(result != 0);
+    }
+
+    /* Reject oversized request bodies before reading them */
+    if (r->content_length > 0 && (size_t)r->content_length > MaxBodySize){
+        fprintf(stderr, "Request body too large: %zd > %zu\n", r->content_length, MaxBodySize);
+        result = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+        goto error;
+    }
+
+    /* Serve metrics endpoint */
+    if (streq(r->uri, METRICS_PATH)){
+        handler = METRICS_HANDLER_METRICS;
+        probe(handle__metrics, r->fd, r->uri);
+        result  = handle_metrics_request(r);
+        metrics_stage(r, METRICS_STAGE_HANDLER, &mark);
+        goto done;
+    }
 
     /* Determine request path */
     r->path = determine_request_path(r->uri);
+    metrics_stage(r, METRICS_STAGE_PATH, &mark);
     if (r->path == NULL){
         fprintf(stderr, "Determining request path(%s) failed: %s\n", r->path, strerror(errno));
         result = HTTP_STATUS_NOT_FOUND;
@@ -57,27 +143,49 @@ HTTPStatus  handle_request(Request *r) {
     struct stat s;
     lstat(r->path, &s);
     if ((s.st_mode & S_IFMT) == S_IFDIR){
+        handler = METRICS_HANDLER_BROWSE;
+        probe(handle__browse, r->fd, r->path);
         result = handle_browse_request(r);
     }
     else if ((s.st_mode & S_IFMT) == S_IFREG){
         if (access(r->path, X_OK) == 0){
+            handler = METRICS_HANDLER_CGI;
+            probe(handle__cgi, r->fd, r->path);
             result = handle_cgi_request(r);
         }
-        else { result = handle_file_request(r); }
+        else {
+            handler = METRICS_HANDLER_FILE;
+            probe(handle__file, r->fd, r->path);
+            result = handle_file_request(r);
+        }
     }
     else {
         result = HTTP_STATUS_BAD_REQUEST;
     }
+    metrics_stage(r, METRICS_STAGE_HANDLER, &mark);
 
     if (result != 0){
+        handler = METRICS_HANDLER_ERROR;
         result = handle_error(r, result);
     }
-    log("HTTP REQUEST STATUS: %s", http_status_string(result));
-    return result;
+    goto done;
 
 error:
     result = handle_error(r, result);
-    log("HTTP REQUEST STATUS: %s", http_status_string(result));
+
+done:
+    response_flush(&r->response);
+    socket_uncork(r->fd, r->addr.ss_family);
+    accesslog_record(r, result);
+    metrics_request(r->status_code ? r->status_code : http_status_code(result), handler);
+    metrics_stage(r, METRICS_STAGE_FLUSH, &mark);
+    metrics_inflight(-1);
+    trace_record(r, result);
+
+    /* Let the client read the error before its unread body resets the connection */
+    if (result != HTTP_STATUS_OK && request_has_body(r) && !r->body_done){
+        request_linger(r);
+    }
     return result;
 }
 
@@ -103,27 +211,27 @@ HTTPStatus  handle_browse_request(Request *r) {
         return HTTP_STATUS_NOT_FOUND;
     }
     /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->file, "Content-Type: text/html\r\n");
-    fprintf(r->file, "\r\n");
+    snprintf(r->content_type, sizeof(r->content_type), "text/html");
+    response_status(&r->response, HTTP_STATUS_OK);
+    response_literal(&r->response, HTML_CONTENT_TYPE "\r\n");
 
     /* For each entry in directory, emit HTML list item */
     char *base = NULL;
-    fprintf(r->file, "<ul>\r\n");
+    response_printf(&r->response, "<ul>\r\n");
     for (int i = 0; i < n; i++) {
         if (!streq(entries[i]->d_name, ".")){
             if (!streq(r->uri, "/")){
                 base = basename(r->path);
-                fprintf(r->file, "<li><a href=\"/%s/%s\">%s</a></li>\r\n", base, entries[i]->d_name, entries[i]->d_name);
-            } else { fprintf(r->file, "<li><a href=\"/%s\">%s</a></li>\r\n", entries[i]->d_name, entries[i]->d_name); }
+                response_printf(&r->response, "<li><a href=\"/%s/%s\">%s</a></li>\r\n", base, entries[i]->d_name, entries[i]->d_name);
+            } else { response_printf(&r->response, "<li><a href=\"/%s\">%s</a></li>\r\n", entries[i]->d_name, entries[i]->d_name); }
         }
         free(entries[i]);
     }
-    fprintf(r->file, "</ul>\r\n");
+    response_printf(&r->response, "</ul>\r\n");
     free(entries);
 
     /* Flush socket, return OK */
-    if (fflush(r->file) != 0){
+    if (response_flush(&r->response) < 0){
         fprintf(stderr, "flush socket failed: %s\n", strerror(errno));
         return HTTP_STATUS_NOT_FOUND;
     }
@@ -137,53 +245,49 @@ HTTPStatus  handle_browse_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * This opens the specified file and sends its contents to the socket with
+ * sendfile(2), right behind the response headers (see response_sendfile).
  *
  * If the path cannot be opened for reading, then handle error with
  * HTTP_STATUS_NOT_FOUND.
  **/
 HTTPStatus  handle_file_request(Request *r) {
-    FILE *fs;
-    char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
+    int fd;
+    struct stat s;
 
     /* Open file for reading */
-    fs = fopen(r->path, "r");
-    if (!fs) {
-        fprintf(stderr, "fdopen failed: %s\n", strerror(errno));
+    fd = open(r->path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &s) < 0) {
+        fprintf(stderr, "open failed: %s\n", strerror(errno));
         goto fail;
     }
 
     /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);
-
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->file, "Content-Type: %s\r\n", mimetype);
-    fprintf(r->file, "\r\n");
-
-    /* Read from file and write to socket in chunks */
-    while ((nread = fread(buffer, sizeof(char), BUFSIZ, fs))){
-        fwrite(buffer, sizeof(char), nread, r->file);
-    }
-
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    fclose(fs);
-    if (fflush(r->file) != 0){
-        fprintf(stderr, "flush socket failed: %s\n", strerror(errno));
+    const MimeType *type = mimetype_lookup(r->path);
+    snprintf(r->content_type, sizeof(r->content_type), "%s", type->mimetype);
+
+    /* Write HTTP Headers with OK status, determined Content-Type, and size */
+    response_status(&r->response, HTTP_STATUS_OK);
+    response_append(&r->response, type->header, type->header_length);
+    response_content_length(&r->response, s.st_size);
+    response_literal(&r->response, "\r\n");
+
+    /* Send headers and file to socket */
+    if (response_sendfile(&r->response, fd, 0) < 0){
+        fprintf(stderr, "send file failed: %s\n", strerror(errno));
         goto fail;
     }
-    free(mimetype);
+
+    /* Close file, return OK */
+    close(fd);
 
     return HTTP_STATUS_OK;
 
 fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    if (fs != NULL){
-        fclose(fs);
+    /* Close file, return INTERNAL_SERVER_ERROR */
+    if (fd >= 0){
+        close(fd);
     }
-    free(mimetype);
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
 
@@ -193,31 +297,192 @@ fail:
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This forks and executes the specified script with its standard output
+ * connected to a pipe.  If the request has a body, a feeder process streams it
+ * to the script's standard input through a fixed-size buffer.
+ *
+ * The CGI header block is read and parsed once: a non-parsed header response
+ * (one that begins with "HTTP/") is passed through as is, otherwise the Status:
+ * and Content-Type: headers are used to write the response status line and
+ * headers.  The remainder of the output is then relayed from the pipe to the
+ * socket with splice(2).
+ *
+ * If the response cache is enabled, a fresh cached response is served without
+ * running the script at all.  Concurrent misses for the same key wait on the
+ * cache lock, so only one of them executes the script; if its output carries
+ * a Cache-Control lifetime, it is relayed into the cache first and then sent
+ * from there.
  *
- * If the path cannot be popened, then handle error with
+ * If the script cannot be executed, then handle error with
  * HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 HTTPStatus handle_cgi_request(Request *r) {
-    FILE *pfs;
     char buffer[BUFSIZ];
+    HTTPStatus result = HTTP_STATUS_OK;
+    Response *out = &r->response;
+    Response cache;
+    time_t ttl = 0;
+    int lock_fd = -1;
+    int cache_fd = -1;
+    int body_fd = -1;
+    int pipe_fd;
+    pid_t pid;
+    pid_t feeder = -1;
+
+    /* Read chunked body up front, so it can still be refused */
+    if (r->chunked && (body_fd = cgi_spool_body(r, &result)) < 0){
+        return result;
+    }
+
+    /* Serve from cache, or wait for concurrent fill of same key */
+    if (cache_enabled(r)){
+        int status = cache_serve(r);
+        if (status == 0){
+            return HTTP_STATUS_OK;
+        }
+        if (status < 0){
+            lock_fd = cache_lock(r);
+            status  = cache_serve(r);
+            if (status >= 0){
+                /* Served by (or marked uncacheable by) concurrent fill */
+                cache_unlock(r, lock_fd);
+                lock_fd = -1;
+                if (status == 0){
+                    return HTTP_STATUS_OK;
+                }
+            }
+        }
+    }
+
+    /* Spawn CGI script */
+    cgi_export_environment(r);
+    pipe_fd = cgi_spawn(r, body_fd, &pid, &feeder);
+    if (body_fd >= 0){
+        close(body_fd);
+    }
+    if (pipe_fd < 0){
+        cache_unlock(r, lock_fd);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Read and parse CGI header block */
+    size_t nread = 0;
+    char *body = NULL;
+    ssize_t n;
+    while (body == NULL && nread < sizeof(buffer) - 1){
+        n = read(pipe_fd, buffer + nread, sizeof(buffer) - 1 - nread);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            break;
+        }
+        nread += n;
+        buffer[nread] = '\0';
+        body = cgi_header_end(buffer);
+    }
+    if (body == NULL){
+        fprintf(stderr, "CGI header block missing: %s\n", r->path);
+        result = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        goto done;
+    }
+
+    cgi_content_type(buffer, body, r->content_type, sizeof(r->content_type));
+
+    /* Relay into cache instead of socket if response is cacheable */
+    if (lock_fd >= 0){
+        ttl = cache_ttl(buffer, body);
+        if (ttl <= 0){
+            cache_pass(r);
+        } else if ((cache_fd = cache_create(r)) >= 0){
+            response_init(&cache, cache_fd, false);
+            out = &cache;
+        }
+    }
+
+    int status_code;
+    if (strncmp(buffer, "HTTP/", 5) == 0){
+        /* Non-parsed headers: relay header block unmodified */
+        const char *space = memchr(buffer, ' ', body - buffer);
+        status_code = space ? atoi(space + 1) : 0;
+        response_append(out, buffer, body - buffer);
+    } else {
+        status_code = cgi_write_headers(out, buffer, body);
+    }
+    response_append(out, body, buffer + nread - body);
+
+    /* Flush headers (and record the status the script chose), then relay
+     * remaining output from pipe */
+    if (response_flush(out) < 0){
+        fprintf(stderr, "flush socket failed: %s\n", strerror(errno));
+        result = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    } else {
+        r->status_code = status_code >= 100 && status_code <= 599 ? status_code : 0;
+        if ((n = cgi_relay(pipe_fd, out)) < 0){
+            fprintf(stderr, "relay CGI output failed: %s\n", strerror(errno));
+            result = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        } else {
+            out->sent += n;
+        }
+    }
+
+    /* Publish cache entry and send it to client */
+    if (out != &r->response){
+        if (result != HTTP_STATUS_OK){
+            cache_discard(r);
+        } else if (cache_commit(r, cache_fd, ttl) < 0){
+            result = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+        close(cache_fd);
+    }
+
+done:
+    /* Close pipe, release cache lock, and reap script (and feeder) */
+    close(pipe_fd);
+    cache_unlock(r, lock_fd);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+    if (feeder > 0){
+        while (waitpid(feeder, NULL, 0) < 0 && errno == EINTR);
+    }
+    return result;
+}
+
+/**
+ * Export CGI environment variables.
+ *
+ * @param   r           HTTP Request structure.
+ **/
+void cgi_export_environment(Request *r) {
+    char buffer[BUFSIZ];
+
     /* Export CGI environment variables from request structure:
     * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
     setenv("DOCUMENT_ROOT", RootPath, 1);
     if (r->query != NULL){
        setenv("QUERY_STRING", r->query, 1);
     } else { setenv("QUERY_STRING", "", 1); }
-    if (r->host != NULL){
-        setenv("REMOTE_ADDR", r->host, 1);
-    } else { setenv("REMOTE_ADDR", "", 1); }
-    if (r->port != NULL){
-        setenv("REMOTE_PORT", r->port, 1);
-    } else { setenv("REMOTE_PORT", "", 1); }
+    setenv("REMOTE_ADDR", request_host(r), 1);
+    setenv("REMOTE_HOST", request_hostname(r), 1);
+    setenv("REMOTE_PORT", request_port(r), 1);
     setenv("REQUEST_METHOD", r->method, 1);
     setenv("REQUEST_URI", r->uri, 1);
     setenv("SCRIPT_FILENAME", r->path, 1);
-    setenv("SERVER_PORT", Port, 1);
+    if (r->secure){
+        setenv("HTTPS", "on", 1);
+    } else { unsetenv("HTTPS"); }
+    struct sockaddr_storage local;
+    socklen_t local_length = sizeof(local);
+    char server_port[NI_MAXSERV];
+    if (r->addr.ss_family != AF_UNIX &&
+        getsockname(r->fd, (struct sockaddr *)&local, &local_length) == 0 &&
+        getnameinfo((struct sockaddr *)&local, local_length, NULL, 0, server_port, sizeof(server_port), NI_NUMERICSERV) == 0){
+        setenv("SERVER_PORT", server_port, 1);
+    } else { unsetenv("SERVER_PORT"); }
+    if (r->content_length >= 0){
+        snprintf(buffer, sizeof(buffer), "%zd", r->content_length);
+        setenv("CONTENT_LENGTH", buffer, 1);
+    } else { unsetenv("CONTENT_LENGTH"); }
+    unsetenv("CONTENT_TYPE");
 
     /* Export CGI environment variables from request headers */
     for (struct header *temp = r->headers; temp != NULL; temp = temp->next){
@@ -242,24 +507,367 @@ HTTPStatus handle_cgi_request(Request *r) {
         else if (streq(temp->name, "User-Agent")){
             setenv("HTTP_USER_AGENT", temp->value, 1);
         }
+        else if (strcasecmp(temp->name, "Content-Type") == 0){
+            setenv("CONTENT_TYPE", temp->value, 1);
+        }
 
     }
+}
 
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");
-    if (pfs == NULL){
-        fprintf(stderr, "popen failed: %s\n", strerror(errno));
-        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+/**
+ * Spawn CGI script.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   body_fd     File holding the request body (or -1 to stream it).
+ * @param   pid         Pointer to store process id of script.
+ * @param   feeder      Pointer to store process id of body feeder (or -1).
+ * @return  Read end of script's output pipe (or -1 on error).
+ **/
+int cgi_spawn(Request *r, int body_fd, pid_t *pid, pid_t *feeder) {
+    int pfd[2];
+    int ifd[2];
+
+    /* Spawn CGI script with its standard input and output connected to pipes */
+    if (pipe(pfd) < 0){
+        fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pipe(ifd) < 0){
+        fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+        close(pfd[0]);
+        close(pfd[1]);
+        return -1;
+    }
+    *pid = fork();
+    if (*pid < 0){
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        close(pfd[0]);
+        close(pfd[1]);
+        close(ifd[0]);
+        close(ifd[1]);
+        return -1;
+    }
+    if (*pid == 0){
+        signal(SIGPIPE, SIG_DFL);
+        dup2(body_fd >= 0 ? body_fd : ifd[0], STDIN_FILENO);
+        dup2(pfd[1], STDOUT_FILENO);
+        close(ifd[0]);
+        close(ifd[1]);
+        close(pfd[0]);
+        close(pfd[1]);
+        execl(r->path, r->path, (char *)NULL);
+        fprintf(stderr, "exec %s failed: %s\n", r->path, strerror(errno));
+        _exit(127);
     }
+    close(pfd[1]);
+    close(ifd[0]);
 
-    /* Copy data from popen to socket */
-    while (fgets(buffer, BUFSIZ, pfs)){
-        fputs(buffer, r->file);
+    /* Stream request body (if any) to script */
+    *feeder = -1;
+    if (body_fd < 0 && request_has_body(r)){
+        *feeder = cgi_feed_body(r, ifd[1]);
     }
+    close(ifd[1]);
+
+    return pfd[0];
+}
+
+/**
+ * Find end of CGI header block.
+ *
+ * @param   s           NUL-terminated CGI output read so far.
+ * @return  Pointer to first byte of body (or NULL if header block incomplete).
+ **/
+char * cgi_header_end(char *s) {
+    char *lf   = strstr(s, "\n\n");
+    char *crlf = strstr(s, "\r\n\r\n");
+
+    if (crlf != NULL && (lf == NULL || crlf < lf)){
+        return crlf + 4;
+    }
+    if (lf != NULL){
+        return lf + 2;
+    }
+    return NULL;
+}
+
+/**
+ * Extract Content-Type from CGI header block.
+ *
+ * @param   s           Start of CGI header block.
+ * @param   end         End of CGI header block.
+ * @param   buffer      Buffer to store content type (empty if none).
+ * @param   size        Size of buffer.
+ **/
+void cgi_content_type(const char *s, const char *end, char *buffer, size_t size) {
+    buffer[0] = '\0';
+    for (const char *line = s; line < end; ){
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL){
+            eol = end;
+        }
+        if (strncasecmp(line, "Content-Type:", 13) == 0){
+            const char *value = line + 13;
+            while (value < eol && (*value == ' ' || *value == '\t')){
+                value++;
+            }
+            int length = eol - value;
+            if (length > 0 && value[length - 1] == '\r'){
+                length--;
+            }
+            snprintf(buffer, size, "%.*s", length, value);
+            return;
+        }
+        line = eol + 1;
+    }
+}
+
+/**
+ * Write HTTP status line and headers from CGI header block.
+ *
+ * @param   response    Response to write headers to.
+ * @param   s           Start of CGI header block.
+ * @param   end         End of CGI header block (first byte of body).
+ * @return  Status code written (e.g. 302).
+ *
+ * The status line is taken from the Status: header, or is 302 Found if only a
+ * Location: header is present, and 200 OK otherwise.  All other headers
+ * (including Content-Type:) are written with CRLF line endings.
+ **/
+int cgi_write_headers(Response *response, char *s, char *end) {
+    const char *status = "200 OK";
+    size_t      status_len = strlen(status);
+
+    /* Terminate each header line */
+    for (char *c = s; c < end; c++){
+        if (*c == '\r' || *c == '\n'){
+            *c = '\0';
+        }
+    }
+
+    /* Determine status line */
+    for (char *line = s; line < end; line += strlen(line) + 1){
+        if (strncasecmp(line, "Status:", 7) == 0){
+            status = skip_whitespace(line + 7);
+            status_len = strlen(status);
+            break;
+        }
+        if (strncasecmp(line, "Location:", 9) == 0){
+            status = "302 Found";
+            status_len = strlen(status);
+        }
+    }
+    if (status_len == 6 && strncmp(status, "200 OK", 6) == 0){
+        response_status(response, HTTP_STATUS_OK);
+    } else {
+        response_printf(response, "HTTP/1.0 %.*s\r\n", (int)status_len, status);
+        response_date(response);
+    }
+
+    /* Pass through remaining headers */
+    for (char *line = s; line < end; line += strlen(line) + 1){
+        if (*line == '\0' || strncasecmp(line, "Status:", 7) == 0){
+            continue;
+        }
+        response_printf(response, "%s\r\n", line);
+    }
+    response_printf(response, "\r\n");
+    return atoi(status);
+}
+
+/**
+ * Relay CGI output from pipe to socket.
+ *
+ * @param   in_fd       Read end of CGI output pipe.
+ * @param   out         Response to client (or cache entry), already flushed.
+ * @return  Number of bytes relayed (or -1 on error).
+ *
+ * This moves data with splice(2) in CGI_RELAY_CHUNK sized chunks, so output is
+ * never copied through user space and embedded NULs are preserved.  Since the
+ * socket is blocking, a slow client stalls the splice, which in turn fills the
+ * pipe and blocks the script: backpressure propagates all the way back.
+ *
+ * If the socket does not support splice(2), fall back to read(2)/write(2).
+ * TLS connections without kernel TLS fall back to read(2)/tls_write.
+ **/
+ssize_t cgi_relay(int in_fd, Response *out) {
+    char    buffer[BUFSIZ];
+    ssize_t nread;
+    ssize_t total = 0;
+
+    if (out->tls != NULL){
+        goto fallback;
+    }
+    while ((nread = splice(in_fd, NULL, out->fd, NULL, CGI_RELAY_CHUNK, SPLICE_F_MOVE|SPLICE_F_MORE)) != 0){
+        if (nread < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EINVAL){
+                goto fallback;
+            }
+            return -1;
+        }
+        total += nread;
+    }
+    out->more = out->socket;
+    return total;
+
+fallback:
+    while ((nread = read(in_fd, buffer, sizeof(buffer))) != 0){
+        if (nread < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if (out->tls != NULL){
+            struct iovec iov = {.iov_base = buffer, .iov_len = nread};
+            if (tls_write(out->tls, &iov, 1) < 0){
+                return -1;
+            }
+            total += nread;
+            continue;
+        }
+        for (char *p = buffer; nread > 0; ){
+            ssize_t nwritten = write(out->fd, p, nread);
+            if (nwritten < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                return -1;
+            }
+            p     += nwritten;
+            nread -= nwritten;
+            total += nwritten;
+        }
+    }
+    return total;
+}
+
+/**
+ * Stream request body to CGI script.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   out_fd      Write end of CGI input pipe.
+ * @return  Process id of feeder (or -1 on error).
+ *
+ * The body is copied in a separate process so that a script which writes
+ * output before consuming all of its input cannot deadlock against the relay.
+ * Only a single BUFSIZ buffer is ever used, regardless of body size.  The
+ * Content-Length was checked against MaxBodySize already, so the script only
+ * sees a truncated input if the client stops sending.
+ **/
+pid_t cgi_feed_body(Request *r, int out_fd) {
+    char    buffer[BUFSIZ];
+    ssize_t nread;
+    pid_t   pid;
+
+    pid = fork();
+    if (pid < 0){
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid > 0){
+        return pid;
+    }
+
+    while ((nread = read_request_body(r, buffer, sizeof(buffer))) > 0){
+        for (char *p = buffer; nread > 0; ){
+            ssize_t nwritten = write(out_fd, p, nread);
+            if (nwritten < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                _exit(EXIT_FAILURE);
+            }
+            p     += nwritten;
+            nread -= nwritten;
+        }
+    }
+    if (nread < 0){
+        fprintf(stderr, "read request body failed: %s\n", strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Spool chunked request body to temporary file.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      Pointer to store HTTP status on error.
+ * @return  Unlinked file positioned at the start of the body (or -1 on error).
+ *
+ * The length of a chunked body is only known once all of it has arrived, so
+ * it is decoded into a file first: a body over MaxBodySize is then refused
+ * with HTTP_STATUS_PAYLOAD_TOO_LARGE before the script runs, and the script
+ * gets its CONTENT_LENGTH like for any other body.
+ **/
+int cgi_spool_body(Request *r, HTTPStatus *status) {
+    char    buffer[BUFSIZ];
+    ssize_t nread;
+
+    int fd = open(P_tmpdir, O_TMPFILE | O_RDWR, 0600);
+    if (fd < 0){
+        fprintf(stderr, "open failed: %s\n", strerror(errno));
+        *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        return -1;
+    }
+
+    while ((nread = read_request_body(r, buffer, sizeof(buffer))) > 0){
+        for (char *p = buffer; nread > 0; ){
+            ssize_t nwritten = write(fd, p, nread);
+            if (nwritten < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                fprintf(stderr, "write failed: %s\n", strerror(errno));
+                *status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+                close(fd);
+                return -1;
+            }
+            p     += nwritten;
+            nread -= nwritten;
+        }
+    }
+    if (nread < 0){
+        fprintf(stderr, "read request body failed: %s\n", strerror(errno));
+        switch (errno){
+            case EFBIG:
+                *status = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+                break;
+            case ETIMEDOUT:
+                *status = HTTP_STATUS_REQUEST_TIMEOUT;
+                break;
+            default:
+                *status = HTTP_STATUS_BAD_REQUEST;
+                break;
+        }
+        close(fd);
+        return -1;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    r->content_length = r->body_read;
+    return fd;
+}
+
+/**
+ * Handle metrics request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP metrics request.
+ *
+ * This writes the server metrics in Prometheus text exposition format.
+ **/
+HTTPStatus  handle_metrics_request(Request *r) {
+    snprintf(r->content_type, sizeof(r->content_type), "text/plain; version=0.0.4");
+    response_status(&r->response, HTTP_STATUS_OK);
+    response_literal(&r->response, METRICS_CONTENT_TYPE "\r\n");
+    metrics_render(&r->response);
 
-    /* Close popen, flush socket, return OK */
-    fclose(pfs);
-    if (fflush(r->file) != 0){
+    if (response_flush(&r->response) < 0){
         fprintf(stderr, "flush socket failed: %s\n", strerror(errno));
         return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
@@ -279,15 +887,15 @@ HTTPStatus  handle_error(Request *r, HTTPStatus status) {
     const char *status_string = http_status_string(status);
 
     /* Write HTTP Header */
-    fprintf(r->file, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->file, "Content-Type: %s\r\n", "text/html");
-    fprintf(r->file, "\r\n");
+    snprintf(r->content_type, sizeof(r->content_type), "text/html");
+    response_status(&r->response, status);
+    response_literal(&r->response, HTML_CONTENT_TYPE "\r\n");
 
     /* Write HTML Description of Error*/
-    fprintf(r->file, "<h1>%s</h1>\r\n", status_string);
+    response_printf(&r->response, "<h1>%s</h1>\r\n", status_string);
 
     /* Return specified status */
-    if (fflush(r->file) != 0){
+    if (response_flush(&r->response) < 0){
         fprintf(stderr, "flush socket failed: %s\n", strerror(errno));
         return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
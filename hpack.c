@@ -0,0 +1,554 @@
+/* hpack.c: HPACK Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Constants */
+
+#define HPACK_STATIC_ENTRIES    61      /* Entries in static table */
+#define HPACK_ENTRY_OVERHEAD    32      /* Bytes counted per dynamic table entry */
+#define HPACK_HUFFMAN_BITS      30      /* Longest Huffman code (EOS) */
+#define HPACK_HUFFMAN_EOS       256     /* Symbol of end-of-string code */
+
+/* Static table (RFC 7541, Appendix A), indexed from 1 */
+
+static const char *StaticTable[HPACK_STATIC_ENTRIES + 1][2] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* Huffman code (RFC 7541, Appendix B).  The code is canonical, so it is
+ * described by the number of codes of each length and the symbols in code
+ * order (see hpack_huffman_decode). */
+
+static const uint16_t HuffmanCounts[HPACK_HUFFMAN_BITS + 1] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint16_t HuffmanSymbols[HPACK_HUFFMAN_EOS + 1] = {
+     48,  49,  50,  97,  99, 101, 105, 111, 115, 116,  32,  37,  45,  46,  47,  51,
+     52,  53,  54,  55,  56,  57,  61,  65,  95,  98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117,  58,  66,  67,  68,  69,  70,  71,  72,  73,  74,  75,  76,
+     77,  78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  89, 106, 107, 113, 118,
+    119, 120, 121, 122,  38,  42,  44,  59,  88,  90,  33,  34,  40,  41,  63,  39,
+     43, 124,  35,  62,   0,  36,  64,  91,  93, 126,  94, 125,  60,  96, 123,  92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233,   1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239,   9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+      2,   3,   4,   5,   6,   7,   8,  11,  12,  14,  15,  16,  17,  18,  19,  20,
+     21,  23,  24,  25,  26,  27,  28,  29,  30,  31, 127, 220, 249,  10,  13,  22,
+    256,
+};
+
+/* Internal Declarations */
+int         hpack_integer(const uint8_t **p, const uint8_t *end, int prefix, size_t *value);
+char *      hpack_string(const uint8_t **p, const uint8_t *end);
+ssize_t     hpack_huffman_decode(const uint8_t *data, size_t size, char *buffer);
+Header *    hpack_entry(HPACKTable *table, size_t index);
+void        hpack_insert(HPACKTable *table, const char *name, const char *value);
+void        hpack_evict(HPACKTable *table, size_t size);
+bool        hpack_count(size_t *size, size_t *fields, const char *name, const char *value);
+uint8_t *   hpack_put_integer(uint8_t *p, uint8_t *end, uint8_t flags, int prefix, size_t value);
+uint8_t *   hpack_put_string(uint8_t *p, uint8_t *end, const char *s);
+
+/**
+ * Initialize HPACK decoder table.
+ *
+ * @param   table       HPACK table.
+ **/
+void hpack_init(HPACKTable *table) {
+    memset(table, 0, sizeof(HPACKTable));
+    table->max_size = HPACK_TABLE_SIZE;
+}
+
+/**
+ * Release entries of HPACK decoder table.
+ *
+ * @param   table       HPACK table.
+ **/
+void hpack_free(HPACKTable *table) {
+    hpack_evict(table, 0);
+}
+
+/**
+ * Decode HPACK header block.
+ *
+ * @param   table       HPACK decoder table of the connection.
+ * @param   block       Header block (HEADERS and CONTINUATION fragments).
+ * @param   size        Size of header block.
+ * @param   headers     List to append decoded headers to.
+ * @return  -1 on error (a compression error), 1 if the header list is too
+ *          large, and 0 on success.
+ *
+ * Names and values are copied into newly allocated Header entries, in the
+ * order they appear in the block (pseudo-header fields such as :path
+ * included).  On error, the headers decoded so far are still on the list.
+ *
+ * Once the list exceeds HPACK_MAX_LIST_SIZE (counted as in RFC 9113, 6.5.2)
+ * or HPACK_MAX_FIELDS, the remaining fields are still decoded, to keep the
+ * table in sync with the client's encoder, but they are not copied.
+ **/
+int hpack_decode(HPACKTable *table, const uint8_t *block, size_t size, Header **headers) {
+    const uint8_t *p   = block;
+    const uint8_t *end = block + size;
+    Header **tail = headers;
+    size_t   list_size = 0;
+    size_t   fields    = 0;
+    int      status    = 0;
+
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+
+    while (p < end) {
+        size_t  index;
+        char   *name  = NULL;
+        char   *value = NULL;
+        bool    indexing = false;
+
+        if (*p & 0x80) {
+            /* Indexed header field */
+            if (hpack_integer(&p, end, 7, &index) < 0) {
+                return -1;
+            }
+            Header *entry = hpack_entry(table, index);
+            if (entry == NULL) {
+                return -1;
+            }
+            if (!hpack_count(&list_size, &fields, entry->name, entry->value)) {
+                status = 1;
+                continue;
+            }
+            name  = strdup(entry->name);
+            value = strdup(entry->value);
+        } else if ((*p & 0xe0) == 0x20) {
+            /* Dynamic table size update */
+            if (hpack_integer(&p, end, 5, &index) < 0 || index > HPACK_TABLE_SIZE) {
+                return -1;
+            }
+            table->max_size = index;
+            hpack_evict(table, table->max_size);
+            continue;
+        } else {
+            /* Literal header field (with incremental indexing, without
+             * indexing, or never indexed) */
+            indexing = (*p & 0xc0) == 0x40;
+            if (hpack_integer(&p, end, indexing ? 6 : 4, &index) < 0) {
+                return -1;
+            }
+            if (index > 0) {
+                Header *entry = hpack_entry(table, index);
+                if (entry == NULL) {
+                    return -1;
+                }
+                name = strdup(entry->name);
+            } else if ((name = hpack_string(&p, end)) == NULL) {
+                return -1;
+            }
+            if ((value = hpack_string(&p, end)) == NULL) {
+                free(name);
+                return -1;
+            }
+            if (!hpack_count(&list_size, &fields, name, value)) {
+                if (indexing) {
+                    hpack_insert(table, name, value);
+                }
+                free(name);
+                free(value);
+                status = 1;
+                continue;
+            }
+        }
+
+        Header *header = calloc(1, sizeof(Header));
+        if (header == NULL || name == NULL || value == NULL) {
+            fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+            free(header);
+            free(name);
+            free(value);
+            return -1;
+        }
+        if (indexing) {
+            hpack_insert(table, name, value);
+        }
+        header->name  = name;
+        header->value = value;
+        *tail = header;
+        tail  = &header->next;
+    }
+    return status;
+}
+
+/**
+ * Count header field against limits of header list.
+ *
+ * @param   size        Size of header list so far (updated).
+ * @param   fields      Number of fields so far (updated).
+ * @param   name        Field name.
+ * @param   value       Field value.
+ * @return  Whether the list is still within the limits.
+ **/
+bool hpack_count(size_t *size, size_t *fields, const char *name, const char *value) {
+    *size += strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+    return ++*fields <= HPACK_MAX_FIELDS && *size <= HPACK_MAX_LIST_SIZE;
+}
+
+/**
+ * Encode header field.
+ *
+ * @param   buffer      Buffer to encode header field into.
+ * @param   size        Size of buffer.
+ * @param   name        Header name (lowercase).
+ * @param   value       Header value.
+ * @return  Number of bytes encoded (0 if the buffer is too small).
+ *
+ * Fields in the static table (e.g. ":status: 200") are sent as an index.
+ * Everything else is a literal without indexing, with the name indexed when
+ * the static table has it, so the encoder needs no dynamic table.  Strings
+ * are not Huffman coded.
+ **/
+size_t hpack_encode(uint8_t *buffer, size_t size, const char *name, const char *value) {
+    uint8_t *p    = buffer;
+    uint8_t *end  = buffer + size;
+    size_t   name_index = 0;
+
+    for (size_t i = 1; i <= HPACK_STATIC_ENTRIES; i++) {
+        if (streq(StaticTable[i][0], name)) {
+            if (streq(StaticTable[i][1], value)) {
+                p = hpack_put_integer(p, end, 0x80, 7, i);
+                return p ? p - buffer : 0;
+            }
+            if (name_index == 0) {
+                name_index = i;
+            }
+        }
+    }
+
+    p = hpack_put_integer(p, end, 0x00, 4, name_index);
+    if (name_index == 0) {
+        p = hpack_put_string(p, end, name);
+    }
+    p = hpack_put_string(p, end, value);
+    return p ? p - buffer : 0;
+}
+
+/**
+ * Decode integer with prefix.
+ *
+ * @param   p           Pointer to current position (advanced past integer).
+ * @param   end         End of header block.
+ * @param   prefix      Number of bits of prefix (1 to 8).
+ * @param   value       Pointer to store value.
+ * @return  -1 on error (truncated or too large) and 0 on success.
+ **/
+int hpack_integer(const uint8_t **p, const uint8_t *end, int prefix, size_t *value) {
+    const uint8_t *s    = *p;
+    size_t         mask = (1 << prefix) - 1;
+
+    if (s >= end) {
+        return -1;
+    }
+    *value = *s++ & mask;
+    if (*value == mask) {
+        for (int shift = 0; ; shift += 7) {
+            if (s >= end || shift > 28) {
+                return -1;
+            }
+            *value += (size_t)(*s & 0x7f) << shift;
+            if (!(*s++ & 0x80)) {
+                break;
+            }
+        }
+    }
+    *p = s;
+    return 0;
+}
+
+/**
+ * Decode string literal.
+ *
+ * @param   p           Pointer to current position (advanced past string).
+ * @param   end         End of header block.
+ * @return  Newly allocated string (or NULL on error).
+ *
+ * Strings containing NUL are an error: names and values are kept as C
+ * strings, so the dynamic table could not account for them.
+ **/
+char *hpack_string(const uint8_t **p, const uint8_t *end) {
+    size_t length;
+    bool   huffman;
+    char  *s;
+
+    if (*p >= end) {
+        return NULL;
+    }
+    huffman = **p & 0x80;
+    if (hpack_integer(p, end, 7, &length) < 0 || length > (size_t)(end - *p)) {
+        return NULL;
+    }
+
+    if (huffman) {
+        /* Shortest code is 5 bits */
+        if ((s = malloc(length * 8 / 5 + 1)) == NULL) {
+            return NULL;
+        }
+        ssize_t decoded = hpack_huffman_decode(*p, length, s);
+        if (decoded < 0 || memchr(s, '\0', decoded) != NULL) {
+            free(s);
+            return NULL;
+        }
+        s[decoded] = '\0';
+    } else {
+        if (memchr(*p, '\0', length) != NULL) {
+            return NULL;
+        }
+        s = strndup((const char *)*p, length);
+    }
+    *p += length;
+    return s;
+}
+
+/**
+ * Decode Huffman coded string.
+ *
+ * @param   data        Huffman coded data.
+ * @param   size        Size of data.
+ * @param   buffer      Buffer of at least size * 8 / 5 bytes.
+ * @return  Number of bytes decoded (or -1 on error).
+ *
+ * Codes are matched a bit at a time: codes of each length are consecutive
+ * numbers, so a code of length len is valid if it is below the first code of
+ * that length plus the number of codes of that length.  The string may end
+ * with up to 7 bits of the EOS code as padding.
+ **/
+ssize_t hpack_huffman_decode(const uint8_t *data, size_t size, char *buffer) {
+    char     *s     = buffer;
+    uint32_t  code  = 0;        /* Bits of current code */
+    uint32_t  first = 0;        /* First code of current length */
+    uint32_t  index = 0;        /* Index of first code of current length */
+    int       len   = 0;        /* Length of current code */
+
+    for (size_t i = 0; i < size; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code |= (data[i] >> bit) & 1;
+            len++;
+            uint32_t count = HuffmanCounts[len];
+            if (code - first < count) {
+                uint16_t symbol = HuffmanSymbols[index + code - first];
+                if (symbol == HPACK_HUFFMAN_EOS) {
+                    return -1;
+                }
+                *s++  = symbol;
+                code  = first = index = 0;
+                len   = 0;
+                continue;
+            }
+            if (len == HPACK_HUFFMAN_BITS) {
+                return -1;
+            }
+            index += count;
+            first  = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+
+    /* Padding must be a prefix of EOS (all ones) and shorter than a byte */
+    if (len > 7 || (code >> 1) != (1u << len) - 1) {
+        return -1;
+    }
+    return s - buffer;
+}
+
+/**
+ * Look up entry of static or dynamic table.
+ *
+ * @param   table       HPACK table.
+ * @param   index       Index (1 to 61 are static, then newest dynamic first).
+ * @return  Header entry (or NULL if index is invalid).
+ **/
+Header *hpack_entry(HPACKTable *table, size_t index) {
+    static Header entry;
+
+    if (index == 0) {
+        return NULL;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        entry.name  = (char *)StaticTable[index][0];
+        entry.value = (char *)StaticTable[index][1];
+        return &entry;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= table->count) {
+        return NULL;
+    }
+    return &table->entries[(table->first + index) % HPACK_TABLE_ENTRIES];
+}
+
+/**
+ * Insert entry at front of dynamic table.
+ *
+ * @param   table       HPACK table.
+ * @param   name        Header name.
+ * @param   value       Header value.
+ *
+ * Older entries are evicted to make room; an entry larger than the whole
+ * table just empties it.
+ **/
+void hpack_insert(HPACKTable *table, const char *name, const char *value) {
+    size_t size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+
+    if (size > table->max_size) {
+        hpack_evict(table, 0);
+        return;
+    }
+    hpack_evict(table, table->max_size - size);
+
+    table->first = (table->first + HPACK_TABLE_ENTRIES - 1) % HPACK_TABLE_ENTRIES;
+    table->entries[table->first].name  = strdup(name);
+    table->entries[table->first].value = strdup(value);
+    table->count++;
+    table->size += size;
+}
+
+/**
+ * Evict oldest entries of dynamic table.
+ *
+ * @param   table       HPACK table.
+ * @param   size        Size to shrink table to.
+ **/
+void hpack_evict(HPACKTable *table, size_t size) {
+    while (table->count > 0 && table->size > size) {
+        Header *entry = &table->entries[(table->first + table->count - 1) % HPACK_TABLE_ENTRIES];
+        table->size -= strlen(entry->name) + strlen(entry->value) + HPACK_ENTRY_OVERHEAD;
+        free(entry->name);
+        free(entry->value);
+        entry->name  = NULL;
+        entry->value = NULL;
+        table->count--;
+    }
+}
+
+/**
+ * Encode integer with prefix.
+ *
+ * @param   p           Current position (NULL after an earlier overflow).
+ * @param   end         End of buffer.
+ * @param   flags       Bits above the prefix in the first byte.
+ * @param   prefix      Number of bits of prefix.
+ * @param   value       Value to encode.
+ * @return  Position after integer (or NULL if the buffer is too small).
+ **/
+uint8_t *hpack_put_integer(uint8_t *p, uint8_t *end, uint8_t flags, int prefix, size_t value) {
+    size_t mask = (1 << prefix) - 1;
+
+    if (p == NULL || p >= end) {
+        return NULL;
+    }
+    if (value < mask) {
+        *p++ = flags | value;
+        return p;
+    }
+    *p++   = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        if (p >= end) {
+            return NULL;
+        }
+        *p++    = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (p >= end) {
+        return NULL;
+    }
+    *p++ = value;
+    return p;
+}
+
+/**
+ * Encode string literal (without Huffman coding).
+ *
+ * @param   p           Current position (NULL after an earlier overflow).
+ * @param   end         End of buffer.
+ * @param   s           String to encode.
+ * @return  Position after string (or NULL if the buffer is too small).
+ **/
+uint8_t *hpack_put_string(uint8_t *p, uint8_t *end, const char *s) {
+    size_t length = strlen(s);
+
+    p = hpack_put_integer(p, end, 0x00, 7, length);
+    if (p == NULL || length > (size_t)(end - p)) {
+        return NULL;
+    }
+    memcpy(p, s, length);
+    return p + length;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,1563 @@
+/* http2.c: HTTP/2 Connections (RFC 9113) */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define H2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_HEADER     9           /* Bytes of frame header */
+#define H2_FRAME_SIZE       16384       /* SETTINGS_MAX_FRAME_SIZE (both ways) */
+#define H2_MAX_STREAMS      32          /* SETTINGS_MAX_CONCURRENT_STREAMS */
+#define H2_WINDOW           65535       /* Initial flow control window */
+#define H2_WINDOW_MAX       0x7fffffff  /* Largest flow control window */
+#define H2_BLOCK_SIZE       (1<<16)     /* Largest request header block */
+#define H2_OUTPUT_SIZE      (1<<16)     /* Frames buffered per write */
+
+#define H2_UPGRADE_RESPONSE "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
+static const char Base64URL[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* Request pseudo-header fields, and fields that are specific to an HTTP/1
+ * connection (RFC 9113, 8.2.2 and 8.3.1) */
+
+static const char *PseudoHeaders[] = {":method", ":scheme", ":authority", ":path"};
+static const char *ConnectionHeaders[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+
+/* Frame types, flags, settings and error codes */
+
+enum {
+    H2_DATA = 0, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+    H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION,
+};
+
+enum {
+    H2_FLAG_ACK         = 0x01,
+    H2_FLAG_END_STREAM  = 0x01,
+    H2_FLAG_END_HEADERS = 0x04,
+    H2_FLAG_PADDED      = 0x08,
+    H2_FLAG_PRIORITY    = 0x20,
+};
+
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1, H2_SETTINGS_ENABLE_PUSH, H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_SETTINGS_MAX_FRAME_SIZE, H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+enum {
+    H2_NO_ERROR = 0, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM,
+    H2_CANCEL, H2_COMPRESSION_ERROR, H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM,
+};
+
+/* Streams
+ *
+ * Each stream is served by a worker process that runs handle_request on a
+ * Request built from the stream's headers and body, and writes the usual
+ * HTTP/1 response into a pipe.  The connection relays it to the client as a
+ * HEADERS frame and DATA frames, as far as the flow control windows allow. */
+
+typedef struct {
+    uint32_t    id;                     /*< Stream identifier (0 if slot is free) */
+    Header     *headers;                /*< Request header fields (pseudo-headers included) */
+    char       *body;                   /*< Request body */
+    size_t      body_length;            /*< Bytes of request body received */
+    size_t      body_capacity;          /*< Bytes allocated for request body */
+    bool        oversized;              /*< Request body exceeded MaxBodySize */
+    bool        remote_closed;          /*< Client sent END_STREAM */
+    struct timespec start;              /*< Time request headers arrived */
+    bool        admitted;               /*< Holds an admission slot of its own */
+    pid_t       pid;                    /*< Worker process (0 until dispatched) */
+    int         fd;                     /*< Read end of worker's response pipe (-1 if none) */
+    bool        eof;                    /*< Worker's response is complete */
+    bool        headers_sent;           /*< Response HEADERS frame sent */
+    int64_t     window;                 /*< Send window */
+    int64_t     receive_window;         /*< Receive window (bytes the client may still send) */
+    size_t      buffered;               /*< Bytes of response in buffer */
+    char        buffer[H2_FRAME_SIZE];  /*< Response header block, then body data */
+} HTTP2Stream;
+
+typedef struct {
+    Request    *request;                /*< Connection (request that switched protocols) */
+    HPACKTable  decoder;                /*< Request header decoder */
+    HTTP2Stream streams[H2_MAX_STREAMS];/*< Open streams */
+    size_t      active;                 /*< Number of open streams */
+    size_t      opened;                 /*< Number of streams opened so far */
+    uint32_t    last_stream;            /*< Highest stream identifier received */
+    uint32_t    continuation;           /*< Stream whose header block is incomplete (0 if none) */
+    uint8_t     continuation_flags;     /*< Flags of HEADERS frame that started it */
+    struct timespec block_start;        /*< Time HEADERS frame of header block arrived */
+    struct timespec last_input;         /*< Time input last arrived from client */
+    uint8_t     block[H2_BLOCK_SIZE];   /*< Header block being received */
+    size_t      block_length;           /*< Bytes of header block received */
+    int64_t     window;                 /*< Connection send window */
+    int64_t     initial_window;         /*< Initial send window of streams */
+    int64_t     receive_window;         /*< Connection receive window */
+    int64_t     closed_window;          /*< Receive windows left by closed or refused streams */
+    bool        goaway;                 /*< GOAWAY sent or received (no new streams) */
+    const char *preface;                /*< Rest of client preface expected */
+    uint8_t     input[H2_FRAME_HEADER + H2_FRAME_SIZE];
+    size_t      input_length;           /*< Bytes of (partial) frames in input */
+    uint8_t     output[H2_OUTPUT_SIZE]; /*< Frames to write */
+    size_t      output_length;          /*< Bytes of frames to write */
+} HTTP2Connection;
+
+/* Internal Declarations */
+int             http2_receive(HTTP2Connection *c);
+uint32_t        http2_frame(HTTP2Connection *c, uint8_t type, uint8_t flags, uint32_t id, uint8_t *payload, size_t length);
+uint32_t        http2_headers(HTTP2Connection *c, uint32_t id, uint8_t flags);
+uint32_t        http2_data(HTTP2Connection *c, uint32_t id, uint8_t flags, uint8_t *payload, size_t length, size_t size);
+uint32_t        http2_settings(HTTP2Connection *c, const uint8_t *payload, size_t length);
+uint32_t        http2_window_update(HTTP2Connection *c, uint32_t id, const uint8_t *payload, size_t length);
+void            http2_write_frame(HTTP2Connection *c, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t length);
+void            http2_write_u32(HTTP2Connection *c, uint8_t type, uint32_t id, uint32_t value);
+void            http2_goaway(HTTP2Connection *c, uint32_t error);
+int             http2_flush(HTTP2Connection *c);
+int             http2_timeout(HTTP2Connection *c);
+int             http2_expire(HTTP2Connection *c);
+int64_t         http2_time_left(const struct timespec *start, int64_t allowed, const struct timespec *now);
+int64_t         http2_stream_time_left(HTTP2Stream *s, const struct timespec *now);
+HTTP2Stream *   http2_stream_open(HTTP2Connection *c, uint32_t id, Header *headers);
+HTTP2Stream *   http2_stream_find(HTTP2Connection *c, uint32_t id);
+void            http2_stream_reset(HTTP2Connection *c, HTTP2Stream *s, uint32_t error);
+void            http2_stream_error(HTTP2Connection *c, uint32_t id, uint8_t flags, HTTPStatus status);
+void            http2_stream_close(HTTP2Connection *c, HTTP2Stream *s, bool cancel);
+void            http2_stream_dispatch(HTTP2Connection *c, HTTP2Stream *s);
+Request *       http2_stream_request(HTTP2Connection *c, HTTP2Stream *s, int fd);
+void            http2_stream_relay(HTTP2Connection *c, HTTP2Stream *s);
+int             http2_stream_respond(HTTP2Connection *c, HTTP2Stream *s, char *end);
+void            http2_stream_send(HTTP2Connection *c, HTTP2Stream *s);
+int             http2_upgrade(HTTP2Connection *c);
+bool            http2_header_valid(Header *headers, bool trailers);
+char *          http2_header_end(char *s, size_t size);
+Header *        http2_header(Header **headers, const char *name, const char *value);
+void            http2_free_headers(Header *headers);
+
+/**
+ * Determine if request asks for HTTP/2.
+ *
+ * @param   r           Request structure (parsed).
+ * @return  Whether the request is the HTTP/2 connection preface (prior
+ *          knowledge, or h2 negotiated with ALPN) or an HTTP/1.1 request to
+ *          upgrade to h2c.
+ *
+ * Only requests without a body are upgraded, so the body never has to be
+ * carried over into the new connection.  TLS connections are not upgraded
+ * (h2c is cleartext only).
+ **/
+bool http2_requested(Request *r) {
+    bool upgrade  = false;
+    bool settings = false;
+
+    if (r->version == 20){
+        return streq(r->method, "PRI") && streq(r->uri, "*");
+    }
+    if (r->version != 11 || r->secure || request_has_body(r)){
+        return false;
+    }
+    for (Header *header = r->headers; header != NULL; header = header->next){
+        if (strcasecmp(header->name, "Upgrade") == 0){
+            upgrade = strcasestr(header->value, "h2c") != NULL;
+        } else if (strcasecmp(header->name, "HTTP2-Settings") == 0){
+            settings = true;
+        }
+    }
+    return upgrade && settings;
+}
+
+/**
+ * Serve HTTP/2 connection.
+ *
+ * @param   r           Request that switched protocols (see http2_requested).
+ * @return  HTTP_STATUS_OK (the streams are logged on their own).
+ *
+ * This runs the connection until the client closes it or goes away, the
+ * connection is idle for HeaderTimeout, or the server shuts down (after the
+ * open streams are complete).  Each stream's request is held to the read
+ * deadlines of HTTP/1 requests (see http2_expire).  Streams are served in parallel, each by its
+ * own worker process, so a slow stream does not hold up the others.
+ **/
+HTTPStatus http2_serve(Request *r) {
+    HTTP2Connection *c = calloc(1, sizeof(HTTP2Connection));
+    if (c == NULL){
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    c->request        = r;
+    c->window         = H2_WINDOW;
+    c->initial_window = H2_WINDOW;
+    c->receive_window = H2_WINDOW;
+    hpack_init(&c->decoder);
+    for (size_t i = 0; i < H2_MAX_STREAMS; i++){
+        c->streams[i].fd = -1;
+    }
+
+    /* Frames are gathered into one write per round already, and a stream's
+     * last (small) frame must not wait for the client's delayed ACK */
+    int nodelay = 1;
+    if (r->addr.ss_family != AF_UNIX && setsockopt(r->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0){
+        debug("setsockopt TCP_NODELAY failed: %s", strerror(errno));
+    }
+
+    /* Workers inherit the formatted client address */
+    request_host(r);
+    request_hostname(r);
+
+    /* Start connection: the preface's request line and empty line are
+     * already parsed, unless this is an upgrade */
+    c->preface = H2_PREFACE + strlen("PRI * HTTP/2.0\r\n\r\n");
+    if (r->version != 20){
+        c->preface = H2_PREFACE;
+        response_literal(&r->response, H2_UPGRADE_RESPONSE);
+    }
+    uint8_t settings[] = {
+        0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS,
+        0, H2_SETTINGS_MAX_HEADER_LIST_SIZE, 0, 0, HPACK_MAX_LIST_SIZE >> 8, HPACK_MAX_LIST_SIZE & 0xff,
+    };
+    http2_write_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    if (r->version != 20 && http2_upgrade(c) < 0){
+        http2_goaway(c, H2_PROTOCOL_ERROR);
+    }
+    debug("HTTP/2 connection from %s:%s", request_host(r), request_port(r));
+    clock_gettime(CLOCK_MONOTONIC, &c->last_input);
+
+    while (http2_flush(c) == 0){
+        struct pollfd pfds[H2_MAX_STREAMS + 1];
+        HTTP2Stream  *polled[H2_MAX_STREAMS + 1];
+        nfds_t        npfds = 0;
+
+        /* Stop taking new streams on shutdown, and finish once the open
+         * ones are complete */
+        if (Shutdown && !c->goaway){
+            http2_goaway(c, H2_NO_ERROR);
+            continue;
+        }
+        if (c->goaway && c->active == 0){
+            break;
+        }
+
+        /* Process frames already received */
+        if (c->input_length > 0){
+            int status = http2_receive(c);
+            if (status < 0){
+                break;
+            }
+            if (status > 0){
+                continue;
+            }
+        }
+
+        /* Wait for client frames and worker output */
+        pfds[npfds].fd     = r->fd;
+        pfds[npfds].events = POLLIN;
+        polled[npfds++]    = NULL;
+        for (size_t i = 0; i < H2_MAX_STREAMS; i++){
+            HTTP2Stream *s = &c->streams[i];
+            if (s->id && s->fd >= 0 && !s->eof && s->buffered < sizeof(s->buffer)){
+                pfds[npfds].fd     = s->fd;
+                pfds[npfds].events = POLLIN;
+                polled[npfds++]    = s;
+            }
+        }
+        /* Input read ahead by the HTTP/1 parser (or decrypted ahead) is
+         * taken before the socket is polled again */
+        bool pending = r->input_start < r->input_end || tls_pending(r);
+        int  ready   = poll(pfds, npfds, pending ? 0 : http2_timeout(c));
+        if (ready < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (ready == 0 && !pending){
+            if (http2_expire(c) < 0){
+                break;
+            }
+            continue;
+        }
+
+        for (nfds_t i = 1; i < npfds; i++){
+            if (pfds[i].revents){
+                http2_stream_relay(c, polled[i]);
+            }
+        }
+        if (pfds[0].revents || pending){
+            void   *input = c->input + c->input_length;
+            size_t  size  = sizeof(c->input) - c->input_length;
+            ssize_t nread = request_read(r, input, size);
+            if (nread < 0 && errno == EINTR){
+                continue;
+            }
+            if (nread <= 0){
+                break;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &c->last_input);
+            c->input_length += nread;
+            if (http2_receive(c) < 0){
+                break;
+            }
+        }
+
+        /* Send data that was waiting for window updates */
+        for (size_t i = 0; i < H2_MAX_STREAMS; i++){
+            if (c->streams[i].id && c->streams[i].buffered > 0){
+                http2_stream_send(c, &c->streams[i]);
+            }
+        }
+    }
+
+    /* Cancel streams left over (client gone or connection error) */
+    http2_flush(c);
+    for (size_t i = 0; i < H2_MAX_STREAMS; i++){
+        if (c->streams[i].id){
+            http2_stream_close(c, &c->streams[i], true);
+        }
+    }
+    hpack_free(&c->decoder);
+    free(c);
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Process frames in input buffer.
+ *
+ * @param   c           HTTP/2 connection.
+ * @return  -1 if the connection must be closed, 1 if frames were processed,
+ *          and 0 if more input is needed.
+ *
+ * On a connection error, GOAWAY is sent with the error code first.  A partial
+ * frame is kept at the start of the input buffer.
+ **/
+int http2_receive(HTTP2Connection *c) {
+    uint8_t *p   = c->input;
+    uint8_t *end = c->input + c->input_length;
+    int      processed = 0;
+
+    /* Match client preface */
+    while (*c->preface && p < end){
+        if (*p++ != (uint8_t)*c->preface++){
+            fprintf(stderr, "HTTP/2 client preface mismatch\n");
+            http2_goaway(c, H2_PROTOCOL_ERROR);
+            return -1;
+        }
+        processed = 1;
+    }
+
+    while (end - p >= H2_FRAME_HEADER){
+        size_t   length = (p[0] << 16) | (p[1] << 8) | p[2];
+        uint8_t  type   = p[3];
+        uint8_t  flags  = p[4];
+        uint32_t id     = ((p[5] << 24) | (p[6] << 16) | (p[7] << 8) | p[8]) & 0x7fffffff;
+
+        if (length > H2_FRAME_SIZE){
+            http2_goaway(c, H2_FRAME_SIZE_ERROR);
+            return -1;
+        }
+        if ((size_t)(end - p) < H2_FRAME_HEADER + length){
+            break;
+        }
+
+        uint32_t error = http2_frame(c, type, flags, id, p + H2_FRAME_HEADER, length);
+        if (error != H2_NO_ERROR){
+            fprintf(stderr, "HTTP/2 connection error %u (frame type %u)\n", error, type);
+            http2_goaway(c, error);
+            return -1;
+        }
+        p += H2_FRAME_HEADER + length;
+        processed = 1;
+    }
+
+    c->input_length = end - p;
+    memmove(c->input, p, c->input_length);
+    return processed;
+}
+
+/**
+ * Process frame.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   type        Frame type.
+ * @param   flags       Frame flags.
+ * @param   id          Stream identifier.
+ * @param   payload     Frame payload.
+ * @param   length      Length of payload.
+ * @return  Connection error code (H2_NO_ERROR to continue).
+ *
+ * Stream errors are handled here, by resetting the stream.  Frames of unknown
+ * type are ignored.
+ **/
+uint32_t http2_frame(HTTP2Connection *c, uint8_t type, uint8_t flags, uint32_t id, uint8_t *payload, size_t length) {
+    /* A header block must not be interrupted */
+    if (c->continuation && (type != H2_CONTINUATION || id != c->continuation)){
+        return H2_PROTOCOL_ERROR;
+    }
+
+    /* Strip padding (which still counts against flow control) */
+    size_t size = length;
+    if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_FLAG_PADDED)){
+        if (length < 1 || payload[0] >= length){
+            return H2_PROTOCOL_ERROR;
+        }
+        length -= 1 + payload[0];
+        payload++;
+    }
+
+    switch (type){
+        case H2_DATA:
+            return http2_data(c, id, flags, payload, length, size);
+
+        case H2_HEADERS:
+            if (id == 0 || (id & 1) == 0){
+                return H2_PROTOCOL_ERROR;
+            }
+            if (flags & H2_FLAG_PRIORITY){
+                if (length < 5){
+                    return H2_FRAME_SIZE_ERROR;
+                }
+                payload += 5;
+                length  -= 5;
+            }
+            c->block_length = 0;
+            clock_gettime(CLOCK_MONOTONIC, &c->block_start);
+            /* Fall through */
+        case H2_CONTINUATION:
+            if (type == H2_CONTINUATION && c->continuation == 0){
+                return H2_PROTOCOL_ERROR;
+            }
+            if (length > sizeof(c->block) - c->block_length){
+                return H2_COMPRESSION_ERROR;
+            }
+            memcpy(c->block + c->block_length, payload, length);
+            c->block_length += length;
+            if (type == H2_HEADERS){
+                c->continuation_flags = flags;
+            }
+            if (!(flags & H2_FLAG_END_HEADERS)){
+                c->continuation = id;
+                return H2_NO_ERROR;
+            }
+            c->continuation = 0;
+            return http2_headers(c, id, c->continuation_flags);
+
+        case H2_PRIORITY:
+            return length == 5 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+
+        case H2_RST_STREAM:
+            if (length != 4){
+                return H2_FRAME_SIZE_ERROR;
+            }
+            if (id == 0 || id > c->last_stream){
+                return H2_PROTOCOL_ERROR;
+            }
+            HTTP2Stream *s = http2_stream_find(c, id);
+            if (s != NULL){
+                debug("HTTP/2 stream %u reset by client", id);
+                http2_stream_close(c, s, true);
+            }
+            return H2_NO_ERROR;
+
+        case H2_SETTINGS:
+            if (id != 0){
+                return H2_PROTOCOL_ERROR;
+            }
+            if (flags & H2_FLAG_ACK){
+                return length == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+            }
+            uint32_t error = http2_settings(c, payload, length);
+            if (error == H2_NO_ERROR){
+                http2_write_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+            }
+            return error;
+
+        case H2_PING:
+            if (id != 0){
+                return H2_PROTOCOL_ERROR;
+            }
+            if (length != 8){
+                return H2_FRAME_SIZE_ERROR;
+            }
+            if (!(flags & H2_FLAG_ACK)){
+                http2_write_frame(c, H2_PING, H2_FLAG_ACK, 0, payload, length);
+            }
+            return H2_NO_ERROR;
+
+        case H2_GOAWAY:
+            if (id != 0){
+                return H2_PROTOCOL_ERROR;
+            }
+            c->goaway = true;
+            return H2_NO_ERROR;
+
+        case H2_WINDOW_UPDATE:
+            return http2_window_update(c, id, payload, length);
+
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR;
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Process complete request header block.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   id          Stream identifier.
+ * @param   flags       Flags of HEADERS frame.
+ * @return  Connection error code (H2_NO_ERROR to continue).
+ *
+ * A header block opens a new stream, or carries trailers that end the request
+ * body of an open one (they are decoded, but dropped).  The block is decoded
+ * even if the stream is refused, to keep the decoder table in sync.  A
+ * request whose header list is over the advertised limit is answered with
+ * 431 right away, and a malformed one (see http2_header_valid) is reset with
+ * PROTOCOL_ERROR.
+ **/
+uint32_t http2_headers(HTTP2Connection *c, uint32_t id, uint8_t flags) {
+    Header *headers = NULL;
+
+    int decoded = hpack_decode(&c->decoder, c->block, c->block_length, &headers);
+    if (decoded < 0){
+        http2_free_headers(headers);
+        return H2_COMPRESSION_ERROR;
+    }
+
+    /* Trailers */
+    HTTP2Stream *s = http2_stream_find(c, id);
+    if (s != NULL){
+        bool valid = http2_header_valid(headers, true);
+        http2_free_headers(headers);
+        if (s->remote_closed || !(flags & H2_FLAG_END_STREAM)){
+            return H2_PROTOCOL_ERROR;
+        }
+        if (!valid){
+            http2_stream_reset(c, s, H2_PROTOCOL_ERROR);
+            return H2_NO_ERROR;
+        }
+        s->remote_closed = true;
+        if (!s->oversized){
+            http2_stream_dispatch(c, s);
+        }
+        return H2_NO_ERROR;
+    }
+    if (id <= c->last_stream){
+        http2_free_headers(headers);
+        return H2_STREAM_CLOSED;
+    }
+    c->last_stream = id;
+
+    /* Data the client sends before it learns the stream was refused is
+     * bounded by the stream's window (see http2_data) */
+    if (!(flags & H2_FLAG_END_STREAM)){
+        c->closed_window += H2_WINDOW;
+    }
+
+    /* New stream */
+    if (c->goaway){
+        http2_free_headers(headers);
+        return H2_NO_ERROR;
+    }
+    if (decoded > 0){
+        fprintf(stderr, "HTTP/2 stream %u header list too large\n", id);
+        http2_free_headers(headers);
+        http2_stream_error(c, id, flags, HTTP_STATUS_HEADERS_TOO_LARGE);
+        return H2_NO_ERROR;
+    }
+    if (!http2_header_valid(headers, false)){
+        fprintf(stderr, "HTTP/2 stream %u malformed header list\n", id);
+        http2_free_headers(headers);
+        http2_write_u32(c, H2_RST_STREAM, id, H2_PROTOCOL_ERROR);
+        return H2_NO_ERROR;
+    }
+    if ((s = http2_stream_open(c, id, headers)) == NULL){
+        return H2_NO_ERROR;
+    }
+    if (flags & H2_FLAG_END_STREAM){
+        s->remote_closed = true;
+        http2_stream_dispatch(c, s);
+    } else {
+        c->closed_window -= H2_WINDOW;
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Process DATA frame.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   id          Stream identifier.
+ * @param   flags       Frame flags.
+ * @param   payload     Data (without padding).
+ * @param   length      Length of data.
+ * @param   size        Length of frame payload (counted by flow control).
+ * @return  Connection error code (H2_NO_ERROR to continue).
+ *
+ * The request body is collected until END_STREAM, then the stream is
+ * dispatched.  The stream window is credited back only for data that was
+ * buffered, so the body is bounded by MaxBodySize; a body beyond it is
+ * dropped, the worker answers 413, and the stream's window is left to run
+ * out.  The connection window is credited for every frame (as RFC 9113
+ * requires it to be accounted), since data discarded for a stream is already
+ * bounded by that stream's window.
+ *
+ * Both receive windows are enforced: a frame larger than what is left of
+ * either is a FLOW_CONTROL_ERROR, so a client that ignores flow control
+ * cannot stream past them.  Data for streams that were closed or refused
+ * before the client finished sending is still accepted (and credited to
+ * the connection), but only as much as their windows left it (see
+ * http2_stream_close).
+ **/
+uint32_t http2_data(HTTP2Connection *c, uint32_t id, uint8_t flags, uint8_t *payload, size_t length, size_t size) {
+    if (id == 0){
+        return H2_PROTOCOL_ERROR;
+    }
+    if ((int64_t)size > c->receive_window){
+        return H2_FLOW_CONTROL_ERROR;
+    }
+    c->receive_window -= size;
+    if (size > 0){
+        http2_write_u32(c, H2_WINDOW_UPDATE, 0, size);
+        c->receive_window += size;
+    }
+
+    HTTP2Stream *s = http2_stream_find(c, id);
+    if (s == NULL || s->remote_closed){
+        if (id > c->last_stream){
+            return H2_PROTOCOL_ERROR;
+        }
+        if ((int64_t)size > c->closed_window){
+            return H2_FLOW_CONTROL_ERROR;
+        }
+        c->closed_window -= size;
+        http2_write_u32(c, H2_RST_STREAM, id, H2_STREAM_CLOSED);
+        return H2_NO_ERROR;
+    }
+    if ((int64_t)size > s->receive_window){
+        return H2_FLOW_CONTROL_ERROR;
+    }
+    s->receive_window -= size;
+
+    if (!s->oversized && s->body_length + length > MaxBodySize){
+        s->oversized = true;
+        http2_stream_dispatch(c, s);
+    }
+    if (!s->oversized && length > 0){
+        if (s->body_length + length > s->body_capacity){
+            size_t capacity = s->body_capacity ? s->body_capacity : BUFSIZ;
+            while (capacity < s->body_length + length){
+                capacity *= 2;
+            }
+            char *body = realloc(s->body, capacity);
+            if (body == NULL){
+                fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+                http2_stream_reset(c, s, H2_INTERNAL_ERROR);
+                return H2_NO_ERROR;
+            }
+            s->body          = body;
+            s->body_capacity = capacity;
+        }
+        memcpy(s->body + s->body_length, payload, length);
+        s->body_length += length;
+    }
+
+    if (flags & H2_FLAG_END_STREAM){
+        s->remote_closed = true;
+        if (!s->oversized){
+            http2_stream_dispatch(c, s);
+        }
+    } else if (!s->oversized && size > 0){
+        http2_write_u32(c, H2_WINDOW_UPDATE, id, size);
+        s->receive_window += size;
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Apply client settings.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   payload     Settings (SETTINGS payload or decoded HTTP2-Settings).
+ * @param   length      Length of settings.
+ * @return  Connection error code (H2_NO_ERROR to continue).
+ *
+ * Only the initial window size affects this side: responses are sent in
+ * frames of the default size and without compression state.
+ **/
+uint32_t http2_settings(HTTP2Connection *c, const uint8_t *payload, size_t length) {
+    if (length % 6){
+        return H2_FRAME_SIZE_ERROR;
+    }
+    for (const uint8_t *p = payload; p < payload + length; p += 6){
+        uint16_t identifier = (p[0] << 8) | p[1];
+        uint32_t value      = ((uint32_t)p[2] << 24) | (p[3] << 16) | (p[4] << 8) | p[5];
+
+        switch (identifier){
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1){
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_WINDOW_MAX){
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                for (size_t i = 0; i < H2_MAX_STREAMS; i++){
+                    if (c->streams[i].id){
+                        int64_t delta = (int64_t)value - c->initial_window;
+                        if (c->streams[i].window + delta > H2_WINDOW_MAX){
+                            return H2_FLOW_CONTROL_ERROR;
+                        }
+                        c->streams[i].window += delta;
+                    }
+                }
+                c->initial_window = value;
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_FRAME_SIZE || value > 0xffffff){
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Process WINDOW_UPDATE frame.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   id          Stream identifier (0 for the connection).
+ * @param   payload     Frame payload.
+ * @param   length      Length of payload.
+ * @return  Connection error code (H2_NO_ERROR to continue).
+ **/
+uint32_t http2_window_update(HTTP2Connection *c, uint32_t id, const uint8_t *payload, size_t length) {
+    if (length != 4){
+        return H2_FRAME_SIZE_ERROR;
+    }
+    uint32_t increment = (((uint32_t)payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3]) & 0x7fffffff;
+
+    if (id == 0){
+        if (increment == 0){
+            return H2_PROTOCOL_ERROR;
+        }
+        c->window += increment;
+        return c->window > H2_WINDOW_MAX ? H2_FLOW_CONTROL_ERROR : H2_NO_ERROR;
+    }
+
+    HTTP2Stream *s = http2_stream_find(c, id);
+    if (s == NULL){
+        return id > c->last_stream ? H2_PROTOCOL_ERROR : H2_NO_ERROR;
+    }
+    if (increment == 0){
+        http2_stream_reset(c, s, H2_PROTOCOL_ERROR);
+    } else if ((s->window += increment) > H2_WINDOW_MAX){
+        http2_stream_reset(c, s, H2_FLOW_CONTROL_ERROR);
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Queue frame for writing.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   type        Frame type.
+ * @param   flags       Frame flags.
+ * @param   id          Stream identifier.
+ * @param   payload     Frame payload.
+ * @param   length      Length of payload (at most H2_FRAME_SIZE).
+ **/
+void http2_write_frame(HTTP2Connection *c, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t length) {
+    if (c->output_length + H2_FRAME_HEADER + length > sizeof(c->output)){
+        http2_flush(c);
+    }
+
+    uint8_t *p = c->output + c->output_length;
+    p[0] = length >> 16;
+    p[1] = length >> 8;
+    p[2] = length;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = id >> 24;
+    p[6] = id >> 16;
+    p[7] = id >> 8;
+    p[8] = id;
+    if (length > 0){
+        memcpy(p + H2_FRAME_HEADER, payload, length);
+    }
+    c->output_length += H2_FRAME_HEADER + length;
+}
+
+/**
+ * Queue frame whose payload is a single 32-bit value.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   type        Frame type (H2_WINDOW_UPDATE or H2_RST_STREAM).
+ * @param   id          Stream identifier.
+ * @param   value       Window increment or error code.
+ **/
+void http2_write_u32(HTTP2Connection *c, uint8_t type, uint32_t id, uint32_t value) {
+    uint8_t payload[4] = {value >> 24, value >> 16, value >> 8, value};
+    http2_write_frame(c, type, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * Queue GOAWAY frame.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   error       Error code (H2_NO_ERROR for a graceful close).
+ *
+ * Streams up to the last one received are still served.
+ **/
+void http2_goaway(HTTP2Connection *c, uint32_t error) {
+    uint32_t last = c->last_stream;
+    uint8_t  payload[8] = {last >> 24, last >> 16, last >> 8, last, error >> 24, error >> 16, error >> 8, error};
+
+    http2_write_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->goaway = true;
+}
+
+/**
+ * Write queued frames to client.
+ *
+ * @param   c           HTTP/2 connection.
+ * @return  -1 on error and 0 on success.
+ **/
+int http2_flush(HTTP2Connection *c) {
+    Response *response = &c->request->response;
+
+    if (c->output_length > 0){
+        response_append(response, c->output, c->output_length);
+        c->output_length = 0;
+    }
+    if (response_flush(response) < 0){
+        return -1;
+    }
+    socket_uncork(c->request->fd, c->request->addr.ss_family);
+    return 0;
+}
+
+/**
+ * Determine how long to wait for input.
+ *
+ * @param   c           HTTP/2 connection.
+ * @return  Milliseconds until the next read deadline (-1 if there is none).
+ **/
+int http2_timeout(HTTP2Connection *c) {
+    struct timespec now;
+    int64_t timeout = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (HeaderTimeout && c->continuation){
+        timeout = http2_time_left(&c->block_start, HeaderTimeout * 1000000LL, &now);
+    } else if (HeaderTimeout && c->active == 0){
+        timeout = http2_time_left(&c->last_input, HeaderTimeout * 1000000LL, &now);
+    }
+    for (size_t i = 0; i < H2_MAX_STREAMS; i++){
+        int64_t left = http2_stream_time_left(&c->streams[i], &now);
+        if (left >= 0 && (timeout < 0 || left < timeout)){
+            timeout = left;
+        }
+    }
+    return timeout;
+}
+
+/**
+ * Enforce read deadlines.
+ *
+ * @param   c           HTTP/2 connection.
+ * @return  -1 if the connection must be closed, and 0 otherwise.
+ *
+ * A header block must be complete within HeaderTimeout of its HEADERS frame;
+ * otherwise the connection is closed with GOAWAY, since no other frame may
+ * arrive before the block ends.  A request body must start within
+ * BodyTimeout of the headers and then sustain MinBodyRate, or else the stream
+ * is reset with CANCEL.  A connection without streams that receives nothing
+ * for HeaderTimeout is sent GOAWAY.
+ **/
+int http2_expire(HTTP2Connection *c) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (HeaderTimeout && c->continuation && http2_time_left(&c->block_start, HeaderTimeout * 1000000LL, &now) == 0){
+        fprintf(stderr, "HTTP/2 header block timed out: %s:%s\n", request_host(c->request), request_port(c->request));
+        http2_goaway(c, H2_ENHANCE_YOUR_CALM);
+        return -1;
+    }
+    for (size_t i = 0; i < H2_MAX_STREAMS; i++){
+        HTTP2Stream *s = &c->streams[i];
+        if (http2_stream_time_left(s, &now) == 0){
+            fprintf(stderr, "HTTP/2 stream %u request body timed out: %s:%s\n", s->id, request_host(c->request), request_port(c->request));
+            http2_stream_reset(c, s, H2_CANCEL);
+        }
+    }
+    if (HeaderTimeout && c->active == 0 && !c->goaway && http2_time_left(&c->last_input, HeaderTimeout * 1000000LL, &now) == 0){
+        debug("HTTP/2 connection idle: %s:%s", request_host(c->request), request_port(c->request));
+        http2_goaway(c, H2_NO_ERROR);
+    }
+    return 0;
+}
+
+/**
+ * Compute time left until deadline.
+ *
+ * @param   start       Start of the allowed time.
+ * @param   allowed     Time allowed (nanoseconds).
+ * @param   now         Current time.
+ * @return  Milliseconds left (rounded up, 0 once the deadline has passed).
+ **/
+int64_t http2_time_left(const struct timespec *start, int64_t allowed, const struct timespec *now) {
+    int64_t elapsed = (now->tv_sec - start->tv_sec) * 1000000000LL + (now->tv_nsec - start->tv_nsec);
+    return elapsed >= allowed ? 0 : (allowed - elapsed + 999999) / 1000000;
+}
+
+/**
+ * Compute time left to receive request body of stream.
+ *
+ * @param   s           Stream.
+ * @param   now         Current time.
+ * @return  Milliseconds left (0 once the deadline has passed, -1 if the
+ *          stream is not receiving a body or BodyTimeout is disabled).
+ *
+ * Like request_receive, every byte received pushes the deadline back by
+ * 1/MinBodyRate seconds.
+ **/
+int64_t http2_stream_time_left(HTTP2Stream *s, const struct timespec *now) {
+    if (BodyTimeout == 0 || s->id == 0 || s->pid != 0 || s->remote_closed){
+        return -1;
+    }
+
+    int64_t allowed = BodyTimeout * 1000000LL;
+    if (MinBodyRate > 0){
+        allowed += s->body_length * 1000000000LL / MinBodyRate;
+    }
+    return http2_time_left(&s->start, allowed, now);
+}
+
+/**
+ * Open stream.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   id          Stream identifier.
+ * @param   headers     Request header fields (owned by the stream from now on).
+ * @return  Stream (or NULL if it was refused).
+ *
+ * Streams beyond SETTINGS_MAX_CONCURRENT_STREAMS are refused, and so are
+ * requests without :method or :path (which includes CONNECT).
+ *
+ * Streams are also subject to rate limiting and admission control, like
+ * connections: the connection's own token covers its first stream, and its
+ * admission slot covers one open stream.  Streams over the client's rate
+ * (429) or the in-flight limit (503) are refused with REFUSED_STREAM, so the
+ * client may retry them.
+ **/
+HTTP2Stream *http2_stream_open(HTTP2Connection *c, uint32_t id, Header *headers) {
+    HTTP2Stream *s      = NULL;
+    bool         method = false;
+    bool         path   = false;
+
+    for (Header *header = headers; header != NULL; header = header->next){
+        method |= streq(header->name, ":method");
+        path   |= streq(header->name, ":path") && header->value[0] == '/';
+    }
+    if (!method || !path){
+        http2_free_headers(headers);
+        http2_write_u32(c, H2_RST_STREAM, id, H2_PROTOCOL_ERROR);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < H2_MAX_STREAMS && s == NULL; i++){
+        if (c->streams[i].id == 0){
+            s = &c->streams[i];
+        }
+    }
+    if (s == NULL){
+        http2_free_headers(headers);
+        http2_write_u32(c, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+        return NULL;
+    }
+
+    HTTPStatus refusal = HTTP_STATUS_OK;
+    if (c->opened > 0 && !ratelimit_admit(c->request)){
+        refusal = HTTP_STATUS_TOO_MANY_REQUESTS;
+    } else if (c->active > 0 && !admission_admit(c->request)){
+        refusal = HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
+    c->opened++;
+    if (refusal != HTTP_STATUS_OK){
+        debug("HTTP/2 stream %u refused: %s", id, http_status_string(refusal));
+        http2_free_headers(headers);
+        http2_write_u32(c, H2_RST_STREAM, id, H2_REFUSED_STREAM);
+        metrics_request(http_status_code(refusal), METRICS_HANDLER_ERROR);
+        return NULL;
+    }
+    s->admitted          = c->request->admitted;
+    c->request->admitted = false;
+
+    s->id             = id;
+    s->headers        = headers;
+    s->body           = NULL;
+    s->body_length    = 0;
+    s->body_capacity  = 0;
+    s->oversized      = false;
+    s->remote_closed  = false;
+    s->pid            = 0;
+    s->fd             = -1;
+    s->eof            = false;
+    s->headers_sent   = false;
+    s->window         = c->initial_window;
+    s->receive_window = H2_WINDOW;
+    s->buffered       = 0;
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    c->active++;
+    return s;
+}
+
+/**
+ * Find open stream.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   id          Stream identifier.
+ * @return  Stream (or NULL if it is not open).
+ **/
+HTTP2Stream *http2_stream_find(HTTP2Connection *c, uint32_t id) {
+    for (size_t i = 0; i < H2_MAX_STREAMS; i++){
+        if (c->streams[i].id == id && id != 0){
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Reset stream.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   s           Stream.
+ * @param   error       Error code.
+ **/
+void http2_stream_reset(HTTP2Connection *c, HTTP2Stream *s, uint32_t error) {
+    debug("HTTP/2 stream %u reset: error %u", s->id, error);
+    http2_write_u32(c, H2_RST_STREAM, s->id, error);
+    http2_stream_close(c, s, true);
+}
+
+/**
+ * Answer request with error status (without opening a stream).
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   id          Stream identifier.
+ * @param   flags       Flags of request HEADERS frame.
+ * @param   status      Response status.
+ *
+ * The response has no body.  If the client has more of the request to send,
+ * the stream is then reset with NO_ERROR, so it stops sending.
+ **/
+void http2_stream_error(HTTP2Connection *c, uint32_t id, uint8_t flags, HTTPStatus status) {
+    uint8_t block[16];
+    char    code[4];
+
+    snprintf(code, sizeof(code), "%s", http_status_string(status));
+    size_t length = hpack_encode(block, sizeof(block), ":status", code);
+    http2_write_frame(c, H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, id, block, length);
+    if (!(flags & H2_FLAG_END_STREAM)){
+        http2_write_u32(c, H2_RST_STREAM, id, H2_NO_ERROR);
+    }
+    metrics_request(http_status_code(status), METRICS_HANDLER_ERROR);
+}
+
+/**
+ * Close stream.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   s           Stream.
+ * @param   cancel      Kill the worker instead of waiting for it.
+ *
+ * If the client has not finished sending, what is left of the stream's
+ * receive window may still arrive (see http2_data).
+ **/
+void http2_stream_close(HTTP2Connection *c, HTTP2Stream *s, bool cancel) {
+    if (s->fd >= 0){
+        close(s->fd);
+    }
+    if (s->pid > 0){
+        if (cancel){
+            kill(s->pid, SIGKILL);
+        }
+        while (waitpid(s->pid, NULL, 0) < 0 && errno == EINTR);
+    }
+    if (s->admitted){
+        admission_finish(&s->start);
+        s->admitted = false;
+    }
+    if (!s->remote_closed){
+        c->closed_window += s->receive_window;
+    }
+    http2_free_headers(s->headers);
+    free(s->body);
+    s->id      = 0;
+    s->headers = NULL;
+    s->body    = NULL;
+    s->fd      = -1;
+    s->pid     = 0;
+    c->active--;
+}
+
+/**
+ * Start worker process for stream.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   s           Stream (request complete, or body oversized).
+ *
+ * The worker handles the request like any other, writing its response to a
+ * pipe, and exits.  It dies with the connection's process.
+ **/
+void http2_stream_dispatch(HTTP2Connection *c, HTTP2Stream *s) {
+    int pfd[2];
+
+    if (pipe2(pfd, O_CLOEXEC) < 0){
+        fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+        http2_stream_reset(c, s, H2_INTERNAL_ERROR);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0){
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        close(pfd[0]);
+        close(pfd[1]);
+        http2_stream_reset(c, s, H2_REFUSED_STREAM);
+        return;
+    }
+    if (pid == 0){
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        close(pfd[0]);
+        Request *r = http2_stream_request(c, s, pfd[1]);
+        if (r != NULL){
+            handle_request(r);
+        }
+        _exit(r != NULL ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(pfd[1]);
+    s->pid = pid;
+    s->fd  = pfd[0];
+    debug("HTTP/2 stream %u dispatched to %d", s->id, pid);
+}
+
+/**
+ * Build request of stream (in its worker).
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   s           Stream.
+ * @param   fd          Write end of response pipe.
+ * @return  Parsed request (or NULL on error).
+ *
+ * The pseudo-header fields become the method, URI and query, :authority
+ * becomes the Host header, and the remaining names are capitalized the way
+ * HTTP/1 clients send them (e.g. User-Agent), as the handlers compare them
+ * exactly.  The body is read from memory.  The client socket stays the
+ * request's descriptor (for SERVER_PORT), but is never read or written (nor
+ * is its TLS connection, which only tells the handlers it is secure).
+ **/
+Request *http2_stream_request(HTTP2Connection *c, HTTP2Stream *s, int fd) {
+    Request *r = calloc(1, sizeof(Request));
+    if (r == NULL){
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    r->fd             = c->request->fd;
+    r->secure         = c->request->secure;
+    r->tls            = c->request->tls;
+    r->addr           = c->request->addr;
+    r->version        = 20;
+    r->start          = s->start;
+    r->content_length = -1;
+    memcpy(r->host, c->request->host, sizeof(r->host));
+    memcpy(r->port, c->request->port, sizeof(r->port));
+    memcpy(r->hostname, c->request->hostname, sizeof(r->hostname));
+    response_init(&r->response, fd, false);
+
+    Header **tail = &r->headers;
+    for (Header *header = s->headers; header != NULL; header = header->next){
+        if (streq(header->name, ":method")){
+            r->method = strdup(header->value);
+        } else if (streq(header->name, ":path")){
+            char *query = strchr(header->value, '?');
+            r->uri = strndup(header->value, query ? (size_t)(query - header->value) : strlen(header->value));
+            if (query != NULL){
+                r->query = strdup(query + 1);
+            }
+        } else if (streq(header->name, ":authority")){
+            *tail = http2_header(NULL, "Host", header->value);
+        } else if (header->name[0] != ':'){
+            *tail = http2_header(NULL, header->name, header->value);
+            for (char *p = (*tail)->name; *p; p++){
+                *p = (p == (*tail)->name || p[-1] == '-') ? toupper(*p) : *p;
+            }
+        }
+        if (*tail != NULL){
+            tail = &(*tail)->next;
+        }
+    }
+
+    /* An oversized body is not kept: its length is enough for a 413 */
+    if (s->oversized){
+        r->content_length = MaxBodySize + 1;
+    } else if (s->body_length > 0){
+        r->content_length = s->body_length;
+        r->input          = s->body;
+        r->input_end      = s->body_length;
+    }
+    r->input_closed = true;
+    r->body_done    = r->input_end == 0;
+    return r;
+}
+
+/**
+ * Read worker output of stream.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   s           Stream (worker output ready).
+ *
+ * The HTTP/1 header block is turned into a HEADERS frame once it is
+ * complete; the rest is sent as DATA frames.
+ **/
+void http2_stream_relay(HTTP2Connection *c, HTTP2Stream *s) {
+    ssize_t nread = read(s->fd, s->buffer + s->buffered, sizeof(s->buffer) - s->buffered);
+    if (nread < 0 && (errno == EINTR || errno == EAGAIN)){
+        return;
+    }
+    if (nread <= 0){
+        s->eof = true;
+    } else {
+        s->buffered += nread;
+    }
+
+    if (!s->headers_sent){
+        char *end = http2_header_end(s->buffer, s->buffered);
+        if (end == NULL){
+            if (s->eof || s->buffered == sizeof(s->buffer)){
+                fprintf(stderr, "HTTP/2 stream %u: response header block missing\n", s->id);
+                http2_stream_reset(c, s, H2_INTERNAL_ERROR);
+            }
+            return;
+        }
+        if (http2_stream_respond(c, s, end) < 0){
+            http2_stream_reset(c, s, H2_INTERNAL_ERROR);
+            return;
+        }
+    }
+    http2_stream_send(c, s);
+}
+
+/**
+ * Send response headers of stream.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   s           Stream.
+ * @param   end         End of HTTP/1 header block in stream buffer.
+ * @return  -1 on error and 0 on success.
+ *
+ * The status code comes from the status line (of the handlers or of a
+ * non-parsed header CGI script), header names are lowercased,
+ * and connection-specific headers are dropped.  The header block is removed
+ * from the stream buffer.
+ **/
+int http2_stream_respond(HTTP2Connection *c, HTTP2Stream *s, char *end) {
+    uint8_t block[H2_FRAME_SIZE];
+    size_t  length = 0;
+    size_t  encoded;
+    char   *next;
+
+    for (char *line = s->buffer; line < end; line = next + 1){
+        /* Every line of the block ends with LF (CRLF from the handlers) */
+        next = memchr(line, '\n', end - line);
+        *next = '\0';
+        if (next > line && next[-1] == '\r'){
+            next[-1] = '\0';
+        }
+        if (*line == '\0'){
+            break;
+        }
+
+        /* Status line */
+        if (line == s->buffer){
+            char *code = skip_whitespace(skip_nonwhitespace(line));
+            if (strncmp(line, "HTTP/", 5) != 0 || !isdigit(code[0]) || !isdigit(code[1]) || !isdigit(code[2])){
+                fprintf(stderr, "HTTP/2 stream %u: bad status line\n", s->id);
+                return -1;
+            }
+            code[3] = '\0';
+            if ((encoded = hpack_encode(block, sizeof(block), ":status", code)) == 0){
+                return -1;
+            }
+            length += encoded;
+            continue;
+        }
+
+        /* Header fields */
+        char *value = strchr(line, ':');
+        if (value == NULL){
+            continue;
+        }
+        *value++ = '\0';
+        value = skip_whitespace(value);
+        for (char *p = line; *p; p++){
+            *p = tolower(*p);
+        }
+        if (streq(line, "connection") || streq(line, "keep-alive") || streq(line, "proxy-connection") ||
+            streq(line, "transfer-encoding") || streq(line, "upgrade")){
+            continue;
+        }
+        if ((encoded = hpack_encode(block + length, sizeof(block) - length, line, value)) == 0){
+            return -1;
+        }
+        length += encoded;
+    }
+
+    /* Body so far */
+    s->buffered -= end - s->buffer;
+    memmove(s->buffer, end, s->buffered);
+    s->headers_sent = true;
+
+    bool last = s->eof && s->buffered == 0;
+    http2_write_frame(c, H2_HEADERS, H2_FLAG_END_HEADERS | (last ? H2_FLAG_END_STREAM : 0), s->id, block, length);
+    return 0;
+}
+
+/**
+ * Send buffered response data of stream.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   s           Stream (response headers sent).
+ *
+ * Data is sent as far as the stream and connection windows allow; the rest
+ * waits for WINDOW_UPDATE.  Once the worker's response is complete and
+ * sent, the stream ends (and is reset if the client is still sending a body
+ * no one will read).
+ **/
+void http2_stream_send(HTTP2Connection *c, HTTP2Stream *s) {
+    while (s->buffered > 0 && s->window > 0 && c->window > 0){
+        size_t length = s->buffered;
+        if ((int64_t)length > s->window){
+            length = s->window;
+        }
+        if ((int64_t)length > c->window){
+            length = c->window;
+        }
+        bool last = s->eof && length == s->buffered;
+        http2_write_frame(c, H2_DATA, last ? H2_FLAG_END_STREAM : 0, s->id, s->buffer, length);
+        s->window   -= length;
+        c->window   -= length;
+        s->buffered -= length;
+        memmove(s->buffer, s->buffer + length, s->buffered);
+        if (last){
+            goto done;
+        }
+    }
+    if (!s->eof || s->buffered > 0){
+        return;
+    }
+    if (s->headers_sent){
+        http2_write_frame(c, H2_DATA, H2_FLAG_END_STREAM, s->id, NULL, 0);
+    }
+
+done:
+    if (!s->remote_closed){
+        http2_write_u32(c, H2_RST_STREAM, s->id, H2_NO_ERROR);
+    }
+    http2_stream_close(c, s, false);
+}
+
+/**
+ * Switch HTTP/1.1 request to stream 1 (h2c upgrade).
+ *
+ * @param   c           HTTP/2 connection.
+ * @return  -1 on error and 0 on success.
+ *
+ * The HTTP2-Settings header (base64url) is applied as the client's initial
+ * settings, and the request itself is served as stream 1, which is
+ * half-closed already.
+ **/
+int http2_upgrade(HTTP2Connection *c) {
+    Request *r       = c->request;
+    Header  *headers = NULL;
+    Header **tail    = &headers;
+    char     path[BUFSIZ];
+
+    snprintf(path, sizeof(path), "%s%s%s", r->uri, r->query ? "?" : "", r->query ? r->query : "");
+    tail = &http2_header(tail, ":method", r->method)->next;
+    tail = &http2_header(tail, ":path", path)->next;
+
+    for (Header *header = r->headers; header != NULL; header = header->next){
+        if (strcasecmp(header->name, "HTTP2-Settings") == 0){
+            uint8_t  settings[BUFSIZ];
+            size_t   length = 0;
+            uint32_t bits   = 0;
+            int      nbits  = 0;
+            for (const char *p = header->value; *p && *p != '=' && length < sizeof(settings); p++){
+                const char *digit = strchr(Base64URL, *p);
+                if (digit == NULL){
+                    http2_free_headers(headers);
+                    return -1;
+                }
+                bits   = (bits << 6) | (digit - Base64URL);
+                nbits += 6;
+                if (nbits >= 8){
+                    nbits -= 8;
+                    settings[length++] = bits >> nbits;
+                }
+            }
+            if (http2_settings(c, settings, length) != H2_NO_ERROR){
+                http2_free_headers(headers);
+                return -1;
+            }
+        } else if (strcasecmp(header->name, "Host") == 0){
+            tail = &http2_header(tail, ":authority", header->value)->next;
+        } else if (strcasecmp(header->name, "Connection") != 0 && strcasecmp(header->name, "Upgrade") != 0){
+            tail = &http2_header(tail, header->name, header->value)->next;
+        }
+    }
+
+    c->last_stream = 1;
+    HTTP2Stream *s = http2_stream_open(c, 1, headers);
+    if (s == NULL){
+        return -1;
+    }
+    s->remote_closed = true;
+    http2_stream_dispatch(c, s);
+    return 0;
+}
+
+/**
+ * Check decoded header list (RFC 9113, 8.2 and 8.3).
+ *
+ * @param   headers     Header fields.
+ * @param   trailers    The list carries trailers (no pseudo-header fields).
+ * @return  Whether the list is well-formed.
+ *
+ * Names must be lowercase and free of control characters, whitespace and
+ * colons; values must not contain CR or LF (NUL is already rejected by the
+ * decoder) or start or end with whitespace.  Connection-specific fields are
+ * not allowed, nor is TE other than "trailers".  The request pseudo-header
+ * fields must come first, each at most once.
+ **/
+bool http2_header_valid(Header *headers, bool trailers) {
+    bool     regular = false;
+    unsigned pseudo  = 0;
+    size_t   npseudo = sizeof(PseudoHeaders) / sizeof(PseudoHeaders[0]);
+
+    for (Header *header = headers; header != NULL; header = header->next){
+        const char *name = header->name;
+        if (name[0] == ':'){
+            size_t i = 0;
+            while (i < npseudo && !streq(name, PseudoHeaders[i])){
+                i++;
+            }
+            if (trailers || regular || i == npseudo || (pseudo & (1u << i))){
+                return false;
+            }
+            pseudo |= 1u << i;
+            name++;
+        } else {
+            regular = true;
+            for (size_t i = 0; i < sizeof(ConnectionHeaders) / sizeof(ConnectionHeaders[0]); i++){
+                if (streq(name, ConnectionHeaders[i])){
+                    return false;
+                }
+            }
+            if (streq(name, "te") && !streq(header->value, "trailers")){
+                return false;
+            }
+        }
+
+        if (*name == '\0'){
+            return false;
+        }
+        for (const unsigned char *p = (const unsigned char *)name; *p; p++){
+            if (*p <= ' ' || *p >= 0x7f || *p == ':' || isupper(*p)){
+                return false;
+            }
+        }
+
+        const char *value  = header->value;
+        size_t      length = strlen(value);
+        if (strpbrk(value, "\r\n") != NULL ||
+            (length > 0 && (strchr(" \t", value[0]) || strchr(" \t", value[length - 1])))){
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Find end of HTTP/1 header block.
+ *
+ * @param   s           Response read so far.
+ * @param   size        Number of bytes read.
+ * @return  Pointer to first byte of body (or NULL if header block incomplete).
+ *
+ * Like cgi_header_end, this accepts an empty line ended by LF as well as by
+ * CRLF, as scripts often write bare LFs.
+ **/
+char *http2_header_end(char *s, size_t size) {
+    for (char *lf = memchr(s, '\n', size); lf != NULL; lf = memchr(lf + 1, '\n', s + size - lf - 1)){
+        char *next = lf + 1;
+        if (next < s + size && *next == '\r'){
+            next++;
+        }
+        if (next < s + size && *next == '\n'){
+            return next + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocate header.
+ *
+ * @param   tail        Where to link the header (NULL to leave it unlinked).
+ * @param   name        Header name.
+ * @param   value       Header value.
+ * @return  Newly allocated header (exits on allocation failure).
+ **/
+Header *http2_header(Header **tail, const char *name, const char *value) {
+    Header *header = calloc(1, sizeof(Header));
+    if (header == NULL || (header->name = strdup(name)) == NULL || (header->value = strdup(value)) == NULL){
+        fatal("calloc failed: %s", strerror(errno));
+    }
+    if (tail != NULL){
+        *tail = header;
+    }
+    return header;
+}
+
+/**
+ * Deallocate list of headers.
+ *
+ * @param   headers     First header of list.
+ **/
+void http2_free_headers(Header *headers) {
+    for (Header *header = headers, *next; header != NULL; header = next){
+        next = header->next;
+        free(header->name);
+        free(header->value);
+        free(header);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
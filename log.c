@@ -0,0 +1,494 @@
+/* log.c: Asynchronous Access Log */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define ACCESS_LOG_SLOTS    4096        /* Ring capacity (power of two) */
+#define ACCESS_LOG_BATCH    64          /* Entries written per writev */
+#define ACCESS_LOG_LINE     1024        /* Maximum formatted entry length */
+#define ACCESS_LOG_STRINGS  256         /* Interned strings in binary format */
+#define ACCESS_LOG_IDLE_NS  10000000    /* Writer sleep when ring is empty */
+#define ACCESS_LOG_STALL_NS 1000000000  /* Wait for a claimed slot to be published */
+
+/* Access log entry */
+
+typedef struct {
+    int64_t     time;                   /*< Completion time (seconds since epoch) */
+    int64_t     latency;                /*< Nanoseconds from accept to completion */
+    uint64_t    bytes;                  /*< Response bytes sent */
+    int32_t     pid;                    /*< Worker process id */
+    char        status[32];             /*< HTTP status */
+    char        method[16];             /*< HTTP method */
+    char        mimetype[64];           /*< Content-Type of response */
+    char        host[64];               /*< Client address */
+    char        uri[256];               /*< HTTP URI */
+    char        referer[128];           /*< Referer request header */
+    char        agent[128];             /*< User-Agent request header */
+} AccessLogEntry;
+
+typedef struct {
+    _Atomic uint64_t    sequence;       /*< Slot sequence number */
+    AccessLogEntry      entry;          /*< Slot payload */
+} AccessLogSlot;
+
+/* Bounded multi-producer, single-consumer ring in shared memory, so that
+ * forked workers can submit entries without locks or system calls. */
+
+typedef struct {
+    _Atomic uint64_t    head;           /*< Next position to claim (producers) */
+    char                pad0[56];
+    _Atomic uint64_t    tail;           /*< Next position to drain (consumer) */
+    char                pad1[56];
+    _Atomic uint64_t    dropped;        /*< Entries dropped because ring was full */
+    AccessLogSlot       slots[ACCESS_LOG_SLOTS];
+} AccessLogRing;
+
+/* Internal Variables */
+
+AccessLogRing  *AccessLog      = NULL;
+int             AccessLogFd    = STDERR_FILENO;
+pthread_mutex_t AccessLogMutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t        AccessLogDropped = 0;
+uint64_t        AccessLogStalled = UINT64_MAX;  /* Position consumer waits at */
+int64_t         AccessLogStalledSince = 0;      /* Since when (CLOCK_MONOTONIC ns) */
+
+char            AccessLogStrings[ACCESS_LOG_STRINGS][64];
+size_t          AccessLogStringsCount = 0;
+
+/* Internal Declarations */
+size_t  accesslog_drain(void);
+bool    accesslog_skip(AccessLogSlot *slot, uint64_t position);
+void *  accesslog_writer(void *arg);
+int     accesslog_format_text(AccessLogEntry *entry, char *buffer);
+int     accesslog_format_binary(AccessLogEntry *entry, char *buffer);
+size_t  accesslog_intern(const char *s, uint8_t *buffer, uint64_t *id);
+size_t  varint_encode(uint8_t *buffer, uint64_t value);
+size_t  string_encode(uint8_t *buffer, const char *s);
+size_t  record_encode(uint8_t *buffer, AccessLogTag tag, const uint8_t *payload, size_t length);
+
+/**
+ * Initialize access log.
+ *
+ * @param   path        Path to access log file (NULL for stderr).
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked, since the ring buffer
+ * is allocated as anonymous shared memory.
+ *
+ * If AccessLogBinary is set, the binary log header is written to an empty
+ * log, and a reset record to a log that is being appended to.
+ **/
+int accesslog_init(const char *path) {
+    if (path != NULL) {
+        AccessLogFd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+        if (AccessLogFd < 0) {
+            fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (AccessLogBinary) {
+        uint8_t buffer[16];
+        size_t  length;
+        if (lseek(AccessLogFd, 0, SEEK_END) > 0) {
+            length = record_encode(buffer, ACCESS_LOG_RESET, NULL, 0);
+        } else {
+            length = strlen(ACCESS_LOG_MAGIC);
+            memcpy(buffer, ACCESS_LOG_MAGIC, length);
+        }
+        if (write(AccessLogFd, buffer, length) != (ssize_t)length) {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    AccessLog = mmap(NULL, sizeof(AccessLogRing), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (AccessLog == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        AccessLog = NULL;
+        return -1;
+    }
+    for (uint64_t i = 0; i < ACCESS_LOG_SLOTS; i++) {
+        atomic_init(&AccessLog->slots[i].sequence, i);
+    }
+    return 0;
+}
+
+/**
+ * Start background access log writer thread.
+ **/
+void accesslog_start(void) {
+    pthread_t thread;
+    sigset_t  all, saved;
+
+    if (AccessLog == NULL) {
+        return;
+    }
+
+    /* Writer inherits a fully blocked signal mask, so signals such as SIGUSR1
+     * are always delivered to (and interrupt accept in) the server loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    if (pthread_create(&thread, NULL, accesslog_writer, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+    } else {
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/**
+ * Record completed request in access log.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      HTTP status of response (unless r->status_code is set).
+ *
+ * This claims a slot in the shared ring with a compare-and-swap and never
+ * blocks: if the ring is full, the entry is dropped and counted instead.
+ **/
+void accesslog_record(Request *r, HTTPStatus status) {
+    AccessLogSlot *slot;
+    struct timespec now;
+
+    if (AccessLog == NULL) {
+        return;
+    }
+
+    /* Claim slot */
+    uint64_t position = atomic_load_explicit(&AccessLog->head, memory_order_relaxed);
+    while (true) {
+        slot = &AccessLog->slots[position & (ACCESS_LOG_SLOTS - 1)];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t  difference = (int64_t)sequence - (int64_t)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&AccessLog->head, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            atomic_fetch_add_explicit(&AccessLog->dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            position = atomic_load_explicit(&AccessLog->head, memory_order_relaxed);
+        }
+    }
+
+    /* Fill and publish entry */
+    AccessLogEntry *entry = &slot->entry;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    entry->latency = (now.tv_sec - r->start.tv_sec) * 1000000000LL + (now.tv_nsec - r->start.tv_nsec);
+    entry->time    = time(NULL);
+    entry->bytes   = r->response.sent;
+    entry->pid     = getpid();
+    if (r->status_code != 0) {
+        snprintf(entry->status, sizeof(entry->status), "%d", r->status_code);
+    } else {
+        snprintf(entry->status, sizeof(entry->status), "%s", http_status_string(status));
+    }
+    snprintf(entry->method, sizeof(entry->method), "%.*s", (int)sizeof(entry->method) - 1, r->method ? r->method : "-");
+    snprintf(entry->mimetype, sizeof(entry->mimetype), "%s", r->content_type[0] ? r->content_type : "-");
+    snprintf(entry->host, sizeof(entry->host), "%.*s", (int)sizeof(entry->host) - 1, request_hostname(r));
+    snprintf(entry->uri, sizeof(entry->uri), "%.*s", (int)sizeof(entry->uri) - 1, r->uri ? r->uri : "-");
+    entry->referer[0] = '\0';
+    entry->agent[0]   = '\0';
+    for (Header *header = r->headers; header != NULL; header = header->next) {
+        if (strcasecmp(header->name, "Referer") == 0) {
+            snprintf(entry->referer, sizeof(entry->referer), "%.*s", (int)sizeof(entry->referer) - 1, header->value);
+        } else if (strcasecmp(header->name, "User-Agent") == 0) {
+            snprintf(entry->agent, sizeof(entry->agent), "%.*s", (int)sizeof(entry->agent) - 1, header->value);
+        }
+    }
+    uint64_t expected = position;
+    if (!atomic_compare_exchange_strong_explicit(&slot->sequence, &expected, position + 1, memory_order_release, memory_order_relaxed)) {
+        /* Consumer gave up on this slot (see accesslog_skip) */
+        return;
+    }
+}
+
+/**
+ * Skip slot that was claimed but never published.
+ *
+ * @param   slot        Slot at the consumer's position.
+ * @param   position    Consumer's position.
+ * @return  Whether the slot was skipped.
+ *
+ * A worker killed between claiming a slot and publishing it would otherwise
+ * stall the consumer at that slot forever, and every producer once the ring
+ * is full.  A claimed slot that stays unpublished for ACCESS_LOG_STALL_NS is
+ * released to producers and counted as dropped.  A producer that was merely
+ * that slow finds its slot gone when it publishes, and drops its entry.
+ **/
+bool accesslog_skip(AccessLogSlot *slot, uint64_t position) {
+    struct timespec now;
+
+    if (atomic_load_explicit(&AccessLog->head, memory_order_relaxed) <= position) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t time = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (AccessLogStalled != position) {
+        AccessLogStalled      = position;
+        AccessLogStalledSince = time;
+        return false;
+    }
+    if (time - AccessLogStalledSince < ACCESS_LOG_STALL_NS) {
+        return false;
+    }
+
+    uint64_t expected = position;
+    if (!atomic_compare_exchange_strong_explicit(&slot->sequence, &expected, position + ACCESS_LOG_SLOTS, memory_order_acq_rel, memory_order_acquire)) {
+        return false;
+    }
+    atomic_fetch_add_explicit(&AccessLog->dropped, 1, memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Drain available entries from ring to access log file.
+ *
+ * @return  Number of entries written.
+ *
+ * Entries are formatted (as text or binary records) in batches of up to
+ * ACCESS_LOG_BATCH and written with a single writev(2) per batch.  Slots
+ * abandoned by their producer are skipped (see accesslog_skip).
+ **/
+size_t accesslog_drain(void) {
+    static char  lines[ACCESS_LOG_BATCH][ACCESS_LOG_LINE];
+    struct iovec iov[ACCESS_LOG_BATCH];
+    size_t       total = 0;
+    size_t       count;
+
+    if (AccessLog == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&AccessLogMutex);
+    do {
+        uint64_t position = atomic_load_explicit(&AccessLog->tail, memory_order_relaxed);
+        for (count = 0; count < ACCESS_LOG_BATCH; position++) {
+            AccessLogSlot *slot = &AccessLog->slots[position & (ACCESS_LOG_SLOTS - 1)];
+            if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != position + 1) {
+                if (accesslog_skip(slot, position)) {
+                    continue;
+                }
+                break;
+            }
+
+            /* Format entry */
+            int length;
+            if (AccessLogBinary) {
+                length = accesslog_format_binary(&slot->entry, lines[count]);
+            } else {
+                length = accesslog_format_text(&slot->entry, lines[count]);
+            }
+            iov[count].iov_base = lines[count];
+            iov[count].iov_len  = length;
+            count++;
+
+            /* Release slot to producers */
+            atomic_store_explicit(&slot->sequence, position + ACCESS_LOG_SLOTS, memory_order_release);
+        }
+        atomic_store_explicit(&AccessLog->tail, position, memory_order_relaxed);
+
+        if (count > 0 && writev(AccessLogFd, iov, count) < 0) {
+            fprintf(stderr, "writev failed: %s\n", strerror(errno));
+        }
+        total += count;
+    } while (count == ACCESS_LOG_BATCH);
+
+    /* Report newly dropped entries (to stderr if the log itself is binary) */
+    uint64_t dropped = atomic_load_explicit(&AccessLog->dropped, memory_order_relaxed);
+    if (dropped != AccessLogDropped) {
+        dprintf(AccessLogBinary ? STDERR_FILENO : AccessLogFd, "spidey: %llu access log entries dropped\n", (unsigned long long)(dropped - AccessLogDropped));
+        AccessLogDropped = dropped;
+    }
+    pthread_mutex_unlock(&AccessLogMutex);
+
+    return total;
+}
+
+/**
+ * Format access log entry as text.
+ *
+ * @param   entry       Access log entry.
+ * @param   buffer      Buffer of ACCESS_LOG_LINE bytes.
+ * @return  Length of formatted entry.
+ *
+ * Entries are in Common Log Format followed by latency in microseconds.
+ **/
+int accesslog_format_text(AccessLogEntry *entry, char *buffer) {
+    char      timestamp[32];
+    time_t    t = entry->time;
+    struct tm tm;
+
+    strftime(timestamp, sizeof(timestamp), "%d/%b/%Y:%H:%M:%S +0000", gmtime_r(&t, &tm));
+    int length = snprintf(buffer, ACCESS_LOG_LINE, "%s - - [%s] \"%s %s HTTP/1.0\" %.3s %llu %lld\n",
+        entry->host, timestamp, entry->method, entry->uri, entry->status,
+        (unsigned long long)entry->bytes, (long long)(entry->latency / 1000));
+    if (length >= ACCESS_LOG_LINE) {
+        length = ACCESS_LOG_LINE - 1;
+        buffer[length - 1] = '\n';
+    }
+    return length;
+}
+
+/**
+ * Format access log entry as binary records.
+ *
+ * @param   entry       Access log entry.
+ * @param   buffer      Buffer of ACCESS_LOG_LINE bytes.
+ * @return  Length of formatted records.
+ *
+ * Any method, status, or mimetype strings not yet interned are emitted as
+ * ACCESS_LOG_STRING records ahead of the ACCESS_LOG_REQUEST record.
+ **/
+int accesslog_format_binary(AccessLogEntry *entry, char *buffer) {
+    uint8_t  payload[ACCESS_LOG_LINE];
+    uint8_t *out = (uint8_t *)buffer;
+    uint8_t *p = payload;
+    uint64_t method, status, mimetype;
+
+    /* Make room for all three strings at once, so none is reset away */
+    if (AccessLogStringsCount + 3 > ACCESS_LOG_STRINGS) {
+        AccessLogStringsCount = 0;
+        out += record_encode(out, ACCESS_LOG_RESET, NULL, 0);
+    }
+    out += accesslog_intern(entry->method, out, &method);
+    out += accesslog_intern(entry->status, out, &status);
+    out += accesslog_intern(entry->mimetype, out, &mimetype);
+
+    p += varint_encode(p, entry->time);
+    p += varint_encode(p, entry->latency / 1000);
+    p += varint_encode(p, entry->bytes);
+    p += varint_encode(p, entry->pid);
+    p += varint_encode(p, method);
+    p += varint_encode(p, status);
+    p += varint_encode(p, mimetype);
+    p += string_encode(p, entry->host);
+    p += string_encode(p, entry->uri);
+    p += string_encode(p, entry->referer);
+    p += string_encode(p, entry->agent);
+    out += record_encode(out, ACCESS_LOG_REQUEST, payload, p - payload);
+
+    return out - (uint8_t *)buffer;
+}
+
+/**
+ * Look up interned string, defining it if necessary.
+ *
+ * @param   s           String to intern.
+ * @param   buffer      Buffer to store ACCESS_LOG_STRING record (if any).
+ * @param   id          Pointer to store id of string.
+ * @return  Length of record stored in buffer (0 if already interned).
+ **/
+size_t accesslog_intern(const char *s, uint8_t *buffer, uint64_t *id) {
+    uint8_t payload[128];
+    size_t  length;
+
+    for (size_t i = 0; i < AccessLogStringsCount; i++) {
+        if (streq(AccessLogStrings[i], s)) {
+            *id = i + 1;
+            return 0;
+        }
+    }
+
+    snprintf(AccessLogStrings[AccessLogStringsCount], sizeof(AccessLogStrings[0]), "%s", s);
+    *id = ++AccessLogStringsCount;
+    length  = varint_encode(payload, *id);
+    length += string_encode(payload + length, AccessLogStrings[*id - 1]);
+    return record_encode(buffer, ACCESS_LOG_STRING, payload, length);
+}
+
+/**
+ * Encode unsigned LEB128 varint.
+ *
+ * @param   buffer      Buffer to store encoding (at most 10 bytes).
+ * @param   value       Value to encode.
+ * @return  Length of encoding.
+ **/
+size_t varint_encode(uint8_t *buffer, uint64_t value) {
+    size_t length = 0;
+
+    while (value >= 0x80) {
+        buffer[length++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buffer[length++] = value;
+    return length;
+}
+
+/**
+ * Encode length-prefixed string.
+ *
+ * @param   buffer      Buffer to store encoding.
+ * @param   s           String to encode.
+ * @return  Length of encoding.
+ **/
+size_t string_encode(uint8_t *buffer, const char *s) {
+    size_t length = strlen(s);
+    size_t prefix = varint_encode(buffer, length);
+
+    memcpy(buffer + prefix, s, length);
+    return prefix + length;
+}
+
+/**
+ * Encode binary access log record.
+ *
+ * @param   buffer      Buffer to store record.
+ * @param   tag         Record type.
+ * @param   payload     Record payload.
+ * @param   length      Length of payload.
+ * @return  Length of record.
+ **/
+size_t record_encode(uint8_t *buffer, AccessLogTag tag, const uint8_t *payload, size_t length) {
+    size_t header;
+
+    buffer[0] = tag;
+    header = 1 + varint_encode(buffer + 1, length);
+    if (length > 0) {
+        memcpy(buffer + header, payload, length);
+    }
+    return header + length;
+}
+
+/**
+ * Write all pending access log entries.
+ **/
+void accesslog_flush(void) {
+    while (accesslog_drain() > 0);
+}
+
+/**
+ * Background access log writer.
+ *
+ * @param   arg         Unused.
+ * @return  NULL (never returns).
+ **/
+void * accesslog_writer(void *arg) {
+    struct timespec idle = {0, ACCESS_LOG_IDLE_NS};
+
+    while (true) {
+        if (accesslog_drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,224 @@
+/* logcat.c: Convert spidey binary access log to text */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Constants */
+
+#define MAX_STRINGS 256
+#define MAX_RECORD  (1<<16)
+
+/* Global Variables */
+
+char *Strings[MAX_STRINGS + 1];         /**< Interned strings by id */
+bool  Combined = false;                 /**< Emit Combined Log Format */
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hc] [path]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -c            Combined Log Format (default: Common)\n");
+    exit(status);
+}
+
+/**
+ * Decode unsigned LEB128 varint.
+ *
+ * @param   p           Pointer to current position in record (advanced).
+ * @param   end         End of record.
+ * @param   value       Pointer to store decoded value.
+ * @return  Whether or not decoding was successful.
+ **/
+bool varint_decode(uint8_t **p, uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Decode length-prefixed string.
+ *
+ * @param   p           Pointer to current position in record (advanced).
+ * @param   end         End of record.
+ * @param   buffer      Buffer to store NUL-terminated string.
+ * @param   size        Size of buffer.
+ * @return  Whether or not decoding was successful.
+ **/
+bool string_decode(uint8_t **p, uint8_t *end, char *buffer, size_t size) {
+    uint64_t length;
+
+    if (!varint_decode(p, end, &length) || length > (uint64_t)(end - *p) || length >= size) {
+        return false;
+    }
+    memcpy(buffer, *p, length);
+    buffer[length] = '\0';
+    *p += length;
+    return true;
+}
+
+/**
+ * Look up interned string.
+ *
+ * @param   id          String id.
+ * @return  Interned string (or "-" if unknown).
+ **/
+const char * string_lookup(uint64_t id) {
+    if (id == 0 || id > MAX_STRINGS || Strings[id] == NULL) {
+        return "-";
+    }
+    return Strings[id];
+}
+
+/**
+ * Forget all interned strings.
+ **/
+void strings_reset(void) {
+    for (size_t i = 0; i <= MAX_STRINGS; i++) {
+        free(Strings[i]);
+        Strings[i] = NULL;
+    }
+}
+
+/**
+ * Print request record as Common (or Combined) Log Format line.
+ *
+ * @param   p           Start of record payload.
+ * @param   end         End of record payload.
+ * @return  Whether or not record was well-formed.
+ **/
+bool print_request(uint8_t *p, uint8_t *end) {
+    uint64_t  time, latency, bytes, pid, method, status, mimetype;
+    char      host[BUFSIZ], uri[BUFSIZ], referer[BUFSIZ], agent[BUFSIZ];
+    char      timestamp[32];
+    struct tm tm;
+
+    if (!varint_decode(&p, end, &time)    || !varint_decode(&p, end, &latency) ||
+        !varint_decode(&p, end, &bytes)   || !varint_decode(&p, end, &pid) ||
+        !varint_decode(&p, end, &method)  || !varint_decode(&p, end, &status) ||
+        !varint_decode(&p, end, &mimetype)||
+        !string_decode(&p, end, host, sizeof(host)) ||
+        !string_decode(&p, end, uri, sizeof(uri)) ||
+        !string_decode(&p, end, referer, sizeof(referer)) ||
+        !string_decode(&p, end, agent, sizeof(agent))) {
+        return false;
+    }
+
+    time_t t = time;
+    strftime(timestamp, sizeof(timestamp), "%d/%b/%Y:%H:%M:%S +0000", gmtime_r(&t, &tm));
+    printf("%s - - [%s] \"%s %s HTTP/1.0\" %.3s %llu", host, timestamp,
+        string_lookup(method), uri, string_lookup(status), (unsigned long long)bytes);
+    if (Combined) {
+        printf(" \"%s\" \"%s\"", referer[0] ? referer : "-", agent[0] ? agent : "-");
+    }
+    printf("\n");
+    return true;
+}
+
+/**
+ * Convert binary access log stream to text.
+ *
+ * @param   stream      Binary access log stream.
+ * @return  Whether or not the whole log was well-formed.
+ **/
+bool logcat(FILE *stream) {
+    static uint8_t record[MAX_RECORD];
+    char magic[sizeof(ACCESS_LOG_MAGIC) - 1];
+    int  tag;
+
+    if (fread(magic, 1, sizeof(magic), stream) != sizeof(magic) || memcmp(magic, ACCESS_LOG_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "logcat: not a spidey binary access log\n");
+        return false;
+    }
+
+    while ((tag = fgetc(stream)) != EOF) {
+        /* Read record length and payload */
+        uint64_t length = 0;
+        int      byte;
+        for (int shift = 0; (byte = fgetc(stream)) != EOF; shift += 7) {
+            length |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        if (byte == EOF || length > MAX_RECORD || fread(record, 1, length, stream) != length) {
+            fprintf(stderr, "logcat: truncated record\n");
+            return false;
+        }
+
+        uint8_t *p   = record;
+        uint8_t *end = record + length;
+        uint64_t id;
+        char     buffer[BUFSIZ];
+        switch (tag) {
+            case ACCESS_LOG_STRING:
+                if (!varint_decode(&p, end, &id) || id == 0 || id > MAX_STRINGS || !string_decode(&p, end, buffer, sizeof(buffer))) {
+                    fprintf(stderr, "logcat: malformed string record\n");
+                    return false;
+                }
+                free(Strings[id]);
+                Strings[id] = strdup(buffer);
+                break;
+            case ACCESS_LOG_RESET:
+                strings_reset();
+                break;
+            case ACCESS_LOG_REQUEST:
+                if (!print_request(p, end)) {
+                    fprintf(stderr, "logcat: malformed request record\n");
+                    return false;
+                }
+                break;
+            default:
+                /* Skip unknown record types */
+                break;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parses command line options and converts binary access log
+ **/
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    FILE *stream = stdin;
+
+    /* Parse command line options */
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(argv[0], 0);
+        } else if (streq(arg, "-c")) {
+            Combined = true;
+        } else {
+            usage(argv[0], 1);
+        }
+    }
+
+    if (argind < argc && (stream = fopen(argv[argind], "r")) == NULL) {
+        fprintf(stderr, "fopen %s failed: %s\n", argv[argind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    bool success = logcat(stream);
+    strings_reset();
+    fclose(stream);
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,304 @@
+/* metrics.c: Request Metrics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define METRICS_SLOTS           32      /* Per-process counter slots */
+#define METRICS_SUB_BITS        3       /* Sub-buckets per power of two (log2) */
+#define METRICS_EXPONENTS       40      /* Powers of two tracked (ns) */
+#define METRICS_BUCKETS         (METRICS_EXPONENTS << METRICS_SUB_BITS)
+#define METRICS_MIN_EXPONENT    10      /* Smallest reported bucket bound (~1us) */
+#define METRICS_STATUS_CODES    600     /* Status codes counted (100 to 599) */
+
+/* Latency histogram with log-linear (HDR style) buckets: each power of two is
+ * split into 2^METRICS_SUB_BITS linear sub-buckets, bounding relative error
+ * to 12.5% over the whole range. */
+
+typedef struct {
+    _Atomic uint64_t    buckets[METRICS_BUCKETS];
+    _Atomic uint64_t    count;
+    _Atomic uint64_t    sum;            /*< Total nanoseconds */
+} MetricsHistogram;
+
+/* Counters written by the processes that map to the slot.  Slots are merged
+ * only when rendered, so recording is a handful of relaxed atomic adds. */
+
+typedef struct {
+    _Atomic uint64_t    statuses[METRICS_STATUS_CODES];   /*< By status code */
+    _Atomic uint64_t    handlers[METRICS_HANDLERS];
+    MetricsHistogram    stages[METRICS_STAGES];
+} __attribute__((aligned(64))) MetricsSlot;
+
+/* Gauges of the whole server (a single instance after the slots) */
+
+typedef struct {
+    _Atomic int64_t     inflight;       /*< Requests being handled */
+    _Atomic int64_t     draining;       /*< Server stopped accepting and is draining */
+    _Atomic int64_t     drain_deadline; /*< End of drain (CLOCK_MONOTONIC ns) */
+} MetricsGauges;
+
+/* Internal Variables */
+
+MetricsSlot    *Metrics     = NULL;
+MetricsSlot    *MetricsSelf = NULL;
+MetricsGauges  *Gauges      = NULL;
+
+const char *MetricsStageNames[] = {
+    "accept",
+    "parse",
+    "path",
+    "handler",
+    "flush",
+};
+
+const char *MetricsHandlerNames[] = {
+    "browse",
+    "file",
+    "cgi",
+    "error",
+    "metrics",
+};
+
+/* Internal Declarations */
+MetricsSlot *   metrics_slot(void);
+void            metrics_reset_slot(void);
+size_t          metrics_bucket(uint64_t value);
+
+/**
+ * Initialize metrics.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked, since the counters are
+ * allocated as anonymous shared memory.
+ **/
+int metrics_init(void) {
+    Metrics = mmap(NULL, sizeof(MetricsSlot) * METRICS_SLOTS + sizeof(MetricsGauges), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (Metrics == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        Metrics = NULL;
+        return -1;
+    }
+    Gauges = (MetricsGauges *)(Metrics + METRICS_SLOTS);
+    pthread_atfork(NULL, NULL, metrics_reset_slot);
+    return 0;
+}
+
+/**
+ * Forget cached slot of current process (after fork).
+ **/
+void metrics_reset_slot(void) {
+    MetricsSelf = NULL;
+}
+
+/**
+ * Return counter slot of current process.
+ *
+ * @return  Counter slot (or NULL if metrics are not initialized).
+ **/
+MetricsSlot * metrics_slot(void) {
+    if (MetricsSelf == NULL && Metrics != NULL) {
+        MetricsSelf = &Metrics[getpid() % METRICS_SLOTS];
+    }
+    return MetricsSelf;
+}
+
+/**
+ * Determine histogram bucket of value.
+ *
+ * @param   value       Latency in nanoseconds.
+ * @return  Bucket index.
+ **/
+size_t metrics_bucket(uint64_t value) {
+    if (value < (1 << METRICS_SUB_BITS)) {
+        return value;
+    }
+
+    size_t exponent = 63 - __builtin_clzll(value);
+    size_t sub      = (value >> (exponent - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1);
+    size_t bucket   = ((exponent - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub;
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+/**
+ * Record duration of request stage.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   stage       Request stage.
+ * @param   mark        Start of stage (updated to current time).
+ *
+ * The stage timing is also kept in the request for the span recorder.
+ **/
+void metrics_stage(Request *r, MetricsStage stage, struct timespec *mark) {
+    MetricsSlot *slot = metrics_slot();
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t elapsed = (now.tv_sec - mark->tv_sec) * 1000000000LL + (now.tv_nsec - mark->tv_nsec);
+    if (elapsed < 0) {
+        elapsed = 0;
+    }
+    r->stage_start[stage] = *mark;
+    r->stage_ns[stage]    = elapsed;
+
+    if (slot != NULL) {
+        MetricsHistogram *histogram = &slot->stages[stage];
+        /* Buckets hold (lower, upper] like Prometheus le bounds */
+        atomic_fetch_add_explicit(&histogram->buckets[metrics_bucket(elapsed > 0 ? elapsed - 1 : 0)], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&histogram->sum, elapsed, memory_order_relaxed);
+    }
+    *mark = now;
+}
+
+/**
+ * Record completed request.
+ *
+ * @param   code        Status code of response (e.g. 404, or whatever a CGI
+ *                      script sent).
+ * @param   handler     Handler that produced response.
+ **/
+void metrics_request(int code, MetricsHandler handler) {
+    MetricsSlot *slot = metrics_slot();
+
+    if (slot == NULL) {
+        return;
+    }
+    if (code > 0 && code < METRICS_STATUS_CODES) {
+        atomic_fetch_add_explicit(&slot->statuses[code], 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&slot->handlers[handler], 1, memory_order_relaxed);
+}
+
+/**
+ * Adjust number of requests in flight.
+ *
+ * @param   delta       1 when a request starts, -1 when it completes, or 0.
+ * @return  Number of requests in flight after adjustment.
+ **/
+int64_t metrics_inflight(int delta) {
+    if (Gauges == NULL) {
+        return 0;
+    }
+    return atomic_fetch_add_explicit(&Gauges->inflight, delta, memory_order_relaxed) + delta;
+}
+
+/**
+ * Record start of drain.
+ *
+ * @param   deadline    Time by which the drain ends (CLOCK_MONOTONIC).
+ **/
+void metrics_drain(const struct timespec *deadline) {
+    if (Gauges != NULL) {
+        atomic_store_explicit(&Gauges->drain_deadline, deadline->tv_sec * 1000000000LL + deadline->tv_nsec, memory_order_relaxed);
+        atomic_store_explicit(&Gauges->draining, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Render metrics in Prometheus text exposition format.
+ *
+ * @param   response    Response to write metrics to.
+ *
+ * Counters are summed over all slots.  Histogram buckets are reported at
+ * power of two (nanosecond) boundaries, in seconds.
+ **/
+void metrics_render(Response *response) {
+    if (Metrics == NULL) {
+        return;
+    }
+
+    /* Gauges */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t remaining = 0;
+    if (atomic_load_explicit(&Gauges->draining, memory_order_relaxed)) {
+        remaining = atomic_load_explicit(&Gauges->drain_deadline, memory_order_relaxed) - (now.tv_sec * 1000000000LL + now.tv_nsec);
+    }
+    response_printf(response, "# HELP spidey_requests_in_flight Requests being handled.\n");
+    response_printf(response, "# TYPE spidey_requests_in_flight gauge\n");
+    response_printf(response, "spidey_requests_in_flight %lld\n", (long long)atomic_load_explicit(&Gauges->inflight, memory_order_relaxed));
+    response_printf(response, "# HELP spidey_draining Whether the server stopped accepting and is draining.\n");
+    response_printf(response, "# TYPE spidey_draining gauge\n");
+    response_printf(response, "spidey_draining %lld\n", (long long)atomic_load_explicit(&Gauges->draining, memory_order_relaxed));
+    response_printf(response, "# HELP spidey_drain_remaining_seconds Time left until draining requests are abandoned.\n");
+    response_printf(response, "# TYPE spidey_drain_remaining_seconds gauge\n");
+    response_printf(response, "spidey_drain_remaining_seconds %.3f\n", remaining > 0 ? remaining / 1e9 : 0.0);
+
+    /* Requests by status */
+    response_printf(response, "# HELP spidey_requests_total Requests handled by response status.\n");
+    response_printf(response, "# TYPE spidey_requests_total counter\n");
+    for (int code = 100; code < METRICS_STATUS_CODES; code++) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < METRICS_SLOTS; i++) {
+            total += atomic_load_explicit(&Metrics[i].statuses[code], memory_order_relaxed);
+        }
+
+        /* The server's own statuses are always exported, others once seen */
+        bool known = false;
+        for (HTTPStatus status = 0; status < HTTP_STATUS_COUNT && !known; status++) {
+            known = http_status_code(status) == code;
+        }
+        if (known || total > 0) {
+            response_printf(response, "spidey_requests_total{status=\"%d\"} %llu\n", code, (unsigned long long)total);
+        }
+    }
+
+    /* Requests by handler */
+    response_printf(response, "# HELP spidey_handler_requests_total Requests handled by handler type.\n");
+    response_printf(response, "# TYPE spidey_handler_requests_total counter\n");
+    for (MetricsHandler handler = 0; handler < METRICS_HANDLERS; handler++) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < METRICS_SLOTS; i++) {
+            total += atomic_load_explicit(&Metrics[i].handlers[handler], memory_order_relaxed);
+        }
+        response_printf(response, "spidey_handler_requests_total{handler=\"%s\"} %llu\n", MetricsHandlerNames[handler], (unsigned long long)total);
+    }
+
+    /* Stage latency histograms */
+    response_printf(response, "# HELP spidey_stage_duration_seconds Time spent in each request stage.\n");
+    response_printf(response, "# TYPE spidey_stage_duration_seconds histogram\n");
+    for (MetricsStage stage = 0; stage < METRICS_STAGES; stage++) {
+        uint64_t buckets[METRICS_BUCKETS] = {0};
+        uint64_t count = 0;
+        uint64_t sum   = 0;
+
+        for (size_t i = 0; i < METRICS_SLOTS; i++) {
+            MetricsHistogram *histogram = &Metrics[i].stages[stage];
+            for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+                buckets[b] += atomic_load_explicit(&histogram->buckets[b], memory_order_relaxed);
+            }
+            count += atomic_load_explicit(&histogram->count, memory_order_relaxed);
+            sum   += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+        }
+
+        uint64_t cumulative = 0;
+        size_t   bucket     = 0;
+        for (size_t exponent = METRICS_SUB_BITS; exponent < METRICS_EXPONENTS; exponent++) {
+            /* Accumulate all buckets up to and including 2^(exponent + 1) ns */
+            size_t limit = metrics_bucket(1ULL << (exponent + 1));
+            for (; bucket < limit; bucket++) {
+                cumulative += buckets[bucket];
+            }
+            if (exponent >= METRICS_MIN_EXPONENT) {
+                response_printf(response, "spidey_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                    MetricsStageNames[stage], (double)(1ULL << (exponent + 1)) / 1e9, (unsigned long long)cumulative);
+            }
+        }
+        response_printf(response, "spidey_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", MetricsStageNames[stage], (unsigned long long)count);
+        response_printf(response, "spidey_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", MetricsStageNames[stage], sum / 1e9);
+        response_printf(response, "spidey_stage_duration_seconds_count{stage=\"%s\"} %llu\n", MetricsStageNames[stage], (unsigned long long)count);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
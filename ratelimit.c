@@ -0,0 +1,242 @@
+/* ratelimit.c: Per-Client Rate Limiting */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+/* Constants */
+
+#define RATELIMIT_SLOTS     4096        /* Buckets in table (power of two) */
+#define RATELIMIT_PROBES    16          /* Slots searched before giving up */
+#define RATELIMIT_ONE       256         /* Fixed-point units per token */
+#define RATELIMIT_TIME_BITS 40          /* Bits of millisecond timestamp in state */
+#define RATELIMIT_TOKEN_MASK ((UINT64_C(1) << (64 - RATELIMIT_TIME_BITS)) - 1)
+
+/* Token bucket of one client address.  The key is a 64-bit hash of the
+ * address (0 if the slot is empty) and the bucket is packed into a single
+ * word (refill time in ms, tokens in 1/256ths) so both are updated with one
+ * compare-and-swap.  A zero state reads as a bucket that was last refilled
+ * long ago, i.e. a full one, so new slots need no initialization. */
+
+typedef struct {
+    _Atomic uint64_t    key;
+    _Atomic uint64_t    state;
+} RateBucket;
+
+typedef struct {
+    RateBucket          buckets[RATELIMIT_SLOTS];
+} RateTable;
+
+/* Internal Variables */
+
+RateTable *Rates = NULL;
+
+/* Internal Declarations */
+uint64_t    ratelimit_key(const struct sockaddr_storage *addr);
+uint64_t    ratelimit_now(void);
+RateBucket *ratelimit_bucket(uint64_t key, uint64_t now);
+uint64_t    ratelimit_refill(uint64_t state, uint64_t now, uint64_t *time);
+
+/**
+ * Initialize rate limiting.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked, since the bucket table
+ * is allocated as anonymous shared memory.  Nothing is allocated if RateLimit
+ * is 0.
+ **/
+int ratelimit_init(void) {
+    if (RateLimit == 0) {
+        return 0;
+    }
+
+    if (RateBurst == 0) {
+        RateBurst = RateLimit;
+    }
+    if (RateBurst * (uint64_t)RATELIMIT_ONE > RATELIMIT_TOKEN_MASK) {
+        fprintf(stderr, "rate burst %u is too large\n", RateBurst);
+        return -1;
+    }
+
+    Rates = mmap(NULL, sizeof(RateTable), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (Rates == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        Rates = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Hash client address (FNV-1a over the IP address, not the port).
+ *
+ * @param   addr        Client socket address.
+ * @return  Nonzero hash of address.
+ *
+ * IPv6 clients are keyed by their /64 prefix, the smallest block a site is
+ * usually assigned, so one client cannot get a fresh bucket per address.
+ * IPv4-mapped IPv6 addresses hash the same as the IPv4 address.
+ **/
+uint64_t ratelimit_key(const struct sockaddr_storage *addr) {
+    const unsigned char *bytes  = NULL;
+    size_t               length = 0;
+
+    if (addr->ss_family == AF_INET) {
+        bytes  = (const unsigned char *)&((const struct sockaddr_in *)addr)->sin_addr;
+        length = 4;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct in6_addr *in6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        bytes  = in6->s6_addr;
+        length = 8;
+        if (IN6_IS_ADDR_V4MAPPED(in6)) {
+            bytes  += 12;
+            length  = 4;
+        }
+    }
+
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * UINT64_C(1099511628211);
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Current time for buckets.
+ *
+ * @return  Milliseconds since boot (CLOCK_MONOTONIC), plus one so that it is
+ *          never 0.
+ **/
+uint64_t ratelimit_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * UINT64_C(1000) + now.tv_nsec / 1000000 + 1) & ((UINT64_C(1) << RATELIMIT_TIME_BITS) - 1);
+}
+
+/**
+ * Refill bucket state up to now.
+ *
+ * @param   state       Packed bucket state.
+ * @param   now         Current time (ms).
+ * @param   time        Refill time to store with the result.
+ * @return  Tokens in bucket (fixed-point).
+ *
+ * The refill time only advances by the time that was converted into whole
+ * fixed-point units, so slow rates do not lose fractions between requests.
+ **/
+uint64_t ratelimit_refill(uint64_t state, uint64_t now, uint64_t *time) {
+    uint64_t last    = state >> (64 - RATELIMIT_TIME_BITS);
+    uint64_t tokens  = state & RATELIMIT_TOKEN_MASK;
+    uint64_t maximum = RateBurst * (uint64_t)RATELIMIT_ONE;
+    uint64_t rate    = RateLimit * (uint64_t)RATELIMIT_ONE;     /* Units per second */
+    uint64_t elapsed = now > last ? now - last : 0;
+
+    if (elapsed >= (maximum * 1000) / rate + 1) {
+        *time = now;
+        return maximum;
+    }
+
+    uint64_t gained = elapsed * rate / 1000;
+    if (tokens + gained >= maximum) {
+        *time = now;
+        return maximum;
+    }
+    *time = last + gained * 1000 / rate;
+    return tokens + gained;
+}
+
+/**
+ * Find or claim bucket for key.
+ *
+ * @param   key         Hash of client address.
+ * @param   now         Current time (ms).
+ * @return  Bucket for key (NULL only if it lost every race for a slot).
+ *
+ * Linear probing over RATELIMIT_PROBES slots.  Slots are claimed with a
+ * compare-and-swap on the key, either when empty or else the one whose bucket
+ * holds the most tokens: a bucket that refilled completely belongs to an idle
+ * client, which is indistinguishable from a new one.  The new client takes
+ * the bucket over as it is, so evicting a busy client never hands out a full
+ * burst, and a full neighbourhood cannot be used to escape the limit.
+ **/
+RateBucket *ratelimit_bucket(uint64_t key, uint64_t now) {
+    size_t      start  = key & (RATELIMIT_SLOTS - 1);
+    RateBucket *oldest = NULL;
+    uint64_t    most   = 0;
+
+    for (size_t i = 0; i < RATELIMIT_PROBES; i++) {
+        RateBucket *bucket  = &Rates->buckets[(start + i) & (RATELIMIT_SLOTS - 1)];
+        uint64_t    current = atomic_load_explicit(&bucket->key, memory_order_acquire);
+
+        if (current == key) {
+            return bucket;
+        }
+        if (current == 0) {
+            if (atomic_compare_exchange_strong(&bucket->key, &current, key) || current == key) {
+                return bucket;
+            }
+            continue;
+        }
+
+        uint64_t time;
+        uint64_t tokens = ratelimit_refill(atomic_load_explicit(&bucket->state, memory_order_relaxed), now, &time);
+        if (oldest == NULL || tokens > most) {
+            oldest = bucket;
+            most   = tokens;
+        }
+    }
+
+    uint64_t current = atomic_load_explicit(&oldest->key, memory_order_relaxed);
+    if (atomic_compare_exchange_strong(&oldest->key, &current, key) || current == key) {
+        return oldest;
+    }
+    return NULL;
+}
+
+/**
+ * Take token from client's bucket.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether or not the client is within its rate.
+ *
+ * This is called right after accept, before any parsing.  Unix domain socket
+ * peers (a local proxy, not a client address) are always admitted.  A client
+ * that cannot be given a bucket (it lost the race for every slot around its
+ * key to concurrent claims) is refused, so the limit fails closed.
+ **/
+bool ratelimit_admit(Request *r) {
+    if (Rates == NULL || r->addr.ss_family == AF_UNIX) {
+        return true;
+    }
+
+    uint64_t    now    = ratelimit_now();
+    RateBucket *bucket = ratelimit_bucket(ratelimit_key(&r->addr), now);
+    if (bucket == NULL) {
+        debug("Rate limiting %s (no bucket)", request_host(r));
+        return false;
+    }
+
+    uint64_t state = atomic_load_explicit(&bucket->state, memory_order_relaxed);
+    while (true) {
+        uint64_t time;
+        uint64_t tokens = ratelimit_refill(state, now, &time);
+        if (tokens < RATELIMIT_ONE) {
+            debug("Rate limiting %s", request_host(r));
+            return false;
+        }
+
+        uint64_t next = (time << (64 - RATELIMIT_TIME_BITS)) | (tokens - RATELIMIT_ONE);
+        if (atomic_compare_exchange_weak_explicit(&bucket->state, &state, next, memory_order_relaxed, memory_order_relaxed)) {
+            return true;
+        }
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
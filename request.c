@@ -1,15 +1,32 @@
 /* request.c: HTTP Request Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define REQUEST_LINGER          1000    /* Milliseconds to discard unread input */
+
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
+int parse_request_body_length(Request *r);
+int read_request_chunk_size(Request *r);
+void request_deadline(Request *r, unsigned timeout);
+void request_peer(Request *r);
+
+ssize_t request_receive(Request *r, char *buffer, size_t size);
+ssize_t request_fill(Request *r);
+char *  request_line(Request *r, char *buffer, size_t size);
 
 /**
  * Accept request from server socket.
@@ -22,50 +39,56 @@ int parse_request_headers(Request *r);
  *  1. Allocates a request struct initialized to 0.
  *  2. Initializes the headers list in the request struct.
  *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
+ *  4. Stores the client address in the request struct.
+ *  5. Sets up the input buffer and response for the request struct.
  *  6. Returns the request struct.
  *
+ * Input is read into the request's own buffer, enforcing the read deadlines
+ * (see request_receive).  Responses are written with the response builder,
+ * which counts the bytes sent for the access log.
+ *
+ * No lookups happen here: the address is only formatted when it is logged or
+ * passed to a CGI script (see request_host and request_hostname).  Neither
+ * does the TLS handshake of a connection to a TLS listener (see tls_accept).
+ *
  * The returned request struct must be deallocated using free_request.
  **/
 Request * accept_request(int sfd) {
     Request *r;
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(struct sockaddr_storage);
     int client_fd;
 
     r = calloc(1, sizeof(Request));
 
     /* Allocate request struct (zeroed) */
     r->fd = 0;
-    r->file = NULL;
+    r->input = r->input_buffer;
     r->method = NULL;
     r->uri = NULL;
     r->path = NULL;
     r->query = NULL;
     r->headers = NULL;
+    r->content_length = -1;
     /* Accept a client */
-    if ((client_fd = accept(sfd, &raddr, &rlen)) < 0) {
-        fprintf(stderr, "accept failed: %s\n", strerror(errno));
-        goto fail;
-    }
-    /* Lookup client information */
-    socklen_t hostlen = 0;
-    socklen_t servlen = 0;
-    int errcode = -1;
-    if ((errcode = getnameinfo(&raddr, rlen, r->host, hostlen, r->port, servlen, 0)) != 0){
-        fprintf(stderr, "getnameinfo failed %s\n", gai_strerror(errcode));
-        goto fail;
-    }
-    /* Open socket stream */
-    r->file = fdopen(client_fd, "w+");
-    if (!r->file) {
-        fprintf(stderr, "fdopen failed: %s\n", strerror(errno));
-        close(client_fd);
+    if ((client_fd = accept(sfd, (struct sockaddr *)&raddr, &rlen)) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+        }
         goto fail;
     }
-
-    log("Accepted request from %s:%s", r->host, r->port);
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    memcpy(&r->addr, &raddr, rlen < sizeof(r->addr) ? rlen : sizeof(r->addr));
+    r->fd = client_fd;
+    r->secure = tls_listener(sfd);
+    socket_configure_client(client_fd, raddr.ss_family);
+    request_deadline(r, HeaderTimeout);
+    response_init(&r->response, client_fd, true);
+
+    debug("Accepted request from %s:%s", request_host(r), request_port(r));
+    probe(accept, r->fd, &r->addr);
+    struct timespec mark = r->start;
+    metrics_stage(r, METRICS_STAGE_ACCEPT, &mark);
     return r;
 
 fail:
@@ -82,7 +105,7 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
+ *  1. Closes the TLS connection and the request socket.
  *  2. Frees all allocated strings in request struct.
  *  3. Frees all of the headers (including any allocated fields).
  *  4. Frees request struct.
@@ -91,10 +114,13 @@ void free_request(Request *r) {
     if (!r) {
         return;
     }
+    probe(free, r->fd, r->response.sent);
 
-    /* Close socket or fd */
-    close(r->fd);
-    fclose(r->file);
+    /* Close TLS connection and socket */
+    tls_close(r);
+    if (r->fd >= 0){
+        close(r->fd);
+    }
 
     /* Free allocated strings */
     free(r->method);
@@ -103,15 +129,270 @@ void free_request(Request *r) {
     free(r->query);
 
     /* Free headers */
-    if (r->headers != NULL){
-        free(r->headers->next);
-        free(r->headers);
+    for (Header *header = r->headers, *next; header != NULL; header = next){
+        next = header->next;
+        free(header->name);
+        free(header->value);
+        free(header);
     }
 
     /* Free request */
     free(r);
 }
 
+/**
+ * Set read deadline of request.
+ *
+ * @param   r           Request structure.
+ * @param   timeout     Milliseconds from now (0 to clear the deadline).
+ **/
+void request_deadline(Request *r, unsigned timeout) {
+    if (timeout == 0) {
+        r->deadline.tv_sec  = 0;
+        r->deadline.tv_nsec = 0;
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &r->deadline);
+    r->deadline.tv_sec  += timeout / 1000;
+    r->deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (r->deadline.tv_nsec >= 1000000000L) {
+        r->deadline.tv_sec  += 1;
+        r->deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Format client address and port (once, on first use).
+ *
+ * @param   r           Request structure.
+ *
+ * Addresses are always formatted numerically, so this never blocks on DNS.
+ * Unix domain peers have no address: they are named by the peer's process
+ * id.
+ **/
+void request_peer(Request *r) {
+    if (r->host[0]) {
+        return;
+    }
+
+    if (r->addr.ss_family == AF_UNIX){
+        struct ucred credentials;
+        socklen_t credlen = sizeof(credentials);
+        snprintf(r->host, sizeof(r->host), "unix");
+        if (getsockopt(r->fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credlen) == 0){
+            snprintf(r->port, sizeof(r->port), "%d", credentials.pid);
+        } else { snprintf(r->port, sizeof(r->port), "-"); }
+        return;
+    }
+
+    socklen_t length = r->addr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    int errcode = getnameinfo((struct sockaddr *)&r->addr, length, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST|NI_NUMERICSERV);
+    if (errcode != 0){
+        fprintf(stderr, "getnameinfo failed %s\n", gai_strerror(errcode));
+        snprintf(r->host, sizeof(r->host), "-");
+        snprintf(r->port, sizeof(r->port), "-");
+    }
+}
+
+/**
+ * Numeric address of client.
+ *
+ * @param   r           Request structure.
+ * @return  Client address (e.g. 127.0.0.1 or ::1, or unix).
+ **/
+const char *request_host(Request *r) {
+    request_peer(r);
+    return r->host;
+}
+
+/**
+ * Port of client.
+ *
+ * @param   r           Request structure.
+ * @return  Client port (or pid of a Unix domain peer).
+ **/
+const char *request_port(Request *r) {
+    request_peer(r);
+    return r->port;
+}
+
+/**
+ * Host name of client.
+ *
+ * @param   r           Request structure.
+ * @return  Cached host name of client, or its numeric address if host names
+ *          are disabled or not resolved yet (see resolve_lookup).
+ **/
+const char *request_hostname(Request *r) {
+    if (!r->hostname[0] && !resolve_lookup(&r->addr, r->hostname, sizeof(r->hostname))){
+        return request_host(r);
+    }
+    return r->hostname;
+}
+
+/**
+ * Read from client socket.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to store data.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read, 0 on end of file, or -1 on error.
+ *
+ * Connections to a TLS listener are decrypted (see tls_read).
+ *
+ * If the request has a deadline, each read waits at most until then; a read
+ * that misses it fails with ETIMEDOUT and marks the request as timed out.
+ * While a body is being received, every byte pushes the deadline back by
+ * 1/MinBodyRate seconds, so a client must sustain MinBodyRate on average;
+ * but never past BodyTimeout from now, so a client that sent quickly cannot
+ * then stall on the credit it built up.
+ **/
+ssize_t request_receive(Request *r, char *buffer, size_t size) {
+    ssize_t nread;
+
+    do {
+        if (r->deadline.tv_sec != 0 && !tls_pending(r)) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t remaining = (r->deadline.tv_sec - now.tv_sec) * 1000LL + (r->deadline.tv_nsec - now.tv_nsec) / 1000000;
+            struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+            int ready = remaining > 0 ? poll(&pfd, 1, remaining) : 0;
+            if (ready < 0) {
+                nread = -1;
+                continue;
+            }
+            if (ready == 0) {
+                debug("Read deadline expired for %s:%s", request_host(r), request_port(r));
+                r->timed_out = true;
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        nread = r->tls != NULL ? tls_read(r, buffer, size) : read(r->fd, buffer, size);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread > 0 && r->deadline.tv_sec != 0 && MinBodyRate > 0 && request_has_body(r)) {
+        struct timespec extended = r->deadline;
+        int64_t credit = nread * 1000000000LL / MinBodyRate;
+        extended.tv_sec  += credit / 1000000000LL;
+        extended.tv_nsec += credit % 1000000000LL;
+        if (extended.tv_nsec >= 1000000000L) {
+            extended.tv_sec  += 1;
+            extended.tv_nsec -= 1000000000L;
+        }
+
+        /* Credit is not banked: the deadline is at most BodyTimeout away */
+        request_deadline(r, BodyTimeout);
+        if (extended.tv_sec < r->deadline.tv_sec ||
+            (extended.tv_sec == r->deadline.tv_sec && extended.tv_nsec < r->deadline.tv_nsec)) {
+            r->deadline = extended;
+        }
+    }
+    return nread;
+}
+
+/**
+ * Read more input into request buffer.
+ *
+ * @param   r           Request structure.
+ * @return  Number of bytes read, 0 on end of file, or -1 on error.
+ *
+ * Consumed input is discarded first.  Input that does not come from the
+ * socket (see input_closed) ends with the buffer.
+ **/
+ssize_t request_fill(Request *r) {
+    if (r->input_start == r->input_end) {
+        r->input_start = 0;
+        r->input_end   = 0;
+    }
+    if (r->input_closed || r->input_end == sizeof(r->input_buffer)) {
+        return 0;
+    }
+
+    ssize_t nread = request_receive(r, r->input_buffer + r->input_end, sizeof(r->input_buffer) - r->input_end);
+    if (nread > 0) {
+        r->input_end += nread;
+    }
+    return nread;
+}
+
+/**
+ * Read line of input.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to store line.
+ * @param   size        Size of buffer.
+ * @return  buffer, or NULL if no input is left.
+ *
+ * Like fgets(3), the line keeps its newline, and a line longer than the
+ * buffer is returned in parts.
+ **/
+char *request_line(Request *r, char *buffer, size_t size) {
+    size_t length = 0;
+
+    while (length + 1 < size) {
+        if (r->input_start == r->input_end && request_fill(r) <= 0) {
+            break;
+        }
+
+        char   *start = r->input + r->input_start;
+        size_t  want  = r->input_end - r->input_start;
+        if (want > size - 1 - length) {
+            want = size - 1 - length;
+        }
+        char *newline = memchr(start, '\n', want);
+        if (newline != NULL) {
+            want = newline - start + 1;
+        }
+        memcpy(buffer + length, start, want);
+        length         += want;
+        r->input_start += want;
+        if (newline != NULL) {
+            break;
+        }
+    }
+
+    if (length == 0) {
+        return NULL;
+    }
+    buffer[length] = '\0';
+    return buffer;
+}
+
+/**
+ * Read input.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to store data.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read, 0 on end of file, or -1 on error.
+ *
+ * Buffered input is returned first.  Otherwise reads of at least a buffer's
+ * size go straight to the socket, without a copy.
+ **/
+ssize_t request_read(Request *r, void *buffer, size_t size) {
+    if (r->input_start == r->input_end) {
+        if (r->input_closed) {
+            return 0;
+        }
+        if (size >= sizeof(r->input_buffer)) {
+            return request_receive(r, buffer, size);
+        }
+        ssize_t nread = request_fill(r);
+        if (nread <= 0) {
+            return nread;
+        }
+    }
+
+    size_t available = r->input_end - r->input_start;
+    if (available > size) {
+        available = size;
+    }
+    memcpy(buffer, r->input + r->input_start, available);
+    r->input_start += available;
+    return available;
+}
+
 /**
  * Parse HTTP Request.
  *
@@ -119,7 +400,8 @@ void free_request(Request *r) {
  * @return  -1 on error and 0 on success.
  *
  * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * headers, returning 0 on success, and -1 on error.  The request body itself
+ * is not read here; it is streamed later with read_request_body.
  **/
 int parse_request(Request *r) {
 
@@ -137,6 +419,11 @@ int parse_request(Request *r) {
         return -2;
     }
 
+    /* Determine length and coding of request body */
+    if (parse_request_body_length(r) != 0){
+        return -3;
+    }
+
     return 0;
 }
 
@@ -155,17 +442,18 @@ int parse_request(Request *r) {
  *  GET / HTTP/1.1
  *  GET /cgi.script?q=foo HTTP/1.0
  *
- * This function extracts the method, uri, and query (if it exists).
+ * This function extracts the method, uri, query (if it exists), and version.
  **/
 int parse_request_method(Request *r) {
     char buffer[BUFSIZ];
     char *method;
     char *uri;
     char *query;
+    char *version;
 
     /* Read line from socket */
-    if (fgets(buffer, BUFSIZ, r->file) == NULL) {
-        debug("fgets failed");
+    if (request_line(r, buffer, BUFSIZ) == NULL) {
+        debug("request_line failed");
         goto fail;
     }
     /* Parse method and uri */
@@ -177,6 +465,11 @@ int parse_request_method(Request *r) {
     if (uri == NULL){
         goto fail;
     }
+    version = strtok(NULL, WHITESPACE);
+    if (version != NULL && strncmp(version, "HTTP/", 5) == 0 &&
+        isdigit(version[5]) && version[6] == '.' && isdigit(version[7])){
+        r->version = (version[5] - '0') * 10 + (version[7] - '0');
+    }
 
     /* Parse query from uri */
     char *temp  = strchr(uri, '?');
@@ -238,10 +531,7 @@ int parse_request_headers(Request *r) {
 
     /* Parse headers from socket */
 
-    while(fgets(buffer, BUFSIZ, r->file)){
-        if (buffer == NULL){
-            goto fail;
-        }
+    while(request_line(r, buffer, BUFSIZ)){
         if (streq(buffer,"\n") || streq(buffer,"\r\n")){
             break;
         }
@@ -272,11 +562,8 @@ int parse_request_headers(Request *r) {
         temp->next = NULL;
         if (r->headers == NULL){
             r->headers = temp;
-        }
-        else if (r->headers->next == NULL){
-            curr = temp;
-            r->headers->next = curr;
         } else { curr->next = temp; }
+        curr = temp;
     }
 
 
@@ -291,4 +578,201 @@ fail:
     return -1;
 }
 
+/**
+ * Determine request body length and transfer coding.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * This records the Content-Length header (if any) and whether the body uses
+ * chunked transfer coding.  A malformed Content-Length is an error.
+ **/
+int parse_request_body_length(Request *r) {
+    for (struct header *header = r->headers; header != NULL; header = header->next) {
+        if (strcasecmp(header->name, "Content-Length") == 0) {
+            char *end;
+            errno = 0;
+            long long length = strtoll(header->value, &end, 10);
+            if (errno != 0 || end == header->value || *end != '\0' || length < 0) {
+                return -1;
+            }
+            r->content_length = length;
+        } else if (strcasecmp(header->name, "Transfer-Encoding") == 0) {
+            r->chunked = strcasestr(header->value, "chunked") != NULL;
+        }
+    }
+
+    /* Chunked transfer coding overrides Content-Length */
+    if (r->chunked) {
+        r->content_length = -1;
+    }
+    r->body_done = !request_has_body(r);
+
+    /* Headers are complete: the body (if any) gets its own deadline */
+    request_deadline(r, r->body_done ? 0 : BodyTimeout);
+    return 0;
+}
+
+/**
+ * Determine if request has a body.
+ *
+ * @param   r           Request structure.
+ * @return  Whether or not the request carries a body.
+ **/
+bool request_has_body(Request *r) {
+    return r->chunked || r->content_length > 0;
+}
+
+/**
+ * Read next chunk-size line of chunked request body.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * A chunk size of zero marks the last chunk, after which any trailer headers
+ * are consumed up to the terminating blank line.  On error, errno is set to
+ * EFBIG if the chunk alone exceeds MaxBodySize, and to ETIMEDOUT or EPROTO
+ * otherwise.
+ **/
+int read_request_chunk_size(Request *r) {
+    char buffer[BUFSIZ];
+    char *end;
+
+    if (request_line(r, buffer, BUFSIZ) == NULL) {
+        errno = r->timed_out ? ETIMEDOUT : EPROTO;
+        return -1;
+    }
+    errno = 0;
+    r->chunk_left = strtoul(buffer, &end, 16);
+    if (errno != 0 || end == buffer) {
+        errno = errno == ERANGE ? EFBIG : EPROTO;
+        return -1;
+    }
+    if (r->chunk_left > MaxBodySize) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (r->chunk_left == 0) {
+        do {
+            if (request_line(r, buffer, BUFSIZ) == NULL) {
+                errno = r->timed_out ? ETIMEDOUT : EPROTO;
+                return -1;
+            }
+        } while (!streq(buffer, "\n") && !streq(buffer, "\r\n"));
+        r->body_done = true;
+    }
+    return 0;
+}
+
+/**
+ * Read next portion of request body.
+ *
+ * @param   r           Request structure.
+ * @param   buffer      Buffer to store body data.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read, 0 at end of body, or -1 on error.
+ *
+ * This streams the body through the caller's buffer, decoding chunked
+ * transfer coding as necessary, so the whole body is never held in memory.
+ * If the body grows beyond MaxBodySize, errno is set to EFBIG and -1 is
+ * returned (ETIMEDOUT or EPROTO if the client is too slow or the body is
+ * malformed).
+ **/
+ssize_t read_request_body(Request *r, char *buffer, size_t size) {
+    size_t  want;
+    ssize_t nread;
+
+    if (r->body_done) {
+        return 0;
+    }
+
+    if (r->chunked) {
+        if (r->chunk_left == 0 && read_request_chunk_size(r) < 0) {
+            return -1;
+        }
+        if (r->body_done) {
+            return 0;
+        }
+        want = r->chunk_left;
+    } else {
+        want = r->content_length - r->body_read;
+    }
+
+    if (want > MaxBodySize - r->body_read) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (want > size) {
+        want = size;
+    }
+
+    nread = request_read(r, buffer, want);
+    if (nread <= 0) {
+        errno = r->timed_out ? ETIMEDOUT : EPROTO;
+        return -1;
+    }
+    r->body_read += nread;
+
+    if (r->chunked) {
+        r->chunk_left -= nread;
+        if (r->chunk_left == 0) {
+            /* Consume CRLF that terminates chunk data (anything else means
+             * the chunk size did not match its data) */
+            char crlf[3];
+            if (request_line(r, crlf, sizeof(crlf)) == NULL || (!streq(crlf, "\r\n") && !streq(crlf, "\n"))) {
+                errno = r->timed_out ? ETIMEDOUT : EPROTO;
+                return -1;
+            }
+        }
+    } else if (r->body_read == (size_t)r->content_length) {
+        r->body_done = true;
+    }
+    return nread;
+}
+
+/**
+ * Discard unread request body before closing connection.
+ *
+ * @param   r           Request structure.
+ *
+ * Closing a socket with unread input makes the kernel reset the connection,
+ * which can destroy an error response (such as 413) before the client reads
+ * it.  This half-closes the connection and discards input until the client
+ * closes its side, for at most REQUEST_LINGER milliseconds.  TLS connections
+ * (which still have to send close_notify) and input that does not come from
+ * the socket are left alone.
+ **/
+void request_linger(Request *r) {
+    char buffer[BUFSIZ];
+    struct timespec deadline;
+    struct timespec now;
+
+    if (r->tls != NULL || r->input_closed || shutdown(r->fd, SHUT_WR) < 0) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += REQUEST_LINGER / 1000;
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t remaining = (deadline.tv_sec - now.tv_sec) * 1000LL + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        struct pollfd pfd = {.fd = r->fd, .events = POLLIN};
+        int ready = remaining > 0 ? poll(&pfd, 1, remaining) : 0;
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return;
+        }
+        ssize_t nread = read(r->fd, buffer, sizeof(buffer));
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return;
+        }
+    }
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,283 @@
+/* resolve.c: Asynchronous Client Host Name Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define RESOLVE_SLOTS       1024        /* Cached addresses (power of two) */
+#define RESOLVE_NAME        256         /* Maximum cached host name length */
+
+/* Cached host name of one client address.  The resolver thread is the only
+ * writer; readers in any worker detect a concurrent update with the sequence
+ * number (odd while an update is in progress) and treat it as a miss.  An
+ * empty name caches a failed lookup. */
+
+typedef struct {
+    _Atomic uint32_t    sequence;       /*< Update sequence number */
+    uint8_t             address[16];    /*< IPv6 (or IPv4-mapped) address */
+    uint64_t            expires;        /*< Expiry time (ms, 0 if empty) */
+    char                name[RESOLVE_NAME]; /*< Host name ("" if unresolvable) */
+} ResolveEntry;
+
+typedef struct {
+    ResolveEntry        entries[RESOLVE_SLOTS];
+} ResolveCache;
+
+/* Internal Variables */
+
+ResolveCache *Resolved        = NULL;
+int           ResolveQueue[2] = {-1, -1};
+
+/* Internal Declarations */
+bool            resolve_address(const struct sockaddr_storage *addr, uint8_t *address);
+bool            resolve_confirm(const char *name, const uint8_t *address);
+ResolveEntry *  resolve_entry(const uint8_t *address);
+uint64_t        resolve_now(void);
+bool            resolve_read(ResolveEntry *entry, const uint8_t *address, char *name, size_t size, uint64_t *expires);
+void *          resolve_worker(void *arg);
+
+/**
+ * Initialize host name resolution.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This allocates the cache as anonymous shared memory, creates the lookup
+ * queue (a datagram socket pair), and starts the resolver thread.  It must be
+ * called before any workers are forked: workers only read the cache and
+ * queue addresses, while lookups run in the server process.  Nothing is done
+ * if HostnameTTL is 0.
+ **/
+int resolve_init(void) {
+    pthread_t thread;
+    sigset_t  all, saved;
+
+    if (HostnameTTL == 0) {
+        return 0;
+    }
+
+    Resolved = mmap(NULL, sizeof(ResolveCache), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (Resolved == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        Resolved = NULL;
+        return -1;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0, ResolveQueue) < 0) {
+        fprintf(stderr, "socketpair failed: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    /* Resolver blocks all signals, like the access log writer */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    if (pthread_create(&thread, NULL, resolve_worker, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        goto fail;
+    }
+    pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return 0;
+
+fail:
+    close(ResolveQueue[0]);
+    close(ResolveQueue[1]);
+    ResolveQueue[0] = ResolveQueue[1] = -1;
+    munmap(Resolved, sizeof(ResolveCache));
+    Resolved = NULL;
+    return -1;
+}
+
+/**
+ * Normalize client address.
+ *
+ * @param   addr        Client socket address.
+ * @param   address     Buffer for 16 byte address.
+ * @return  Whether or not the client has an IP address.
+ *
+ * IPv4 addresses are stored in IPv4-mapped form, so they share the cache
+ * with clients on dual-stack listeners.
+ **/
+bool resolve_address(const struct sockaddr_storage *addr, uint8_t *address) {
+    if (addr->ss_family == AF_INET) {
+        memset(address, 0, 10);
+        address[10] = address[11] = 0xff;
+        memcpy(address + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        return true;
+    }
+    if (addr->ss_family == AF_INET6) {
+        memcpy(address, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Cache slot of address (FNV-1a, direct-mapped).
+ *
+ * @param   address     Normalized 16 byte address.
+ * @return  Cache entry for address.
+ **/
+ResolveEntry *resolve_entry(const uint8_t *address) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < 16; i++) {
+        hash = (hash ^ address[i]) * UINT64_C(1099511628211);
+    }
+    return &Resolved->entries[hash & (RESOLVE_SLOTS - 1)];
+}
+
+/**
+ * Current time for cache entries.
+ *
+ * @return  Milliseconds since boot (CLOCK_MONOTONIC).
+ **/
+uint64_t resolve_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * UINT64_C(1000) + now.tv_nsec / 1000000;
+}
+
+/**
+ * Read cache entry.
+ *
+ * @param   entry       Cache entry.
+ * @param   address     Normalized 16 byte address.
+ * @param   name        Buffer for host name.
+ * @param   size        Size of buffer.
+ * @param   expires     Expiry time of entry.
+ * @return  Whether or not the entry holds address (and was read consistently).
+ **/
+bool resolve_read(ResolveEntry *entry, const uint8_t *address, char *name, size_t size, uint64_t *expires) {
+    uint32_t sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire);
+    if (sequence & 1) {
+        return false;
+    }
+
+    bool match = memcmp(entry->address, address, 16) == 0;
+    *expires   = entry->expires;
+    snprintf(name, size, "%.*s", RESOLVE_NAME - 1, entry->name);
+
+    atomic_thread_fence(memory_order_acquire);
+    return match && atomic_load_explicit(&entry->sequence, memory_order_relaxed) == sequence;
+}
+
+/**
+ * Look up cached host name of client.
+ *
+ * @param   addr        Client socket address.
+ * @param   name        Buffer for host name.
+ * @param   size        Size of buffer.
+ * @return  Whether or not a host name was copied to name.
+ *
+ * This never blocks: on a miss (or an expired entry) the address is queued
+ * for the resolver thread and the caller uses the numeric address for now.
+ * If the queue is full, the address is simply looked up again next time.
+ **/
+bool resolve_lookup(const struct sockaddr_storage *addr, char *name, size_t size) {
+    uint8_t  address[16];
+    uint64_t expires;
+
+    if (Resolved == NULL || !resolve_address(addr, address)) {
+        return false;
+    }
+
+    if (resolve_read(resolve_entry(address), address, name, size, &expires) && expires > resolve_now()) {
+        return name[0] != 0;
+    }
+
+    send(ResolveQueue[1], addr, sizeof(struct sockaddr_storage), MSG_DONTWAIT|MSG_NOSIGNAL);
+    return false;
+}
+
+/**
+ * Forward-confirm host name.
+ *
+ * @param   name        Host name from the reverse lookup.
+ * @param   address     Normalized 16 byte client address.
+ * @return  Whether or not name resolves back to address.
+ *
+ * Whoever controls the reverse zone of an address can claim any name, so a
+ * name is only used if one of its own addresses is the client's.
+ **/
+bool resolve_confirm(const char *name, const uint8_t *address) {
+    struct addrinfo  hints   = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *results = NULL;
+    bool             confirmed = false;
+
+    if (getaddrinfo(name, NULL, &hints, &results) != 0) {
+        return false;
+    }
+    for (struct addrinfo *p = results; p != NULL && !confirmed; p = p->ai_next) {
+        struct sockaddr_storage addr = {0};
+        uint8_t                 resolved[16];
+
+        memcpy(&addr, p->ai_addr, p->ai_addrlen < sizeof(addr) ? p->ai_addrlen : sizeof(addr));
+        confirmed = resolve_address(&addr, resolved) && memcmp(resolved, address, 16) == 0;
+    }
+    freeaddrinfo(results);
+    return confirmed;
+}
+
+/**
+ * Resolve queued addresses into the cache.
+ *
+ * @param   arg         Unused.
+ * @return  NULL (never returns).
+ *
+ * Addresses that were queued several times before their first lookup
+ * finished are skipped while their entry is fresh.  A name that does not
+ * resolve back to the address is cached like a failed lookup.
+ **/
+void *resolve_worker(void *arg) {
+    struct sockaddr_storage addr;
+    uint8_t  address[16];
+    char     name[RESOLVE_NAME];
+    uint64_t expires;
+
+    while (true) {
+        if (recv(ResolveQueue[0], &addr, sizeof(addr), 0) < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "recv failed: %s\n", strerror(errno));
+                return NULL;
+            }
+            continue;
+        }
+        if (!resolve_address(&addr, address)) {
+            continue;
+        }
+
+        ResolveEntry *entry = resolve_entry(address);
+        if (resolve_read(entry, address, name, sizeof(name), &expires) && expires > resolve_now()) {
+            continue;
+        }
+
+        socklen_t length = addr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+        if (getnameinfo((struct sockaddr *)&addr, length, name, sizeof(name), NULL, 0, NI_NAMEREQD) != 0 ||
+            !resolve_confirm(name, address)) {
+            name[0] = 0;
+        }
+        debug("Resolved %s", name[0] ? name : "(no name)");
+
+        uint32_t sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+        atomic_store_explicit(&entry->sequence, sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        memcpy(entry->address, address, 16);
+        memcpy(entry->name, name, sizeof(name));
+        entry->expires = resolve_now() + HostnameTTL * UINT64_C(1000);
+        atomic_store_explicit(&entry->sequence, sequence + 2, memory_order_release);
+    }
+    return NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,350 @@
+/* response.c: Vectored HTTP Response Builder */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define RESPONSE_SENDFILE_CHUNK (1<<20) /* Bytes per sendfile(2) call */
+
+/* Internal Declarations */
+char *  response_reserve(Response *response, size_t size);
+void    response_commit(Response *response, size_t length);
+int     response_write(Response *response, int flags);
+
+/**
+ * Initialize response builder.
+ *
+ * @param   response    Response structure.
+ * @param   fd          Destination file descriptor.
+ * @param   socket      Whether or not fd is a socket (so sendmsg(2) flags
+ *                      such as MSG_MORE apply).
+ **/
+void response_init(Response *response, int fd, bool socket) {
+    response->fd       = fd;
+    response->socket   = socket;
+    response->failed   = false;
+    response->more     = false;
+    response->tls      = NULL;
+    response->segments = 0;
+    response->used     = 0;
+    response->sent     = 0;
+}
+
+/**
+ * Reserve space in response buffer.
+ *
+ * @param   response    Response structure.
+ * @param   size        Number of bytes needed (at most RESPONSE_BUFFER).
+ * @return  Start of free space in buffer (or NULL if a write failed).
+ *
+ * When the buffer (or the segment list) is full, the pending segments are
+ * written first.
+ **/
+char *response_reserve(Response *response, size_t size) {
+    if (response->failed) {
+        return NULL;
+    }
+    if (size > RESPONSE_BUFFER - response->used || response->segments == RESPONSE_SEGMENTS) {
+        if (response_write(response, MSG_MORE) < 0) {
+            return NULL;
+        }
+    }
+    return response->buffer + response->used;
+}
+
+/**
+ * Append bytes written to reserved space to response.
+ *
+ * @param   response    Response structure.
+ * @param   length      Number of bytes written at response_reserve's result.
+ *
+ * The last segment is extended when it is contiguous.
+ **/
+void response_commit(Response *response, size_t length) {
+    char         *start = response->buffer + response->used;
+    struct iovec *last  = response->segments ? &response->iov[response->segments - 1] : NULL;
+
+    if (last != NULL && (char *)last->iov_base + last->iov_len == start) {
+        last->iov_len += length;
+    } else {
+        response->iov[response->segments].iov_base = start;
+        response->iov[response->segments].iov_len  = length;
+        response->segments++;
+    }
+    response->used += length;
+}
+
+/**
+ * Append formatted text to response.
+ *
+ * @param   response    Response structure.
+ * @param   format      printf(3) format string.
+ *
+ * Text is formatted into the response's buffer.  Text longer than the whole
+ * buffer is written on its own.
+ **/
+void response_printf(Response *response, const char *format, ...) {
+    va_list arguments;
+    char   *start = response_reserve(response, 0);
+    int     length;
+
+    if (start == NULL) {
+        return;
+    }
+
+    va_start(arguments, format);
+    length = vsnprintf(start, RESPONSE_BUFFER - response->used, format, arguments);
+    va_end(arguments);
+    if (length < 0) {
+        return;
+    }
+
+    if ((size_t)length >= RESPONSE_BUFFER - response->used) {
+        if ((size_t)length >= RESPONSE_BUFFER) {
+            char *text = malloc(length + 1);
+            if (text == NULL || response_write(response, MSG_MORE) < 0) {
+                free(text);
+                return;
+            }
+            va_start(arguments, format);
+            vsnprintf(text, length + 1, format, arguments);
+            va_end(arguments);
+            response_append(response, text, length);
+            response_write(response, MSG_MORE);
+            free(text);
+            return;
+        }
+        if ((start = response_reserve(response, length + 1)) == NULL) {
+            return;
+        }
+        va_start(arguments, format);
+        vsnprintf(start, length + 1, format, arguments);
+        va_end(arguments);
+    }
+    response_commit(response, length);
+}
+
+/**
+ * Append data to response without copying it.
+ *
+ * @param   response    Response structure.
+ * @param   data        Data to append.
+ * @param   size        Number of bytes to append.
+ *
+ * The data must remain valid until the next response_flush.
+ **/
+void response_append(Response *response, const void *data, size_t size) {
+    if (response->failed || size == 0) {
+        return;
+    }
+    if (response->segments == RESPONSE_SEGMENTS && response_write(response, MSG_MORE) < 0) {
+        return;
+    }
+    response->iov[response->segments].iov_base = (void *)data;
+    response->iov[response->segments].iov_len  = size;
+    response->segments++;
+}
+
+/**
+ * Write pending segments.
+ *
+ * @param   response    Response structure.
+ * @param   flags       sendmsg(2) flags (ignored unless the destination is a
+ *                      socket).
+ * @return  -1 on error and 0 on success.
+ *
+ * All segments are written with one writev(2) or sendmsg(2) call, repeated
+ * only for partial writes (or as TLS records, see tls_write).  The buffer is
+ * reset afterwards.
+ **/
+int response_write(Response *response, int flags) {
+    struct iovec *iov      = response->iov;
+    size_t        segments = response->segments;
+
+    while (segments > 0 && !response->failed) {
+        ssize_t nwritten;
+        if (response->tls != NULL) {
+            nwritten = tls_write(response->tls, iov, segments);
+        } else if (response->socket) {
+            struct msghdr message = {.msg_iov = iov, .msg_iovlen = segments};
+            nwritten = sendmsg(response->fd, &message, flags | MSG_NOSIGNAL);
+        } else {
+            nwritten = writev(response->fd, iov, segments);
+        }
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            response->failed = true;
+            break;
+        }
+
+        response->sent += nwritten;
+        response->more  = response->socket && (flags & MSG_MORE);
+        while (segments > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            segments--;
+        }
+        if (segments > 0) {
+            iov->iov_base  = (char *)iov->iov_base + nwritten;
+            iov->iov_len  -= nwritten;
+        }
+    }
+
+    response->segments = 0;
+    response->used     = 0;
+    return response->failed ? -1 : 0;
+}
+
+/**
+ * Flush response.
+ *
+ * @param   response    Response structure.
+ * @return  -1 if any part of the response could not be written and 0 on
+ *          success.
+ *
+ * If nothing is pending but the last write was sent with MSG_MORE, the
+ * kernel is told to push what it held back (by clearing TCP_CORK, which
+ * sends pending frames even if the socket was not corked).
+ **/
+int response_flush(Response *response) {
+    int off = 0;
+
+    if (response->segments == 0 && response->more && !response->failed) {
+        response->more = false;
+        if (setsockopt(response->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) < 0) {
+            debug("setsockopt TCP_CORK failed: %s", strerror(errno));
+        }
+        return 0;
+    }
+    return response_write(response, 0);
+}
+
+/**
+ * Append file contents to response.
+ *
+ * @param   response    Response structure.
+ * @param   fd          File descriptor to send.
+ * @param   offset      Offset in file to send from (to end of file).
+ * @return  -1 on error and 0 on success.
+ *
+ * Pending segments are written first with MSG_MORE, so a small header block
+ * shares packets with the start of the file.  The file itself is sent with
+ * sendfile(2), without copying it through user space; destinations that do
+ * not support it fall back to read(2) and the builder.  So do TLS
+ * connections, unless the kernel encrypts their records (kTLS).
+ **/
+int response_sendfile(Response *response, int fd, off_t offset) {
+    char    buffer[BUFSIZ];
+    ssize_t nsent;
+
+    if (response_write(response, MSG_MORE) < 0) {
+        return -1;
+    }
+    if (response->tls != NULL) {
+        goto fallback;
+    }
+
+    while ((nsent = sendfile(response->fd, fd, &offset, RESPONSE_SENDFILE_CHUNK)) != 0) {
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                goto fallback;
+            }
+            fprintf(stderr, "sendfile failed: %s\n", strerror(errno));
+            response->failed = true;
+            return -1;
+        }
+        response->sent += nsent;
+    }
+    response->more = false;
+    return 0;
+
+fallback:
+    while ((nsent = pread(fd, buffer, sizeof(buffer), offset)) != 0) {
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "read failed: %s\n", strerror(errno));
+            response->failed = true;
+            return -1;
+        }
+        offset += nsent;
+        response_append(response, buffer, nsent);
+        if (response_write(response, MSG_MORE) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Append status line and Date header to response.
+ *
+ * @param   response    Response structure.
+ * @param   status      HTTP status.
+ *
+ * The status line is a ready-made string (see http_status_line) and is not
+ * copied; the Date header is copied from the shared one (see date_header).
+ **/
+void response_status(Response *response, HTTPStatus status) {
+    size_t      length;
+    const char *line = http_status_line(status, &length);
+
+    if (line != NULL) {
+        response_append(response, line, length);
+    }
+    response_date(response);
+}
+
+/**
+ * Append Date header to response.
+ *
+ * @param   response    Response structure.
+ **/
+void response_date(Response *response) {
+    char *start = response_reserve(response, DATE_HEADER_SIZE);
+    if (start != NULL) {
+        response_commit(response, date_header(start));
+    }
+}
+
+/**
+ * Append Content-Length header to response.
+ *
+ * @param   response    Response structure.
+ * @param   length      Length of response body.
+ **/
+void response_content_length(Response *response, uint64_t length) {
+    static const char Name[] = "Content-Length: ";
+    char *start = response_reserve(response, sizeof(Name) + 20 + 2);
+
+    if (start != NULL) {
+        char *p = start;
+        memcpy(p, Name, sizeof(Name) - 1);
+        p += sizeof(Name) - 1;
+        p += utoa(length, p);
+        *p++ = '\r';
+        *p++ = '\n';
+        response_commit(response, p - start);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
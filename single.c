@@ -10,28 +10,72 @@
 /**
  * Handle one HTTP request at a time.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * This returns once Shutdown is set; the server sockets are left open (they
+ * may be handed over to a new instance).
  **/
-int single_server(int sfd) {
+int single_server(int *sfds, size_t nsfds) {
+    worker_init(sfds, nsfds);
+
     /* Accept and handle HTTP request */
-    while (true) {
+    while (!Shutdown) {
+        /* Reap finished workers, rotate TLS ticket keys, sweep the CGI
+         * cache, and dump spans if requested */
+        worker_reap();
+        tls_rotate();
+        cache_sweep();
+        trace_poll();
+
     	  /* Accept request */
+        int sfd = socket_wait(sfds, nsfds);
+        if (sfd < 0) {
+            continue;
+        }
         Request *client_request = accept_request(sfd);
         if (!client_request) {
             continue;
         }
 
+        /* Reject clients over their rate */
+        if (!ratelimit_admit(client_request)) {
+            admission_reject(client_request, HTTP_STATUS_TOO_MANY_REQUESTS);
+            free_request(client_request);
+            continue;
+        }
+
+        /* Shed request if overloaded */
+        if (!admission_admit(client_request)) {
+            admission_reject(client_request, HTTP_STATUS_SERVICE_UNAVAILABLE);
+            free_request(client_request);
+            continue;
+        }
+
+        /* Hand TLS connections to a worker, so neither the handshake nor a
+         * long-lived connection (e.g. HTTP/2) holds up the server */
+        if (client_request->secure) {
+            pid_t pid = worker_fork(client_request);
+            if (pid == 0) {
+                HTTPStatus status = handle_request(client_request);
+                free_request(client_request);
+                exit(status != 0);
+            }
+            admission_release(client_request);
+            free_request(client_request);
+            continue;
+        }
+
 	      /* Handle request */
         handle_request(client_request);
+        admission_release(client_request);
 
 	      /* Free request */
         free_request(client_request);
 
     }
 
-    /* Close server socket */
-    close(sfd);
     return EXIT_SUCCESS;
 }
 
@@ -1,24 +1,236 @@
 /* socket.c: Simple Socket Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define HANDOFF_ENV         "SPIDEY_HANDOFF"    /* Socket (fd) to receive listeners from */
+#define HANDOFF_TIMEOUT     5000                /* Milliseconds to wait for new instance */
+
+/* Internal Declarations */
+int     socket_configure_listener(int fd, int family);
+void    socket_log_options(int fd);
+int     socket_listen_unix(const char *path, int *fds, size_t size);
+int     socket_receive(int fd, int *fds, size_t size);
+
+/* Internal Variables */
+int     HandoffFd = -1;                 /* Handoff socket until socket_ready */
+
+/**
+ * Parse listener option setting.
+ *
+ * @param   setting     Option of the form key=value.
+ * @return  -1 on error and 0 on success.
+ *
+ * Recognized keys are backlog, defer_accept (seconds), fastopen (queue
+ * length), rcvbuf and sndbuf (bytes), unix_mode (permissions of Unix domain
+ * sockets, e.g. 0660), and the boolean policies reuseaddr, nodelay and cork.
+ * Values may be given in decimal, octal (leading 0) or hex (leading 0x).  A
+ * value that is not a number, or out of range for its key (booleans are 0 or
+ * 1, unix_mode at most 0777, anything else at most INT_MAX), is an error.
+ **/
+int socket_option(const char *setting) {
+    const char *equals = strchr(setting, '=');
+    if (equals == NULL || equals[1] == '\0') {
+        return -1;
+    }
+
+    char *end;
+    errno = 0;
+    long  value = strtol(equals + 1, &end, 0);
+    if (errno != 0 || end == equals + 1 || *end != '\0' || value < 0) {
+        return -1;
+    }
+
+    size_t length = equals - setting;
+    struct {
+        const char *key;
+        int        *field;
+        long        maximum;
+    } options[] = {
+        {"backlog",         &ListenOptions.backlog,         INT_MAX},
+        {"defer_accept",    &ListenOptions.defer_accept,    INT_MAX},
+        {"fastopen",        &ListenOptions.fastopen,        INT_MAX},
+        {"rcvbuf",          &ListenOptions.rcvbuf,          INT_MAX},
+        {"sndbuf",          &ListenOptions.sndbuf,          INT_MAX},
+        {"reuseaddr",       &ListenOptions.reuseaddr,       1},
+        {"nodelay",         &ListenOptions.nodelay,         1},
+        {"cork",            &ListenOptions.cork,            1},
+        {"unix_mode",       &ListenOptions.unix_mode,       0777},
+    };
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+        if (strlen(options[i].key) == length && strncmp(options[i].key, setting, length) == 0) {
+            if (value > options[i].maximum) {
+                return -1;
+            }
+            *options[i].field = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Apply listener options to socket before bind.
+ *
+ * @param   fd          Server socket file descriptor.
+ * @param   family      Address family of socket.
+ * @return  -1 on error and 0 on success.
+ *
+ * TCP options are skipped for Unix domain sockets.
+ **/
+int socket_configure_listener(int fd, int family) {
+    if (ListenOptions.reuseaddr && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &ListenOptions.reuseaddr, sizeof(int)) < 0) {
+        fprintf(stderr, "setsockopt SO_REUSEADDR failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ListenOptions.rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ListenOptions.rcvbuf, sizeof(int)) < 0) {
+        fprintf(stderr, "setsockopt SO_RCVBUF failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ListenOptions.sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &ListenOptions.sndbuf, sizeof(int)) < 0) {
+        fprintf(stderr, "setsockopt SO_SNDBUF failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (family == AF_UNIX) {
+        return 0;
+    }
+    if (ListenOptions.defer_accept && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &ListenOptions.defer_accept, sizeof(int)) < 0) {
+        fprintf(stderr, "setsockopt TCP_DEFER_ACCEPT failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ListenOptions.fastopen && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &ListenOptions.fastopen, sizeof(int)) < 0) {
+        fprintf(stderr, "setsockopt TCP_FASTOPEN failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Log effective listener options.
+ *
+ * @param   fd          Server socket file descriptor.
+ *
+ * Values are read back from the kernel, which may adjust them (e.g. socket
+ * buffer sizes are doubled and capped by net.core.rmem_max/wmem_max).
+ **/
+void socket_log_options(int fd) {
+    int       reuseaddr = 0, rcvbuf = 0, sndbuf = 0, defer_accept = 0, fastopen = 0;
+    socklen_t length;
+
+    length = sizeof(int); getsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, &length);
+    length = sizeof(int); getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &length);
+    length = sizeof(int); getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &length);
+    length = sizeof(int); getsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, &length);
+    length = sizeof(int); getsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, &length);
+
+    log("Listener options: backlog=%d reuseaddr=%d rcvbuf=%d sndbuf=%d defer_accept=%d fastopen=%d nodelay=%d cork=%d",
+        ListenOptions.backlog, reuseaddr, rcvbuf, sndbuf, defer_accept, fastopen, ListenOptions.nodelay, ListenOptions.cork);
+}
+
 /**
- * Allocate socket, bind it, and listen to specified port.
+ * Apply response policy to accepted client socket.
  *
- * @param   port        Port number to bind to and listen on.
- * @return  Allocated server socket file descriptor.
+ * @param   fd          Client socket file descriptor.
+ * @param   family      Address family of client.
+ *
+ * With cork, partial frames are held back until socket_uncork, so response
+ * headers and the start of the body leave in full segments.  Unix domain
+ * sockets have no such options and are left alone.
+ **/
+void socket_configure_client(int fd, int family) {
+    if (family == AF_UNIX) {
+        return;
+    }
+    if (ListenOptions.nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &ListenOptions.nodelay, sizeof(int)) < 0) {
+        debug("setsockopt TCP_NODELAY failed: %s", strerror(errno));
+    }
+    if (ListenOptions.cork && setsockopt(fd, IPPROTO_TCP, TCP_CORK, &ListenOptions.cork, sizeof(int)) < 0) {
+        debug("setsockopt TCP_CORK failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * Send any data held back by cork.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   family      Address family of client.
  **/
-int socket_listen(const char *port) {
+void socket_uncork(int fd, int family) {
+    int off = 0;
+    if (ListenOptions.cork && family != AF_UNIX && setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) < 0) {
+        debug("setsockopt TCP_CORK failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * Allocate sockets, bind them, and listen on specified address.
+ *
+ * @param   address     Address of the form port, host:port, [host]:port
+ *                      (host * or empty for all interfaces), or unix:path
+ *                      (unix:@name for the abstract namespace), optionally
+ *                      prefixed with tls: (see tls_init).
+ * @param   fds         Array to store server socket file descriptors in.
+ * @param   size        Number of free entries in fds.
+ * @return  Number of server sockets allocated (or -1 on error).
+ *
+ * Every address the host resolves to is bound, so a wildcard address gets
+ * both an IPv4 and an IPv6 listener (IPv6 sockets are IPV6_V6ONLY so the two
+ * do not conflict).  Each socket is configured with ListenOptions before it
+ * is bound.
+ **/
+int socket_listen(const char *address, int *fds, size_t size) {
+    char  buffer[NI_MAXHOST + NI_MAXSERV];
+    char *host = NULL;
+    char *port = buffer;
+
+    if (strncmp(address, "tls:", 4) == 0) {
+        address += 4;
+    }
+    if (strncmp(address, "unix:", 5) == 0) {
+        return socket_listen_unix(address + 5, fds, size);
+    }
+
+    /* Split host and port */
+    snprintf(buffer, sizeof(buffer), "%s", address);
+    if (buffer[0] == '[') {
+        char *bracket = strchr(buffer, ']');
+        if (bracket == NULL || bracket[1] != ':') {
+            fprintf(stderr, "invalid address: %s\n", address);
+            return -1;
+        }
+        *bracket = '\0';
+        host = buffer + 1;
+        port = bracket + 2;
+    } else if (strchr(buffer, ':') != NULL && strchr(buffer, ':') == strrchr(buffer, ':')) {
+        port  = strchr(buffer, ':');
+        *port++ = '\0';
+        host  = buffer;
+    }
+    if (host != NULL && (host[0] == '\0' || streq(host, "*"))) {
+        host = NULL;
+    }
+
     /* Lookup server address information */
     struct addrinfo hints = {
         .ai_family      = AF_UNSPEC,    /* Use either IPv4 or IPv6 */
@@ -27,37 +239,414 @@ int socket_listen(const char *port) {
     };
     struct addrinfo *results;
     int status;
-    if ((status = getaddrinfo(NULL, port, &hints, &results)) != 0)  {
+    if ((status = getaddrinfo(host, port, &hints, &results)) != 0)  {
         fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
         return -1;
     }
 
-    /* For each server entry, allocate socket and try to connect */
-    int socket_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
+    /* For each server entry, allocate socket and listen on it */
+    size_t nfds = 0;
+    for (struct addrinfo *p = results; p != NULL && nfds < size; p = p->ai_next) {
 	      /* Allocate socket */
-        if ((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+        int socket_fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (socket_fd < 0) {
             fprintf(stderr, "socket failed: %s\n", strerror(errno));
             continue;
+        }
+        /* Configure socket */
+        int on = 1;
+        if (p->ai_family == AF_INET6 && setsockopt(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) < 0) {
+            fprintf(stderr, "setsockopt IPV6_V6ONLY failed: %s\n", strerror(errno));
+            close(socket_fd);
+            continue;
+        }
+        if (socket_configure_listener(socket_fd, p->ai_family) < 0) {
+            close(socket_fd);
+            continue;
         }
 	       /* Bind socket */
         if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
             fprintf(stderr, "bind failed: %s\n", strerror(errno));
             close(socket_fd);
-            socket_fd = -1;
             continue;
         }
     	  /* Listen to socket */
-        if (listen(socket_fd, SOMAXCONN) < 0) {
+        if (listen(socket_fd, ListenOptions.backlog) < 0) {
             fprintf(stderr, "listen failed: %s\n", strerror(errno));
             close(socket_fd);
-            socket_fd = -1;
             continue;
         }
+
+        char name[NI_MAXHOST], service[NI_MAXSERV];
+        if (getnameinfo(p->ai_addr, p->ai_addrlen, name, sizeof(name), service, sizeof(service), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+            log("Listening on %s%s%s:%s", p->ai_family == AF_INET6 ? "[" : "", name, p->ai_family == AF_INET6 ? "]" : "", service);
+        }
+        socket_log_options(socket_fd);
+        fds[nfds++] = socket_fd;
     }
 
     freeaddrinfo(results);
-    return socket_fd;
+    return nfds > 0 ? (int)nfds : -1;
+}
+
+/**
+ * Allocate Unix domain socket, bind it, and listen on it.
+ *
+ * @param   path        Filesystem path, or @name for an abstract socket.
+ * @param   fds         Array to store server socket file descriptor in.
+ * @param   size        Number of free entries in fds.
+ * @return  Number of server sockets allocated (or -1 on error).
+ *
+ * A stale socket left at path by a previous run is removed first.  The
+ * socket file gets the permissions in ListenOptions.unix_mode (if set); it is
+ * created with mode 0600 and only then widened to them, so it is never
+ * reachable by anyone else in between.
+ **/
+int socket_listen_unix(const char *path, int *fds, size_t size) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    socklen_t length;
+    bool      abstract = path[0] == '@';
+
+    if (size == 0 || path[0] == '\0' || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "invalid unix socket path: %s\n", path);
+        return -1;
+    }
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    length = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+    if (abstract) {
+        addr.sun_path[0] = '\0';
+        length--;
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        fprintf(stderr, "socket failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (socket_configure_listener(socket_fd, AF_UNIX) < 0) {
+        goto fail;
+    }
+
+    struct stat s;
+    if (!abstract && lstat(path, &s) == 0 && S_ISSOCK(s.st_mode) && unlink(path) < 0) {
+        fprintf(stderr, "unlink %s failed: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    mode_t mask = 0;
+    if (ListenOptions.unix_mode) {
+        mask = umask(0177);
+    }
+    int bound = bind(socket_fd, (struct sockaddr *)&addr, length);
+    if (ListenOptions.unix_mode) {
+        umask(mask);
+    }
+    if (bound < 0) {
+        fprintf(stderr, "bind %s failed: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    if (!abstract && ListenOptions.unix_mode && chmod(path, ListenOptions.unix_mode) < 0) {
+        fprintf(stderr, "chmod %s failed: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    if (listen(socket_fd, ListenOptions.backlog) < 0) {
+        fprintf(stderr, "listen failed: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    log("Listening on unix:%s", path);
+    fds[0] = socket_fd;
+    return 1;
+
+fail:
+    close(socket_fd);
+    return -1;
+}
+
+/**
+ * Wait for a connection on any server socket.
+ *
+ * @param   fds         Server socket file descriptors.
+ * @param   nfds        Number of server sockets.
+ * @return  Server socket with a pending connection (or -1 on error, e.g.
+ *          when interrupted by a signal).
+ *
+ * Ready sockets are served round-robin so a busy listener cannot starve the
+ * others.  With a single listener, accept blocks on it directly.
+ **/
+int socket_wait(const int *fds, size_t nfds) {
+    static size_t next = 0;
+    struct pollfd pfds[MAX_LISTENERS];
+
+    if (nfds == 1) {
+        return fds[0];
+    }
+
+    for (size_t i = 0; i < nfds; i++) {
+        pfds[i].fd      = fds[i];
+        pfds[i].events  = POLLIN;
+        pfds[i].revents = 0;
+    }
+    if (poll(pfds, nfds, -1) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+        }
+        return -1;
+    }
+
+    for (size_t i = 0; i < nfds; i++) {
+        size_t index = (next + i) % nfds;
+        if (pfds[index].revents & POLLIN) {
+            next = index + 1;
+            return fds[index];
+        }
+    }
+    return -1;
+}
+
+/**
+ * Take over listening sockets from systemd or a previous instance.
+ *
+ * @param   fds         Array to store server socket file descriptors in.
+ * @param   size        Number of entries in fds.
+ * @return  Number of server sockets inherited (0 if none, -1 on error).
+ *
+ * With socket activation, systemd passes LISTEN_FDS sockets starting at fd 3
+ * (when LISTEN_PID is our pid).  An instance started by socket_handoff finds
+ * the descriptor of its end of the handoff socket in SPIDEY_HANDOFF instead,
+ * and must confirm the handoff with socket_ready once it can serve.  Either
+ * way, the environment is cleared so CGI scripts do not see it.
+ **/
+int socket_inherit(int *fds, size_t size) {
+    const char *pid    = getenv("LISTEN_PID");
+    const char *count  = getenv("LISTEN_FDS");
+    const char *handoff = getenv(HANDOFF_ENV);
+    int         nfds   = 0;
+
+    if (pid != NULL && count != NULL && strtol(pid, NULL, 10) == getpid()) {
+        nfds = strtol(count, NULL, 10);
+        if (nfds < 0 || (size_t)nfds > size) {
+            fprintf(stderr, "cannot inherit %s sockets\n", count);
+            return -1;
+        }
+        for (int i = 0; i < nfds; i++) {
+            fds[i] = 3 + i;
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        log("Inherited %d listener%s from systemd", nfds, nfds == 1 ? "" : "s");
+    } else if (handoff != NULL) {
+        char *end;
+        errno = 0;
+        long fd = strtol(handoff, &end, 10);
+        if (errno != 0 || end == handoff || *end != '\0' || fd <= STDERR_FILENO || fd > INT_MAX) {
+            fprintf(stderr, "invalid %s: %s\n", HANDOFF_ENV, handoff);
+            return -1;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        nfds = socket_receive(fd, fds, size);
+        if (nfds < 0) {
+            close(fd);
+            return -1;
+        }
+        HandoffFd = fd;
+        log("Inherited %d listener%s from previous instance", nfds, nfds == 1 ? "" : "s");
+    }
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    unsetenv(HANDOFF_ENV);
+    return nfds;
+}
+
+/**
+ * Receive listening sockets from previous instance.
+ *
+ * @param   fd          This instance's end of the handoff socket.
+ * @param   fds         Array to store server socket file descriptors in.
+ * @param   size        Number of entries in fds.
+ * @return  Number of server sockets received (or -1 on error).
+ *
+ * The sockets arrive as SCM_RIGHTS ancillary data.
+ **/
+int socket_receive(int fd, int *fds, size_t size) {
+    char   byte;
+    char   control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    struct iovec  iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr message = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t nread;
+    do {
+        nread = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    } while (nread < 0 && errno == EINTR);
+    if (nread <= 0) {
+        fprintf(stderr, "recvmsg failed: %s\n", nread < 0 ? strerror(errno) : "connection closed");
+        return -1;
+    }
+
+    int nfds = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&message); c != NULL; c = CMSG_NXTHDR(&message, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int received;
+            memcpy(&received, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if ((size_t)nfds < size) {
+                fds[nfds++] = received;
+            } else {
+                close(received);
+            }
+        }
+    }
+
+    if (nfds == 0) {
+        fprintf(stderr, "no listeners received from previous instance\n");
+        return -1;
+    }
+    return nfds;
+}
+
+/**
+ * Confirm handoff to previous instance.
+ *
+ * @return  -1 on error and 0 on success (or if there was no handoff).
+ *
+ * This must be called once the server is initialized: until then, the
+ * previous instance keeps its listeners and resumes accepting if this
+ * instance fails (or does not confirm within HANDOFF_TIMEOUT).  The previous
+ * instance answers the confirmation only if it then stops accepting, so an
+ * error here means it resumed and this instance must not serve as well.
+ **/
+int socket_ready(void) {
+    if (HandoffFd < 0) {
+        return 0;
+    }
+
+    char byte;
+    struct pollfd pfd = {.fd = HandoffFd, .events = POLLIN};
+    int ready = -1;
+    if (send(HandoffFd, "!", 1, MSG_NOSIGNAL) == 1) {
+        do {
+            ready = poll(&pfd, 1, HANDOFF_TIMEOUT);
+        } while (ready < 0 && errno == EINTR);
+    }
+    if (ready <= 0 || read(HandoffFd, &byte, 1) != 1) {
+        fprintf(stderr, "previous instance did not release listeners\n");
+        close(HandoffFd);
+        HandoffFd = -1;
+        return -1;
+    }
+    close(HandoffFd);
+    HandoffFd = -1;
+    return 0;
+}
+
+/**
+ * Hand listening sockets over to a new instance of the server.
+ *
+ * @param   fds         Server socket file descriptors.
+ * @param   nfds        Number of server sockets.
+ * @param   argv        Arguments to start new instance with.
+ * @return  -1 on error and 0 on success.
+ *
+ * The new instance is started from the same executable and arguments (via
+ * a double fork, so it is not our child and does not hold up draining).  It
+ * inherits one end of a socket pair, over which it is passed the sockets with
+ * SCM_RIGHTS, so no other process can ask for them.  It confirms once it is
+ * initialized (see socket_ready); if it fails or does not confirm within
+ * HANDOFF_TIMEOUT, the handoff fails and the caller should resume
+ * accepting.  Connections that arrive in the meantime wait in the listen
+ * backlog, so none are dropped.  On success, the caller should stop
+ * accepting and drain its own requests.
+ **/
+int socket_handoff(const int *fds, size_t nfds, char *argv[]) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        fprintf(stderr, "socketpair failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Start new instance */
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        if (fork() != 0) {
+            _exit(EXIT_SUCCESS);
+        }
+        /* Keep our end of the pair open across exec (only) */
+        char name[16];
+        snprintf(name, sizeof(name), "%d", pair[1]);
+        setenv(HANDOFF_ENV, name, 1);
+        fcntl(pair[1], F_SETFD, 0);
+
+        /* Exec the binary by its real path (not /proc/self/exe), so the new
+         * instance keeps the name spidey for ps and pkill */
+        char    path[PATH_MAX];
+        ssize_t size = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        if (size > 0) {
+            path[size] = 0;
+            execv(path, argv);
+        }
+        execvp(argv[0], argv);
+        fprintf(stderr, "exec %s failed: %s\n", argv[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    waitpid(pid, NULL, 0);
+    close(pair[1]);
+
+    /* Send listeners and wait for new instance to confirm it is ready */
+    char   control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    struct iovec  iov = {.iov_base = (char *)"L", .iov_len = 1};
+    struct msghdr message = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * nfds),
+    };
+    memset(control, 0, sizeof(control));
+    struct cmsghdr *c = CMSG_FIRSTHDR(&message);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type  = SCM_RIGHTS;
+    c->cmsg_len   = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+
+    char byte;
+    int  ready;
+    struct pollfd pfd = {.fd = pair[0], .events = POLLIN};
+    if (sendmsg(pair[0], &message, MSG_NOSIGNAL) < 0) {
+        fprintf(stderr, "sendmsg failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    do {
+        ready = poll(&pfd, 1, HANDOFF_TIMEOUT);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0 || read(pair[0], &byte, 1) != 1) {
+        fprintf(stderr, "new instance did not start\n");
+        goto fail;
+    }
+
+    /* Release listeners (the new instance serves only once it sees this) */
+    if (send(pair[0], "!", 1, MSG_NOSIGNAL) != 1) {
+        fprintf(stderr, "new instance exited: %s\n", strerror(errno));
+        goto fail;
+    }
+    close(pair[0]);
+    log("Handed %zu listener%s over to new instance", nfds, nfds == 1 ? "" : "s");
+    return 0;
+
+fail:
+    close(pair[0]);
+    return -1;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
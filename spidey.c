@@ -3,17 +3,12 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
 #include <unistd.h>
 
-/* Global Variables */
-char *Port	      = "9898";
-char *MimeTypesPath   = "/etc/mime.types";
-char *DefaultMimeType = "text/plain";
-char *RootPath	      = "www";
-
 /**
  * Display usage message and exit with specified status code.
  *
@@ -21,14 +16,35 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hAbBcCDefgHkKlLmMNpQrRsStT]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -A            Adapt in-flight limit to observed latency\n");
+    fprintf(stderr, "    -b bytes      Maximum request body size\n");
+    fprintf(stderr, "    -B requests   Requests a client may burst (default: rate)\n");
     fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -C path       CGI response cache directory\n");
+    fprintf(stderr, "    -D ms         Time allowed before request body must flow (default: 10000)\n");
+    fprintf(stderr, "    -e path       TLS certificate chain (PEM) for tls: listeners\n");
+    fprintf(stderr, "    -f format     Access log format (text or binary)\n");
+    fprintf(stderr, "    -g ms         Time allowed for requests in flight at shutdown (default: 30000)\n");
+    fprintf(stderr, "    -H ms         Time allowed to receive request headers (default: 10000)\n");
+    fprintf(stderr, "    -k path       TLS private key (PEM, default: certificate file)\n");
+    fprintf(stderr, "    -K headers    Request headers in CGI cache key (comma-separated)\n");
+    fprintf(stderr, "    -l path       Access log file (default: stderr)\n");
+    fprintf(stderr, "    -L max        Maximum requests in flight (503 when exceeded)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
-    fprintf(stderr, "    -p port       Port to listen on\n");
+    fprintf(stderr, "    -N seconds    Resolve client host names in the background, cached for seconds\n");
+    fprintf(stderr, "    -p address    [tls:][host:]port to listen on (repeatable, default: 9898)\n");
+    fprintf(stderr, "    -Q ms         Maximum time in accept queue (503 when exceeded)\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -R rate       Requests per second per client address (429 when exceeded)\n");
+    fprintf(stderr, "    -s key=value  Listener option (backlog, defer_accept, fastopen, rcvbuf,\n");
+    fprintf(stderr, "                  sndbuf, reuseaddr, nodelay, cork)\n");
+    fprintf(stderr, "    -S bytes      Minimum request body rate in bytes/s (default: 1024)\n");
+    fprintf(stderr, "    -t path       Dump slowest request spans to path on SIGUSR1\n");
+    fprintf(stderr, "    -T rate       Trace one out of every rate requests (default: 1)\n");
     exit(status);
 }
 
@@ -40,8 +56,12 @@ void usage(const char *progname, int status) {
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, MimeTypesPath, DefaultMimeType, Ports, RootPath,
+ * MaxBodySize, CacheDir, CacheKeyHeaders, AccessLogPath, AccessLogBinary,
+ * TracePath, TraceSampleRate, MaxInflight, QueueBudget, AdaptiveLimit,
+ * RateLimit, RateBurst, HeaderTimeout, BodyTimeout, MinBodyRate,
+ * HostnameTTL, TLSCertificatePath, TLSKeyPath, ListenOptions, and
+ * DrainTimeout if specified.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
 
@@ -53,6 +73,34 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             usage(argv[0], 0);
             return true;
         }
+        else if (streq(arg, "-A")){
+            AdaptiveLimit = true;
+            argind++;
+        }
+        else if (streq(arg, "-b")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            MaxBodySize = strtoull(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
+            argind++;
+        }
+        else if (streq(arg, "-B")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            RateBurst = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
+            argind++;
+        }
         else if (streq(arg, "-c")){
             char *ptr = argv[++argind];
             if (ptr == NULL){
@@ -67,6 +115,123 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             else { return false; }
             argind++;
         }
+        else if (streq(arg, "-C")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            if (ptr[0] == '-'){
+                return false;
+            }
+            CacheDir = argv[argind];
+            argind++;
+        }
+        else if (streq(arg, "-D")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            BodyTimeout = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
+            argind++;
+        }
+        else if (streq(arg, "-e")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            if (ptr[0] == '-'){
+                return false;
+            }
+            TLSCertificatePath = argv[argind];
+            argind++;
+        }
+        else if (streq(arg, "-f")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            if (streq(ptr, "text")){
+                AccessLogBinary = false;
+            }
+            else if (streq(ptr, "binary")){
+                AccessLogBinary = true;
+            }
+            else { return false; }
+            argind++;
+        }
+        else if (streq(arg, "-g")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            DrainTimeout = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
+            argind++;
+        }
+        else if (streq(arg, "-H")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            HeaderTimeout = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
+            argind++;
+        }
+        else if (streq(arg, "-k")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            if (ptr[0] == '-'){
+                return false;
+            }
+            TLSKeyPath = argv[argind];
+            argind++;
+        }
+        else if (streq(arg, "-K")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            if (ptr[0] == '-'){
+                return false;
+            }
+            CacheKeyHeaders = argv[argind];
+            argind++;
+        }
+        else if (streq(arg, "-l")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            if (ptr[0] == '-'){
+                return false;
+            }
+            AccessLogPath = argv[argind];
+            argind++;
+        }
+        else if (streq(arg, "-L")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            MaxInflight = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
+            argind++;
+        }
         else if (streq(arg, "-m")){
             char *ptr = argv[++argind];
             if (ptr == NULL){
@@ -89,6 +254,18 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             DefaultMimeType = argv[argind];
             argind++;
         }
+        else if (streq(arg, "-N")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            HostnameTTL = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
+            argind++;
+        }
         else if (streq(arg, "-p")){
             char *ptr = argv[++argind];
             if (ptr == NULL){
@@ -97,7 +274,22 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             if (ptr[0] == '-'){
                 return false;
             }
-            Port = argv[argind];
+            if (PortsCount == MAX_LISTENERS){
+                return false;
+            }
+            Ports[PortsCount++] = argv[argind];
+            argind++;
+        }
+        else if (streq(arg, "-Q")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            QueueBudget = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
             argind++;
         }
         else if (streq(arg, "-r")){
@@ -111,26 +303,192 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             RootPath = argv[argind];
             argind++;
         }
+        else if (streq(arg, "-R")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            RateLimit = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
+            argind++;
+        }
+        else if (streq(arg, "-s")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            if (socket_option(ptr) < 0){
+                fprintf(stderr, "Unknown or invalid listener option: %s\n", ptr);
+                return false;
+            }
+            argind++;
+        }
+        else if (streq(arg, "-S")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            MinBodyRate = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0'){
+                return false;
+            }
+            argind++;
+        }
+        else if (streq(arg, "-t")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            if (ptr[0] == '-'){
+                return false;
+            }
+            TracePath = argv[argind];
+            argind++;
+        }
+        else if (streq(arg, "-T")){
+            char *ptr = argv[++argind];
+            if (ptr == NULL){
+                return false;
+            }
+            char *end;
+            TraceSampleRate = strtoul(ptr, &end, 10);
+            if (end == ptr || *end != '\0' || TraceSampleRate == 0){
+                return false;
+            }
+            argind++;
+        }
+        else { return false; }
     }
     return true;
 }
 
+/**
+ * Request shutdown (signal handler).
+ *
+ * @param   signum      Signal number.
+ **/
+void shutdown_signal(int signum) {
+    Shutdown = 1;
+}
+
+/**
+ * Request handoff to new instance (signal handler).
+ *
+ * @param   signum      Signal number.
+ **/
+void restart_signal(int signum) {
+    Restart  = 1;
+    Shutdown = 1;
+}
+
+/**
+ * Wake server to reap workers (signal handler).
+ *
+ * @param   signum      Signal number.
+ **/
+void child_signal(int signum) {
+}
+
+/**
+ * Wait for requests in flight to finish.
+ *
+ * Forked workers are sent SIGTERM, which lets them finish their request (and
+ * makes HTTP/2 connections send GOAWAY), and are reaped until none are left
+ * or DrainTimeout passes.  Workers still running then are killed with their
+ * process groups, so their CGI scripts do not outlive the server.  Progress
+ * is logged every second and exported in the metrics.
+ **/
+void drain(void) {
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = now;
+    deadline.tv_sec  += DrainTimeout / 1000;
+    deadline.tv_nsec += (DrainTimeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L){
+        deadline.tv_sec  += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    metrics_drain(&deadline);
+    log("Draining %lld request(s) in flight (%u ms)", (long long)metrics_inflight(0), DrainTimeout);
+    worker_signal(SIGTERM, false);
+
+    time_t logged = now.tv_sec;
+    for (worker_reap(); worker_count() > 0; worker_reap()){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)){
+            log("Drain deadline passed, killing %lld request(s)", (long long)metrics_inflight(0));
+            worker_signal(SIGKILL, true);
+            return;
+        }
+        if (now.tv_sec != logged){
+            logged = now.tv_sec;
+            log("Draining: %lld request(s) in flight", (long long)metrics_inflight(0));
+        }
+        usleep(10000);
+    }
+    log("Drained");
+}
+
 /**
  * Parses command line options and starts appropriate server
  **/
 int main(int argc, char *argv[]) {
-    ServerMode mode;
+    ServerMode mode = SINGLE;
 
     /* Parse command line options */
     if (!parse_options(argc, argv, &mode)){
         usage(argv[0], 1);
         return EXIT_FAILURE;
     }
-    /* Listen to server socket */
-    int server_fd = socket_listen(Port);
-    if (server_fd < 0) {
+    /* Ignore broken connections (writes fail with EPIPE instead) */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Stop accepting on SIGTERM or SIGINT and exit normally (no SA_RESTART,
+     * so a blocked accept returns) */
+    struct sigaction action = {.sa_handler = shutdown_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    /* Hand listeners over to a new instance on SIGUSR2 */
+    action.sa_handler = restart_signal;
+    sigaction(SIGUSR2, &action, NULL);
+
+    /* Reap workers as they exit (also interrupts a blocked accept) */
+    action.sa_handler = child_signal;
+    action.sa_flags   = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &action, NULL);
+
+    /* Take over server sockets from systemd or a previous instance, or else
+     * listen on our own (all feed the same server) */
+    int    server_fds[MAX_LISTENERS];
+    size_t server_count = 0;
+    int    inherited = socket_inherit(server_fds, MAX_LISTENERS);
+    if (inherited < 0){
+        return EXIT_FAILURE;
+    }
+    server_count = inherited;
+    if (PortsCount == 0){
+        PortsCount = 1;
+    }
+    for (size_t i = 0; i < PortsCount && inherited == 0; i++){
+        int n = socket_listen(Ports[i], server_fds + server_count, MAX_LISTENERS - server_count);
+        if (n < 0){
+            return EXIT_FAILURE;
+        }
+        server_count += n;
+    }
+    /* Set up TLS listeners (before forking any workers, which share its
+     * session ticket keys) */
+    if (tls_init(server_fds, server_count) < 0){
         return EXIT_FAILURE;
     }
+
     /* Determine real RootPath */
     char buffer[BUFSIZ];
     RootPath = realpath(RootPath, buffer);
@@ -139,18 +497,87 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    log("Listening on port %s", Port);
+    /* Start access log writer (before forking any workers) */
+    if (accesslog_init(AccessLogPath) < 0){
+        return EXIT_FAILURE;
+    }
+    accesslog_start();
+
+    /* Allocate shared metrics (before forking any workers) */
+    if (metrics_init() < 0){
+        return EXIT_FAILURE;
+    }
+
+    /* Allocate shared admission counters (before forking any workers) */
+    if (admission_init() < 0){
+        return EXIT_FAILURE;
+    }
+
+    /* Allocate shared rate limit buckets (before forking any workers) */
+    if (ratelimit_init() < 0){
+        return EXIT_FAILURE;
+    }
+
+    /* Load mime-types and start Date header timer (before forking any
+     * workers) */
+    mimetypes_load();
+    if (date_init() < 0){
+        return EXIT_FAILURE;
+    }
+
+    /* Start host name resolver (before forking any workers) */
+    if (resolve_init() < 0){
+        return EXIT_FAILURE;
+    }
+
+    /* Allocate shared span recorder (before forking any workers) */
+    if (TracePath != NULL && trace_init() < 0){
+        return EXIT_FAILURE;
+    }
+
+    log("Serving %zu listener%s", server_count, server_count == 1 ? "" : "s");
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
+    debug("MaxBodySize     = %zu", MaxBodySize);
+    debug("CacheDir        = %s", CacheDir ? CacheDir : "(disabled)");
+    debug("CacheKeyHeaders = %s", CacheKeyHeaders ? CacheKeyHeaders : "");
+    debug("TracePath       = %s (1/%u)", TracePath ? TracePath : "(disabled)", TraceSampleRate);
+    debug("MaxInflight     = %u%s (queue %u ms)", MaxInflight, AdaptiveLimit ? " adaptive" : "", QueueBudget);
+    debug("RateLimit       = %u/s (burst %u)", RateLimit, RateBurst);
+    debug("HostnameTTL     = %u s%s", HostnameTTL, HostnameTTL ? "" : " (numeric)");
+    debug("TLSCertificate  = %s", TLSCertificatePath ? TLSCertificatePath : "(disabled)");
+    debug("Timeouts        = headers %u ms, body %u ms + 1 s per %u bytes", HeaderTimeout, BodyTimeout, MinBodyRate);
     debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
 
-    /* Start either forking or single HTTP server */
-    if (mode != SINGLE){
-        forking_server(server_fd);
+    /* Take over from previous instance (which resumes if we fail before) */
+    if (socket_ready() < 0){
+        return EXIT_FAILURE;
+    }
+
+    /* Start either forking or single HTTP server (again if a handoff fails) */
+    while (true) {
+        if (mode != SINGLE){
+            forking_server(server_fds, server_count);
+        }
+        else { single_server(server_fds, server_count); }
+
+        if (!Restart || socket_handoff(server_fds, server_count, argv) == 0){
+            break;
+        }
+        log("Handoff failed, resuming");
+        Restart  = 0;
+        Shutdown = 0;
+    }
+
+    /* Stop accepting and wait for requests in flight */
+    for (size_t i = 0; i < server_count; i++){
+        close(server_fds[i]);
     }
-    else { single_server(server_fd); }
+    drain();
 
+    log("Shutting down");
+    accesslog_flush();
     return EXIT_SUCCESS;
 }
 
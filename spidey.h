@@ -2,15 +2,24 @@
 #define SPIDEY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Constants */
 
 #define WHITESPACE	" \t\n"
+#define MAX_LISTENERS   16
+#define RESPONSE_BUFFER     4096        /* Bytes of formatted response text buffered */
+#define RESPONSE_SEGMENTS   32          /* Segments gathered per write */
+#define DATE_HEADER_SIZE    40          /* Buffer size of a Date header line */
 
 /**
  * Concurrency modes
@@ -21,12 +30,50 @@ typedef enum {
     UNKNOWN
 } ServerMode;
 
+/**
+ * Listener socket options (see socket_option)
+ */
+typedef struct {
+    int     backlog;                        /**< listen backlog */
+    int     defer_accept;                   /**< TCP_DEFER_ACCEPT seconds (0 to disable) */
+    int     fastopen;                       /**< TCP_FASTOPEN queue length (0 to disable) */
+    int     rcvbuf;                         /**< SO_RCVBUF bytes (0 for kernel default) */
+    int     sndbuf;                         /**< SO_SNDBUF bytes (0 for kernel default) */
+    int     reuseaddr;                      /**< Set SO_REUSEADDR */
+    int     nodelay;                        /**< Set TCP_NODELAY on client sockets */
+    int     cork;                           /**< Cork client sockets until response is flushed */
+    int     unix_mode;                      /**< Permissions of Unix domain sockets (0 for umask) */
+} SocketOptions;
+
 /* Global Variables */
 
-extern char *Port;                      /**< Port number */
+extern char *Ports[MAX_LISTENERS];      /**< Addresses to listen on ([host:]port) */
+extern size_t PortsCount;               /**< Number of addresses to listen on */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern size_t MaxBodySize;              /**< Maximum request body size */
+extern char *CacheDir;                  /**< CGI response cache directory (NULL if disabled) */
+extern char *CacheKeyHeaders;           /**< Comma-separated request headers in cache key */
+extern char *AccessLogPath;             /**< Access log path (NULL for stderr) */
+extern bool AccessLogBinary;            /**< Write access log in binary format */
+extern char *TracePath;                 /**< Chrome trace output path (NULL if disabled) */
+extern unsigned TraceSampleRate;        /**< Trace one out of this many requests */
+extern unsigned MaxInflight;            /**< Maximum requests in flight (0 for unlimited) */
+extern unsigned QueueBudget;            /**< Maximum accept queue time in ms (0 for unlimited) */
+extern bool AdaptiveLimit;              /**< Adapt in-flight limit to latency */
+extern unsigned RateLimit;              /**< Requests per second per client address (0 for unlimited) */
+extern unsigned RateBurst;              /**< Requests a client address may burst */
+extern unsigned HeaderTimeout;          /**< Time allowed to receive request headers in ms (0 for unlimited) */
+extern unsigned BodyTimeout;            /**< Time allowed to start receiving request body in ms (0 for unlimited) */
+extern unsigned MinBodyRate;            /**< Bytes per second a request body must sustain (0 for any) */
+extern unsigned HostnameTTL;            /**< Seconds to cache client host names (0 for numeric addresses only) */
+extern char *TLSCertificatePath;        /**< TLS certificate chain (PEM, NULL if TLS is not used) */
+extern char *TLSKeyPath;                /**< TLS private key (PEM, NULL if in the certificate file) */
+extern SocketOptions ListenOptions;     /**< Listener and client socket options */
+extern volatile sig_atomic_t Shutdown;  /**< Stop accepting connections (SIGTERM/SIGINT) */
+extern unsigned DrainTimeout;           /**< Time allowed for requests in flight at shutdown in ms */
+extern volatile sig_atomic_t Restart;   /**< Hand listeners over to a new instance (SIGUSR2) */
 
 /* Logging Macros */
 
@@ -39,8 +86,51 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Tracing Probes
+ *
+ * USDT probes for bpftrace/SystemTap (e.g. usdt:./spidey:spidey:parse__start).
+ * They compile to a single nop when <sys/sdt.h> is available, and to nothing
+ * otherwise. */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define probe(name, ...)    STAP_PROBEV(spidey, name, ##__VA_ARGS__)
+#endif
+#endif
+#ifndef probe
+#define probe(name, ...)    do { } while (0)
+#endif
+
+/* HTTP Response */
+
+typedef struct {
+    int     fd;                         /*< Destination file descriptor */
+    bool    socket;                     /*< Destination is a socket */
+    bool    failed;                     /*< A write failed (the rest is discarded) */
+    bool    more;                       /*< Last write was sent with MSG_MORE (held back by the kernel) */
+    struct ssl_st *tls;                 /*< Write through TLS (NULL for plain sockets and kernel TLS) */
+    struct iovec iov[RESPONSE_SEGMENTS];/*< Pending segments */
+    size_t  segments;                   /*< Number of pending segments */
+    size_t  used;                       /*< Bytes of buffer in use */
+    size_t  sent;                       /*< Number of bytes written */
+    char    buffer[RESPONSE_BUFFER];    /*< Formatted text (headers, small bodies) */
+} Response;
+
 /* HTTP Request */
 
+/**
+ * Request stages (timed for metrics and traces)
+ */
+typedef enum {
+    METRICS_STAGE_ACCEPT = 0,           /* accept_request */
+    METRICS_STAGE_PARSE,                /* parse_request */
+    METRICS_STAGE_PATH,                 /* determine_request_path */
+    METRICS_STAGE_HANDLER,              /* handle_*_request */
+    METRICS_STAGE_FLUSH,                /* flush response and log */
+    METRICS_STAGES,
+} MetricsStage;
+
 typedef struct header Header;
 struct header {
     char    *name;                      /*< Name of header entry */
@@ -50,21 +140,54 @@ struct header {
 
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *file;                      /*< Client socket file stream */
+    char    *input;                     /*< Input read from client (input_buffer, see request_read) */
+    size_t  input_start;                /*< Offset of first unconsumed byte of input */
+    size_t  input_end;                  /*< Offset past last byte of input */
+    bool    input_closed;               /*< No input beyond the buffer (e.g. an HTTP/2 stream body) */
+    bool    secure;                     /*< Client connected to a TLS listener */
+    struct ssl_st *tls;                 /*< TLS connection (NULL until handshake, see tls_accept) */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
     char    *path;                      /*< Real path corrsponding to URI and RootPath */
     char    *query;                     /*< HTTP query string */
+    int     version;                    /*< HTTP version (e.g. 11 for HTTP/1.1, 20 for the HTTP/2 preface) */
 
-    char host[NI_MAXHOST];              /*< Host name of client */
-    char port[NI_MAXSERV];              /*< Port number of client */
+    struct sockaddr_storage addr;       /*< Address of client */
+    char host[NI_MAXHOST];              /*< Numeric address of client (see request_host) */
+    char port[NI_MAXSERV];              /*< Port number of client (see request_port) */
+    char hostname[NI_MAXHOST];          /*< Host name of client (see request_hostname) */
 
     Header  *headers;                   /*< List of name, value Header pairs */
+
+    ssize_t content_length;             /*< Content-Length of body (-1 if none) */
+    bool    chunked;                    /*< Body uses chunked transfer coding */
+    size_t  body_read;                  /*< Number of body bytes read so far */
+    size_t  chunk_left;                 /*< Bytes remaining in current chunk */
+    bool    body_done;                  /*< Entire body has been read */
+
+    struct timespec start;              /*< Time request was accepted (CLOCK_MONOTONIC) */
+    bool    admitted;                   /*< Holds an admission slot (see admission_release) */
+    struct timespec deadline;           /*< Time by which reads must complete (zero if none) */
+    bool    timed_out;                  /*< A read missed the deadline */
+    int     status_code;                /*< Status code sent instead of the handler's result (e.g. by a CGI script), or 0 */
+    Response response;                  /*< Response to client (counts bytes sent) */
+    char    content_type[64];           /*< Content-Type of response */
+    char    input_buffer[BUFSIZ];       /*< Storage of input read from client socket */
+
+    struct timespec stage_start[METRICS_STAGES];   /*< Start of each stage */
+    int64_t stage_ns[METRICS_STAGES];   /*< Duration of each stage (nanoseconds) */
 } Request;
 
 Request *       accept_request(int sfd);
 void	        free_request(Request *request);
 int	        parse_request(Request *request);
+bool            request_has_body(Request *request);
+ssize_t         read_request_body(Request *request, char *buffer, size_t size);
+void            request_linger(Request *request);
+ssize_t         request_read(Request *request, void *buffer, size_t size);
+const char *    request_host(Request *request);
+const char *    request_port(Request *request);
+const char *    request_hostname(Request *request);
 
 /* HTTP Request Handlers */
 
@@ -72,28 +195,205 @@ typedef enum {
     HTTP_STATUS_OK = 0,			/* 200 OK */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
+    HTTP_STATUS_REQUEST_TIMEOUT,	/* 408 Request Timeout */
+    HTTP_STATUS_PAYLOAD_TOO_LARGE,	/* 413 Payload Too Large */
+    HTTP_STATUS_TOO_MANY_REQUESTS,	/* 429 Too Many Requests */
+    HTTP_STATUS_HEADERS_TOO_LARGE,	/* 431 Request Header Fields Too Large */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+    HTTP_STATUS_COUNT,
 } HTTPStatus;
 
 HTTPStatus      handle_request(Request *request);
 
+/* HTTP Response Builder */
+
+void            response_init(Response *response, int fd, bool socket);
+void            response_printf(Response *response, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void            response_append(Response *response, const void *data, size_t size);
+int             response_flush(Response *response);
+int             response_sendfile(Response *response, int fd, off_t offset);
+void            response_status(Response *response, HTTPStatus status);
+void            response_date(Response *response);
+void            response_content_length(Response *response, uint64_t length);
+
+#define response_literal(response, s)   response_append((response), (s), sizeof(s) - 1)
+
+/* HTTP/2 */
+
+#define HPACK_TABLE_SIZE    4096        /* Decoder dynamic table size (SETTINGS_HEADER_TABLE_SIZE) */
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / 32)
+#define HPACK_MAX_LIST_SIZE 32768       /* Largest decoded header list (SETTINGS_MAX_HEADER_LIST_SIZE) */
+#define HPACK_MAX_FIELDS    128         /* Most fields in a decoded header list */
+
+typedef struct {
+    Header  entries[HPACK_TABLE_ENTRIES];/*< Dynamic table (ring, newest at first) */
+    size_t  first;                      /*< Slot of newest entry */
+    size_t  count;                      /*< Number of entries */
+    size_t  size;                       /*< Size of entries (as counted by RFC 7541) */
+    size_t  max_size;                   /*< Current maximum size */
+} HPACKTable;
+
+void            hpack_init(HPACKTable *table);
+void            hpack_free(HPACKTable *table);
+int             hpack_decode(HPACKTable *table, const uint8_t *block, size_t size, Header **headers);
+size_t          hpack_encode(uint8_t *buffer, size_t size, const char *name, const char *value);
+
+bool            http2_requested(Request *request);
+HTTPStatus      http2_serve(Request *request);
+
+/* TLS */
+
+int             tls_init(const int *fds, size_t nfds);
+void            tls_rotate(void);
+bool            tls_listener(int sfd);
+int             tls_accept(Request *request);
+ssize_t         tls_read(Request *request, void *buffer, size_t size);
+bool            tls_pending(Request *request);
+ssize_t         tls_write(struct ssl_st *ssl, const struct iovec *iov, size_t segments);
+void            tls_close(Request *request);
+
+/* Access Log */
+
+/**
+ * Binary access log format
+ *
+ * A binary log starts with ACCESS_LOG_MAGIC and is followed by records of the
+ * form <tag:u8> <length:varint> <payload:length bytes>.  All integers are
+ * unsigned LEB128 varints and all strings are <length:varint> <bytes>.
+ *
+ *  ACCESS_LOG_STRING   <id> <string>
+ *      Interns string under id; ids start at 1 and increase by one.
+ *
+ *  ACCESS_LOG_RESET    (empty)
+ *      Forgets all interned strings (a new writer appended to the log).
+ *
+ *  ACCESS_LOG_REQUEST  <time> <latency_us> <bytes> <pid> <method_id>
+ *                      <status_id> <mimetype_id> <host> <uri> <referer>
+ *                      <agent>
+ *      Method, status and mimetype refer to interned strings.
+ **/
+#define ACCESS_LOG_MAGIC    "SPDYLOG1"
+
+typedef enum {
+    ACCESS_LOG_STRING  = 1,
+    ACCESS_LOG_RESET   = 2,
+    ACCESS_LOG_REQUEST = 3,
+} AccessLogTag;
+
+int             accesslog_init(const char *path);
+void            accesslog_start(void);
+void            accesslog_record(Request *request, HTTPStatus status);
+void            accesslog_flush(void);
+
+/* Metrics */
+
+typedef enum {
+    METRICS_HANDLER_BROWSE = 0,
+    METRICS_HANDLER_FILE,
+    METRICS_HANDLER_CGI,
+    METRICS_HANDLER_ERROR,
+    METRICS_HANDLER_METRICS,
+    METRICS_HANDLERS,
+} MetricsHandler;
+
+#define METRICS_PATH    "/_spidey/metrics"
+
+int             metrics_init(void);
+void            metrics_stage(Request *request, MetricsStage stage, struct timespec *mark);
+void            metrics_request(int code, MetricsHandler handler);
+int64_t         metrics_inflight(int delta);
+void            metrics_drain(const struct timespec *deadline);
+void            metrics_render(Response *response);
+
+/* Admission Control */
+
+int             admission_init(void);
+bool            admission_admit(Request *request);
+void            admission_reject(Request *request, HTTPStatus status);
+void            admission_release(Request *request);
+void            admission_finish(const struct timespec *start);
+
+/* Rate Limiting */
+
+int             ratelimit_init(void);
+bool            ratelimit_admit(Request *request);
+
+/* Date Header */
+
+int             date_init(void);
+size_t          date_header(char *buffer);
+
+/* Host Name Resolution */
+
+int             resolve_init(void);
+bool            resolve_lookup(const struct sockaddr_storage *addr, char *name, size_t size);
+
+/* Span Recorder */
+
+int             trace_init(void);
+void            trace_record(Request *request, HTTPStatus status);
+void            trace_dump(const char *path);
+void            trace_poll(void);
+
+/* CGI Response Cache */
+
+bool            cache_enabled(Request *request);
+int             cache_serve(Request *request);
+int             cache_lock(Request *request);
+void            cache_unlock(Request *request, int fd);
+int             cache_create(Request *request);
+int             cache_commit(Request *request, int fd, time_t ttl);
+void            cache_discard(Request *request);
+void            cache_pass(Request *request);
+time_t          cache_ttl(const char *s, const char *end);
+void            cache_sweep(void);
+
 /* HTTP Server */
 
-int             single_server(int sfd);
-int             forking_server(int sfd);
+int             single_server(int *sfds, size_t nsfds);
+int             forking_server(int *sfds, size_t nsfds);
+
+/* Worker Processes */
+
+void            worker_init(const int *sfds, size_t nsfds);
+pid_t           worker_fork(Request *request);
+void            worker_reap(void);
+void            worker_signal(int signum, bool group);
+bool            worker_process(void);
+size_t          worker_count(void);
 
 /* Socket */
 
-int	        socket_listen(const char *port);
+int	        socket_listen(const char *address, int *fds, size_t size);
+int             socket_wait(const int *fds, size_t nfds);
+int             socket_inherit(int *fds, size_t size);
+int             socket_ready(void);
+int             socket_handoff(const int *fds, size_t nfds, char *argv[]);
+int             socket_option(const char *setting);
+void            socket_configure_client(int fd, int family);
+void            socket_uncork(int fd, int family);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
+typedef struct {
+    char    *extension;                 /*< File extension (NULL if slot is empty) */
+    char    *mimetype;                  /*< Mime-type */
+    char    *header;                    /*< Content-Type header line */
+    size_t  header_length;              /*< Length of header line */
+} MimeType;
+
+void            mimetypes_load(void);
+const MimeType *mimetype_lookup(const char *path);
 char *	        determine_mimetype(const char *path);
 char *	        determine_request_path(const char *uri);
 const char *    http_status_string(HTTPStatus status);
+int             http_status_code(HTTPStatus status);
+const char *    http_status_line(HTTPStatus status, size_t *length);
+size_t          utoa(uint64_t value, char *buffer);
 char *	        skip_nonwhitespace(char *s);
 char *	        skip_whitespace(char *s);
 
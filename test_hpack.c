@@ -0,0 +1,145 @@
+/* test_hpack.c: HPACK Decoder Tests (RFC 7541, Appendix C) */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/* Test case: a header block and the header list it decodes to.  Cases of a
+ * group share one decoder table, in order, like the requests or responses of
+ * one connection. */
+
+typedef struct {
+    const char *name;                   /*< Section of RFC 7541 */
+    int         group;                  /*< Cases with the same group share a table */
+    size_t      max_size;               /*< Dynamic table size of the encoder */
+    const char *block;                  /*< Header block (hex) */
+    const char *headers;                /*< Expected header list ("name: value\n" each) */
+    size_t      table_size;             /*< Expected dynamic table size afterwards */
+} HPACKTest;
+
+static const HPACKTest Tests[] = {
+    {"C.2.1 literal with indexing", 1, 4096,
+     "400a637573746f6d2d6b65790d637573746f6d2d686561646572",
+     "custom-key: custom-header\n", 55},
+    {"C.2.2 literal without indexing", 2, 4096,
+     "040c2f73616d706c652f70617468",
+     ":path: /sample/path\n", 0},
+    {"C.2.3 literal never indexed", 3, 4096,
+     "100870617373776f726406736563726574",
+     "password: secret\n", 0},
+    {"C.2.4 indexed", 4, 4096,
+     "82",
+     ":method: GET\n", 0},
+
+    {"C.3.1 first request", 5, 4096,
+     "828684410f7777772e6578616d706c652e636f6d",
+     ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", 57},
+    {"C.3.2 second request", 5, 4096,
+     "828684be58086e6f2d6361636865",
+     ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n", 110},
+    {"C.3.3 third request", 5, 4096,
+     "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565",
+     ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n", 164},
+
+    {"C.4.1 first request (Huffman)", 6, 4096,
+     "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+     ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", 57},
+    {"C.4.2 second request (Huffman)", 6, 4096,
+     "828684be5886a8eb10649cbf",
+     ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n", 110},
+    {"C.4.3 third request (Huffman)", 6, 4096,
+     "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+     ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n", 164},
+
+    {"C.5.1 first response", 7, 256,
+     "4803333032580770726976617465611d4d6f6e2c203231204f637420323031332032303a31333a323120474d546e1768747470733a2f2f7777772e6578616d706c652e636f6d",
+     ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n", 222},
+    {"C.5.2 second response (eviction)", 7, 256,
+     "4803333037c1c0bf",
+     ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n", 222},
+    {"C.5.3 third response (eviction)", 7, 256,
+     "88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c05a04677a69707738666f6f3d4153444a4b48514b425a584f5157454f50495541585157454f49553b206d61782d6167653d333630303b2076657273696f6e3d31",
+     ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\ncontent-encoding: gzip\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n", 215},
+
+    {"C.6.1 first response (Huffman)", 8, 256,
+     "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3",
+     ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n", 222},
+    {"C.6.2 second response (Huffman, eviction)", 8, 256,
+     "4883640effc1c0bf",
+     ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n", 222},
+    {"C.6.3 third response (Huffman, eviction)", 8, 256,
+     "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007",
+     ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\ncontent-encoding: gzip\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n", 215},
+};
+
+/**
+ * Decode hex string.
+ *
+ * @param   hex         Hex digits.
+ * @param   buffer      Buffer to store bytes in.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes decoded.
+ **/
+size_t unhex(const char *hex, uint8_t *buffer, size_t size) {
+    size_t length = 0;
+
+    for (; hex[0] && hex[1] && length < size; hex += 2) {
+        unsigned int byte;
+        sscanf(hex, "%2x", &byte);
+        buffer[length++] = byte;
+    }
+    return length;
+}
+
+/**
+ * Run decoder tests.
+ **/
+int main(int argc, char *argv[]) {
+    HPACKTable table;
+    int        group    = 0;
+    int        failures = 0;
+
+    printf("\n %-64s ... \n", "HPACK Decoder (RFC 7541, Appendix C)");
+    for (size_t i = 0; i < sizeof(Tests) / sizeof(Tests[0]); i++) {
+        const HPACKTest *test = &Tests[i];
+        uint8_t block[BUFSIZ];
+        char    decoded[BUFSIZ] = "";
+        Header *headers = NULL;
+
+        if (test->group != group) {
+            if (group != 0) {
+                hpack_free(&table);
+            }
+            hpack_init(&table);
+            table.max_size = test->max_size;
+            group = test->group;
+        }
+
+        printf("     %-60s ... ", test->name);
+        size_t length = unhex(test->block, block, sizeof(block));
+        int    status = hpack_decode(&table, block, length, &headers);
+        for (Header *header = headers; header != NULL; header = header->next) {
+            size_t used = strlen(decoded);
+            snprintf(decoded + used, sizeof(decoded) - used, "%s: %s\n", header->name, header->value);
+        }
+        while (headers != NULL) {
+            Header *next = headers->next;
+            free(headers->name);
+            free(headers->value);
+            free(headers);
+            headers = next;
+        }
+
+        if (status != 0 || !streq(decoded, test->headers) || table.size != test->table_size) {
+            printf("Failure\n\n%s(status %d, table size %zu)\n\n", decoded, status, table.size);
+            failures++;
+        } else {
+            printf("Success\n");
+        }
+    }
+    hpack_free(&table);
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
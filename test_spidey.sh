@@ -36,8 +36,8 @@ check_md5sum() {
 }
 
 check_header() {
-    status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n' | sed 's/ *$//')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -260,6 +260,28 @@ fi
 
 sleep 2
 
+printf "     %-60s ... " "POST /scripts/env.sh (Content-Length)"
+CONTENT="text/plain"
+HEADERS="REQUEST_METHOD=POST CONTENT_LENGTH=11 CONTENT_TYPE=text/plain"
+curl -s -D $WORKSPACE/header -H "Content-Type: text/plain" -d "hello=world" $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$HEADERS" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "POST /scripts/env.sh (chunked)"
+curl -s -D $WORKSPACE/header -H "Content-Type: text/plain" -H "Transfer-Encoding: chunked" -d "hello=world" $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$HEADERS" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
 # ------------------------------------------------------------------------------
 
 printf "\n %-64s ... \n" "Handle Errors"
@@ -276,6 +298,28 @@ fi
 
 sleep 2
 
+printf "     %-60s ... " "POST /scripts/env.sh (over limit)"
+STATUS="HTTP/1.0 413 Payload Too Large"
+head -c 2000000 /dev/zero > $WORKSPACE/body
+curl -s -D $WORKSPACE/header --data-binary @$WORKSPACE/body $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "413" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "POST /scripts/env.sh (chunked, over limit)"
+curl -s -D $WORKSPACE/header -H "Transfer-Encoding: chunked" --data-binary @$WORKSPACE/body $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "413" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
 printf "     %-60s ... " "Bad Request"
 STATUS="HTTP/1.0 400 Bad Request"
 CONTENT="text/html"
@@ -297,3 +341,52 @@ if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$S
 else
     echo "Success"
 fi
+
+# ------------------------------------------------------------------------------
+
+printf "\n %-64s ... \n" "Handle HTTP/2 Requests"
+
+printf "     %-60s ... " "/html/index.html (prior knowledge)"
+MD5SUM=55cdbe19dcf3ea685707213cdada01ef
+STATUS="HTTP/2 200"
+CONTENT="text/html"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "avengers Spidey html" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/html/index.html (upgrade)"
+curl -s --http2 -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "101 Upgrade HTTP/2" $WORKSPACE/header || ! check_md5sum $MD5SUM; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/scripts/env.sh (prior knowledge)"
+CONTENT="text/plain"
+HEADERS="REQUEST_METHOD REQUEST_URI SERVER_PORT HTTP_HOST HTTP_USER_AGENT"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$HEADERS" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/asdf (prior knowledge)"
+STATUS="HTTP/2 404"
+CONTENT="text/html"
+curl -s --http2-prior-knowledge -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
+    error "Failure"
+else
+    echo "Success"
+fi
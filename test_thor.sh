@@ -1,6 +1,6 @@
 #!/bin/bash
 
-PROGRAM=thor.py
+PROGRAM=thor
 WORKSPACE=/tmp/$PROGRAM.$(id -u)
 FAILURES=0
 
@@ -27,14 +27,6 @@ check_status() {
     return 0;
 }
 
-check_md5sum() {
-    cksum=$(grep -E -v '^(Process|TOTAL)' $WORKSPACE/test | sed -E '/^\s*$/d' | md5sum | awk '{print $1}')
-    if [ $cksum != $1 ]; then
-	echo "FAILURE: md5sum $cksum != $1" > $WORKSPACE/test
-	return 1;
-    fi
-}
-
 grep_all() {
     for pattern in $1; do
     	if ! grep -q -E "$pattern" $2; then
@@ -62,16 +54,19 @@ trap "cleanup 1" INT TERM
 
 # Testing
 
-echo "Testing $PROGRAM..."
+HOST="$1"
+while [ -z "$HOST" ]; do
+    read -p "Server Host: " HOST
+done
 
-# ------------------------------------------------------------------------------
+PORT="$2"
+while [ -z "$PORT" ]; do
+    read -p "Server Port: " PORT
+done
 
-printf " %-64s ... " "Functions"
-if ! grep_all "multiprocessing.Pool requests.get map time.time" $PROGRAM; then
-    error "Failure"
-else
-    echo "Success"
-fi
+URL=http://$HOST:$PORT
+
+echo "Testing $PROGRAM against spidey server on $HOST:$PORT ..."
 
 # ------------------------------------------------------------------------------
 
@@ -101,61 +96,17 @@ else
     echo "Success"
 fi
 
-# ------------------------------------------------------------------------------
-
-PATTERNS="Process Request Elapsed Time TOTAL AVERAGE"
-
-printf "\n %-64s\n" "Single Process"
-
-DOMAIN=https://example.com
-MD5SUM=491dc0a7a6969aa2b10d424835d37e0b
-printf "     %-60s ... " "$DOMAIN"
-./$PROGRAM $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-printf "     %-60s ... " "$DOMAIN (-v)"
-./$PROGRAM -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-DOMAIN=https://yld.me
-MD5SUM=408695c9aacff7faaec9796ef176219f
-printf "     %-60s ... " "$DOMAIN"
-./$PROGRAM $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-printf "     %-60s ... " "$DOMAIN (-v)"
-./$PROGRAM -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-DOMAIN=https://yld.me/izE?raw=1
-MD5SUM=1877fcda6f85fa183220fdb47ecdbb9d
-printf "     %-60s ... " "$DOMAIN"
-./$PROGRAM $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test; then
+printf "     %-60s ... " "-P without -k"
+./$PROGRAM -P 4 -n 1 $URL/ &> $WORKSPACE/test
+if ! check_status $? 1 || ! grep_all "Usage" $WORKSPACE/test; then
     error "Failure"
 else
     echo "Success"
 fi
 
-printf "     %-60s ... " "$DOMAIN (-v)"
-./$PROGRAM -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM; then
+printf "     %-60s ... " "connection refused"
+./$PROGRAM -n 2 http://$HOST:1/ &> $WORKSPACE/test
+if ! check_status $? 1 || ! grep_all "2.errors" $WORKSPACE/test; then
     error "Failure"
 else
     echo "Success"
@@ -163,63 +114,32 @@ fi
 
 # ------------------------------------------------------------------------------
 
-printf "\n %-64s\n" "Single Process, Multiple Requests"
+PATTERNS="Target Connections Rate Duration Requests Transfer Status Latency p50 p90 p99 p99.9 max"
 
-DOMAIN=https://example.com
-MD5SUM=a086e506ace1405a4da43e11ac1ff9e4
-printf "     %-60s ... " "$DOMAIN (-r 4)"
-./$PROGRAM -r 4 $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0     || ! grep_all "$PATTERNS" $WORKSPACE/test || \
-   ! grep_count Process 5 || ! grep_count Request 4; then
-    error "Failure"
-else
-    echo "Success"
-fi
+printf "\n %-64s\n" "Status Classes"
 
-printf "     %-60s ... " "$DOMAIN (-r 4 -v)"
-./$PROGRAM -r 4 -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM || \
-   ! grep_count Process 5 || ! grep_count Request 4; then
+printf "     %-60s ... " "/ (-n 10)"
+./$PROGRAM -n 10 $URL/ &> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || \
+   ! grep_all "10.\(.*\),.0.errors 2xx:.10" $WORKSPACE/test; then
     error "Failure"
 else
     echo "Success"
 fi
 
-DOMAIN=https://yld.me
-MD5SUM=9b24fe29a1b0f5b18f3840da9fe0d32f
-printf "     %-60s ... " "$DOMAIN (-r 4)"
-./$PROGRAM -r 4 $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0     || ! grep_all "$PATTERNS" $WORKSPACE/test || \
-   ! grep_count Process 5 || ! grep_count Request 4; then
+printf "     %-60s ... " "/asdf (-n 10 -c 2)"
+./$PROGRAM -n 10 -c 2 $URL/asdf &> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || \
+   ! grep_all "10.\(.*\),.0.errors 4xx:.10" $WORKSPACE/test; then
     error "Failure"
 else
     echo "Success"
 fi
 
-printf "     %-60s ... " "$DOMAIN (-r 4 -v)"
-./$PROGRAM -r 4 -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM || \
-   ! grep_count Process 5 || ! grep_count Request 4; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-DOMAIN=https://yld.me/izE?raw=1
-MD5SUM=a44c9b1df78e3656398db9ba92548a56
-printf "     %-60s ... " "$DOMAIN (-r 4)"
-./$PROGRAM -r 4 $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0     || ! grep_all "$PATTERNS" $WORKSPACE/test || \
-   ! grep_count Process 5 || ! grep_count Request 4; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-printf "     %-60s ... " "$DOMAIN (-r 4 -v)"
-./$PROGRAM -r 4 -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM || \
-   ! grep_count Process 5 || ! grep_count Request 4; then
+printf "     %-60s ... " "/ and /asdf (-n 20 -k -P 4 -c 2)"
+./$PROGRAM -n 20 -k -P 4 -c 2 $URL/ 3@$URL/asdf &> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || \
+   ! grep_all "20.\(.*\),.0.errors 2xx:.[0-9]+ 4xx:.[0-9]+" $WORKSPACE/test; then
     error "Failure"
 else
     echo "Success"
@@ -227,63 +147,20 @@ fi
 
 # ------------------------------------------------------------------------------
 
-printf "\n %-64s\n" "Multiple Processes"
-
-DOMAIN=https://example.com
-MD5SUM=70f0122be77ab9a12f8767bd04945a19
-printf "     %-60s ... " "$DOMAIN (-p 2)"
-./$PROGRAM -p 2 $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0     || ! grep_all "$PATTERNS" $WORKSPACE/test || \
-   ! grep_count Process 4 || ! grep_count Request 2; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-printf "     %-60s ... " "$DOMAIN (-p 2 -v)"
-./$PROGRAM -p 2 -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM || \
-   ! grep_count Process 4 || ! grep_count Request 2; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-DOMAIN=https://yld.me
-MD5SUM=2d00d24794150a21eb9fe4f4361623bb
-printf "     %-60s ... " "$DOMAIN (-p 2)"
-./$PROGRAM -p 2 $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0     || ! grep_all "$PATTERNS" $WORKSPACE/test || \
-   ! grep_count Process 4 || ! grep_count Request 2; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-printf "     %-60s ... " "$DOMAIN (-p 2 -v)"
-./$PROGRAM -p 2 -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM || \
-   ! grep_count Process 4 || ! grep_count Request 2; then
-    error "Failure"
-else
-    echo "Success"
-fi
+printf "\n %-64s\n" "JSON"
 
-DOMAIN=https://yld.me/izE?raw=1
-MD5SUM=9df2453cf04874e6ca1124f8e49f2051
-printf "     %-60s ... " "$DOMAIN (-p 2)"
-./$PROGRAM -p 2 $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0     || ! grep_all "$PATTERNS" $WORKSPACE/test || \
-   ! grep_count Process 4 || ! grep_count Request 2; then
+printf "     %-60s ... " "/ (-j -n 10)"
+./$PROGRAM -j -n 10 $URL/ &> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all '^\{.*\}$ "requests":10, "errors":0, "2xx":10, "latency_us": "service_us":' $WORKSPACE/test || \
+   ! python3 -m json.tool $WORKSPACE/test > /dev/null; then
     error "Failure"
 else
     echo "Success"
 fi
 
-printf "     %-60s ... " "$DOMAIN (-p 2 -v)"
-./$PROGRAM -p 2 -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM || \
-   ! grep_count Process 4 || ! grep_count Request 2; then
+printf "     %-60s ... " "/asdf (-j -n 10)"
+./$PROGRAM -j -n 10 $URL/asdf &> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all '"requests":10, "4xx":10, "2xx":0,' $WORKSPACE/test; then
     error "Failure"
 else
     echo "Success"
@@ -291,63 +168,20 @@ fi
 
 # ------------------------------------------------------------------------------
 
-printf "\n %-64s\n" "Multiple Processes, Multiple Requests"
-
-DOMAIN=https://example.com
-MD5SUM=8ef96d0b3be2d7dffcfb482971330ca7
-printf "     %-60s ... " "$DOMAIN (-p 2 -r 4)"
-./$PROGRAM -p 2 -r 4 $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0     || ! grep_all "$PATTERNS" $WORKSPACE/test || \
-   ! grep_count Process 10 || ! grep_count Request 8; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-printf "     %-60s ... " "$DOMAIN (-p 2 -r 4 -v)"
-./$PROGRAM -p 2 -r 4 -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM || \
-   ! grep_count Process 10 || ! grep_count Request 8; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-DOMAIN=https://yld.me
-MD5SUM=e0d12f1611dc4d8a1f0f7bd4dfd9b0f6
-printf "     %-60s ... " "$DOMAIN (-p 2 -r 4)"
-./$PROGRAM -p 2 -r 4 $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0     || ! grep_all "$PATTERNS" $WORKSPACE/test || \
-   ! grep_count Process 10 || ! grep_count Request 8; then
-    error "Failure"
-else
-    echo "Success"
-fi
-
-printf "     %-60s ... " "$DOMAIN (-p 2 -r 4 -v)"
-./$PROGRAM -p 2 -r 4 -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM || \
-   ! grep_count Process 10 || ! grep_count Request 8; then
-    error "Failure"
-else
-    echo "Success"
-fi
+printf "\n %-64s\n" "Constant Throughput"
 
-DOMAIN=https://yld.me/izE?raw=1
-MD5SUM=ce4d6bbaca157f968e6e57aa084e6ec1
-printf "     %-60s ... " "$DOMAIN (-p 2 -r 4)"
-./$PROGRAM -p 2 -r 4 $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0     || ! grep_all "$PATTERNS" $WORKSPACE/test || \
-   ! grep_count Process 10 || ! grep_count Request 8; then
+printf "     %-60s ... " "/ (-R 50 -d 1)"
+./$PROGRAM -R 50 -d 1 $URL/ &> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all "$PATTERNS Service" $WORKSPACE/test || \
+   ! grep_all "50.0.req/s.\(constant.throughput\) \s5[0-9].\(" $WORKSPACE/test; then
     error "Failure"
 else
     echo "Success"
 fi
 
-printf "     %-60s ... " "$DOMAIN (-p 2 -r 4 -v)"
-./$PROGRAM -p 2 -r 4 -v $DOMAIN &> $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all "$PATTERNS" $WORKSPACE/test || ! check_md5sum $MD5SUM || \
-   ! grep_count Process 10 || ! grep_count Request 8; then
+printf "     %-60s ... " "/ (-j -R 50 -d 1 -c 2)"
+./$PROGRAM -j -R 50 -d 1 -c 2 $URL/ &> $WORKSPACE/test
+if ! check_status $? 0 || ! grep_all '"rate":50.000, "requests":(4[5-9]|5[0-9]), "errors":0,' $WORKSPACE/test; then
     error "Failure"
 else
     echo "Success"
@@ -0,0 +1,976 @@
+/* thor.c: HTTP Load Generator */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define HISTOGRAM_SUB_BITS  7           /* Sub-buckets per power of two (log2), < 1% error */
+#define HISTOGRAM_EXPONENTS 42          /* Powers of two tracked (ns) */
+#define HISTOGRAM_BUCKETS   (HISTOGRAM_EXPONENTS << HISTOGRAM_SUB_BITS)
+
+#define MAX_TARGETS         64          /* URLs in mix */
+#define MAX_DEPTH           64          /* Pipelined requests per connection */
+#define MAX_EVENTS          256         /* Events per epoll_wait */
+#define HEADER_MAX          (1<<14)     /* Response header block */
+#define READ_SIZE           (1<<16)     /* Bytes per read */
+
+#define NS_PER_SEC          1000000000LL
+
+/* Latency histogram with log-linear (HDR style) buckets */
+
+typedef struct {
+    uint64_t    buckets[HISTOGRAM_BUCKETS];
+    uint64_t    count;
+    uint64_t    max;
+} Histogram;
+
+/* URL in the request mix */
+
+typedef struct {
+    char       *path;
+    char       *request;                /*< Pre-rendered request */
+    size_t      length;
+    unsigned    weight;
+} Target;
+
+/* Request that has been sent (or is about to be) */
+
+typedef struct {
+    int64_t     intended;               /*< Time request was due (ns) */
+    int64_t     sent;                   /*< Time request was written (ns) */
+} Pending;
+
+/* Requests that are due but not yet sent, by intended send time (ring) */
+
+typedef struct {
+    int64_t    *times;
+    size_t      head;
+    size_t      count;
+    size_t      capacity;
+} Schedule;
+
+/* Client connection */
+
+typedef struct {
+    int         fd;                     /*< Socket (-1 if idle) */
+    bool        connected;
+    bool        closing;                /*< Server closes after current response */
+
+    Pending     pending[MAX_DEPTH];     /*< Requests awaiting response (ring) */
+    size_t      head;
+    size_t      count;
+
+    char       *out;                    /*< Unsent request bytes */
+    size_t      out_length;
+    size_t      out_offset;
+
+    char        header[HEADER_MAX];     /*< Response header block so far */
+    size_t      header_length;
+    bool        in_body;
+    int64_t     body_left;              /*< Remaining body bytes (-1 until close) */
+    int         status;
+} Connection;
+
+/* Global Variables */
+
+char       *Host        = NULL;         /**< Target host */
+char       *Service     = "80";         /**< Target port */
+Target      Targets[MAX_TARGETS];       /**< URL mix */
+size_t      TargetCount = 0;
+unsigned    TargetWeight = 0;           /**< Sum of target weights */
+
+size_t      Connections = 1;            /**< Concurrent connections */
+size_t      Depth       = 1;            /**< Pipelined requests per connection */
+bool        KeepAlive   = false;        /**< Reuse connections */
+double      Rate        = 0;            /**< Target requests per second (0 is closed loop) */
+double      Duration    = 10;           /**< Test duration (seconds) */
+uint64_t    Limit       = 0;            /**< Maximum requests (0 is unlimited) */
+double      Timeout     = 5;            /**< Request timeout (seconds) */
+bool        Json        = false;        /**< Report in JSON */
+bool        Persistent  = true;         /**< Server keeps connections alive */
+
+struct addrinfo *Address = NULL;        /**< Resolved target */
+int         Epoll       = -1;
+int         Timer       = -1;           /**< Wakes the loop when the next request is due */
+Connection *Pool        = NULL;
+
+uint64_t    Issued      = 0;            /**< Requests scheduled */
+uint64_t    Completed   = 0;            /**< Responses received */
+uint64_t    Errors      = 0;            /**< Connection errors and timeouts */
+uint64_t    Retries     = 0;            /**< Requests resent after early close */
+uint64_t    Statuses[6] = {0};          /**< Responses by status class */
+uint64_t    BytesRead   = 0;
+Schedule    Backlog;                    /**< Requests due but not yet sent */
+uint64_t    RandomState = 0x9e3779b97f4a7c15ULL;
+Histogram   Latency;                    /**< From intended send time */
+Histogram   ServiceTime;                /**< From actual send time */
+
+/**
+ * Display usage message and exit with specified status code.
+ *
+ * @param   progname    Program Name
+ * @param   status      Exit status.
+ */
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hcdjknPRt] URL...\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -c conns      Concurrent connections (default: 1)\n");
+    fprintf(stderr, "    -d seconds    Test duration (default: 10)\n");
+    fprintf(stderr, "    -j            Report results in JSON\n");
+    fprintf(stderr, "    -k            Keep connections alive (HTTP/1.1)\n");
+    fprintf(stderr, "    -n requests   Stop after this many requests\n");
+    fprintf(stderr, "    -P depth      Pipelined requests per connection (requires -k)\n");
+    fprintf(stderr, "    -R rate       Constant throughput in requests per second (default: closed loop)\n");
+    fprintf(stderr, "    -t seconds    Request timeout (default: 5)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "With -R, latency is measured from when each request was due to be sent,\n");
+    fprintf(stderr, "so time spent waiting behind a slow server is not omitted.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Each URL may be prefixed with a weight (e.g. 3@http://host:port/path);\n");
+    fprintf(stderr, "all URLs must name the same host and port.\n");
+    exit(status);
+}
+
+/**
+ * Return current monotonic time.
+ *
+ * @return  Time in nanoseconds.
+ **/
+int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+/**
+ * Determine histogram bucket of value.
+ *
+ * @param   value       Latency in nanoseconds.
+ * @return  Bucket index.
+ **/
+size_t histogram_bucket(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return value;
+    }
+
+    size_t exponent = 63 - __builtin_clzll(value);
+    size_t sub      = (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    size_t bucket   = ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * Record value in histogram.
+ *
+ * @param   h           Histogram.
+ * @param   value       Latency in nanoseconds.
+ **/
+void histogram_record(Histogram *h, int64_t value) {
+    if (value < 0) {
+        value = 0;
+    }
+    h->buckets[histogram_bucket(value)]++;
+    h->count++;
+    if ((uint64_t)value > h->max) {
+        h->max = value;
+    }
+}
+
+/**
+ * Determine value at percentile.
+ *
+ * @param   h           Histogram.
+ * @param   percentile  Percentile (0 - 100).
+ * @return  Upper bound of bucket containing percentile (in nanoseconds).
+ **/
+uint64_t histogram_percentile(Histogram *h, double percentile) {
+    uint64_t rank       = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+    uint64_t cumulative = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        cumulative += h->buckets[bucket];
+        if (cumulative < rank) {
+            continue;
+        }
+        if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+            return bucket;
+        }
+        size_t   exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+        size_t   sub      = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+        uint64_t upper    = (1ULL << exponent) + ((uint64_t)(sub + 1) << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+        return upper < h->max ? upper : h->max;
+    }
+    return h->max;
+}
+
+/**
+ * Add request to schedule.
+ *
+ * @param   s           Schedule.
+ * @param   intended    Time request is due (ns).
+ **/
+void schedule_push(Schedule *s, int64_t intended) {
+    if (s->count == s->capacity) {
+        size_t   capacity = s->capacity ? s->capacity * 2 : 1024;
+        int64_t *times    = malloc(capacity * sizeof(int64_t));
+        if (times == NULL) {
+            fprintf(stderr, "malloc failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < s->count; i++) {
+            times[i] = s->times[(s->head + i) % s->capacity];
+        }
+        free(s->times);
+        s->times    = times;
+        s->head     = 0;
+        s->capacity = capacity;
+    }
+    s->times[(s->head + s->count) % s->capacity] = intended;
+    s->count++;
+}
+
+/**
+ * Remove oldest request from schedule.
+ *
+ * @param   s           Schedule (must not be empty).
+ * @return  Time request was due (ns).
+ **/
+int64_t schedule_pop(Schedule *s) {
+    int64_t intended = s->times[s->head];
+    s->head = (s->head + 1) % s->capacity;
+    s->count--;
+    return intended;
+}
+
+/**
+ * Parse URL and add it to the request mix.
+ *
+ * @param   url         URL of the form [weight@]http://host[:port][/path].
+ * @return  Whether or not the URL was valid.
+ **/
+bool target_add(char *url) {
+    unsigned weight = 1;
+    char *at = strchr(url, '@');
+
+    if (at != NULL && at < strstr(url, "://")) {
+        weight = strtoul(url, NULL, 10);
+        url    = at + 1;
+    }
+    if (TargetCount >= MAX_TARGETS || weight == 0 || strncmp(url, "http://", 7) != 0) {
+        return false;
+    }
+
+    /* Split authority and path */
+    char *authority = strdup(url + 7);
+    char *slash     = strchr(authority, '/');
+    char *path      = strdup(slash ? slash : "/");
+    if (slash) {
+        *slash = '\0';
+    }
+
+    /* Split host and port (bracketed IPv6 literals keep their colons) */
+    char *host = authority;
+    char *port = "80";
+    if (host[0] == '[') {
+        char *close = strchr(host, ']');
+        if (close == NULL) {
+            free(authority);
+            free(path);
+            return false;
+        }
+        *close = '\0';
+        host++;
+        if (close[1] == ':') {
+            port = close + 2;
+        }
+    } else if ((port = strchr(host, ':')) != NULL) {
+        *port++ = '\0';
+    } else {
+        port = "80";
+    }
+
+    if (Host == NULL) {
+        Host    = strdup(host);
+        Service = strdup(port);
+    } else if (!streq(Host, host) || !streq(Service, port)) {
+        fprintf(stderr, "All URLs must name the same host and port\n");
+        free(authority);
+        free(path);
+        return false;
+    }
+
+    /* Pre-render request */
+    char request[BUFSIZ];
+    int  length = snprintf(request, sizeof(request),
+        "GET %s HTTP/%s\r\nHost: %s:%s\r\nUser-Agent: thor\r\nConnection: %s\r\n\r\n",
+        path, KeepAlive ? "1.1" : "1.0", Host, Service, KeepAlive ? "keep-alive" : "close");
+    if (length < 0 || (size_t)length >= sizeof(request)) {
+        free(authority);
+        free(path);
+        return false;
+    }
+
+    Targets[TargetCount].path    = path;
+    Targets[TargetCount].request = strdup(request);
+    Targets[TargetCount].length  = length;
+    Targets[TargetCount].weight  = weight;
+    TargetCount++;
+    TargetWeight += weight;
+    free(authority);
+    return true;
+}
+
+/**
+ * Choose next target from mix (weighted, deterministic sequence).
+ *
+ * @return  Target to request.
+ **/
+Target * target_next(void) {
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 7;
+    RandomState ^= RandomState << 17;
+
+    unsigned choice = RandomState % TargetWeight;
+    for (size_t i = 0; i < TargetCount; i++) {
+        if (choice < Targets[i].weight) {
+            return &Targets[i];
+        }
+        choice -= Targets[i].weight;
+    }
+    return &Targets[0];
+}
+
+/**
+ * Parse command-line options.
+ *
+ * @param   argc        Number of arguments.
+ * @param   argv        Array of argument strings.
+ * @return  true if parsing was successful, false if there was an error.
+ */
+bool parse_options(int argc, char *argv[]) {
+    int argind = 1;
+
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (streq(arg, "-h")) {
+            usage(argv[0], 0);
+        } else if (streq(arg, "-j")) {
+            Json = true;
+        } else if (streq(arg, "-k")) {
+            KeepAlive = true;
+        } else {
+            char *ptr = argv[argind++];
+            char *end;
+            if (ptr == NULL) {
+                return false;
+            }
+            if (streq(arg, "-c")) {
+                Connections = strtoul(ptr, &end, 10);
+            } else if (streq(arg, "-d")) {
+                Duration = strtod(ptr, &end);
+            } else if (streq(arg, "-n")) {
+                Limit = strtoull(ptr, &end, 10);
+            } else if (streq(arg, "-P")) {
+                Depth = strtoul(ptr, &end, 10);
+            } else if (streq(arg, "-R")) {
+                Rate = strtod(ptr, &end);
+            } else if (streq(arg, "-t")) {
+                Timeout = strtod(ptr, &end);
+            } else {
+                return false;
+            }
+            if (end == ptr || *end != '\0') {
+                return false;
+            }
+        }
+    }
+
+    if (Connections == 0 || Depth == 0 || Depth > MAX_DEPTH || (Depth > 1 && !KeepAlive) ||
+        Rate < 0 || Duration <= 0 || Timeout <= 0) {
+        return false;
+    }
+
+    /* URLs (rendered after options so they honor -k) */
+    if (argind >= argc) {
+        return false;
+    }
+    for (; argind < argc; argind++) {
+        if (!target_add(argv[argind])) {
+            fprintf(stderr, "Invalid URL: %s\n", argv[argind]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Close connection, failing or resending its outstanding requests.
+ *
+ * @param   c           Connection.
+ * @param   error       Whether the outstanding request failed.
+ *
+ * On error the oldest outstanding request counts as failed.  Requests
+ * pipelined behind a response after which the server closed the connection
+ * were never processed and are resent.
+ **/
+void connection_close(Connection *c, bool error) {
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    if (c->count > 0 && error) {
+        Errors++;
+        c->count--;
+    }
+    Retries += c->count;
+    for (size_t i = 0; i < c->count; i++) {
+        schedule_push(&Backlog, c->pending[(c->head + i) % MAX_DEPTH].intended);
+    }
+
+    c->fd            = -1;
+    c->connected     = false;
+    c->closing       = false;
+    c->head          = 0;
+    c->count         = 0;
+    c->out_length    = 0;
+    c->out_offset    = 0;
+    c->header_length = 0;
+    c->in_body       = false;
+}
+
+/**
+ * Open non-blocking connection to target.
+ *
+ * @param   c           Connection.
+ * @return  Whether or not the connect was started.
+ **/
+bool connection_open(Connection *c) {
+    c->fd = socket(Address->ai_family, Address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, Address->ai_protocol);
+    if (c->fd < 0) {
+        fprintf(stderr, "socket failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, Address->ai_addr, Address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    if (epoll_ctl(Epoll, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Write as much of the pending request bytes as the socket accepts.
+ *
+ * @param   c           Connection.
+ * @return  Whether or not the connection is still usable.
+ **/
+bool connection_flush(Connection *c) {
+    while (c->out_offset < c->out_length) {
+        ssize_t n = send(c->fd, c->out + c->out_offset, c->out_length - c->out_offset, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                return true;
+            }
+            return false;
+        }
+        c->out_offset += n;
+    }
+    c->out_length = c->out_offset = 0;
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = c};
+    epoll_ctl(Epoll, EPOLL_CTL_MOD, c->fd, &event);
+    return true;
+}
+
+/**
+ * Queue request on connection.
+ *
+ * @param   c           Connection.
+ * @param   intended    Time request was due (ns).
+ * @param   now         Current time (ns).
+ * @return  Whether or not a connection could be opened for the request.
+ **/
+bool connection_send(Connection *c, int64_t intended, int64_t now) {
+    if (c->fd < 0 && !connection_open(c)) {
+        return false;
+    }
+
+    /* Compact partially written requests */
+    if (c->out_offset > 0) {
+        memmove(c->out, c->out + c->out_offset, c->out_length - c->out_offset);
+        c->out_length -= c->out_offset;
+        c->out_offset  = 0;
+    }
+
+    Target *target = target_next();
+    memcpy(c->out + c->out_length, target->request, target->length);
+    c->out_length += target->length;
+
+    Pending *p = &c->pending[(c->head + c->count) % MAX_DEPTH];
+    p->intended = intended;
+    p->sent     = now;
+    c->count++;
+
+    if (c->connected) {
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+        epoll_ctl(Epoll, EPOLL_CTL_MOD, c->fd, &event);
+        if (!connection_flush(c)) {
+            connection_close(c, true);
+        }
+    }
+    return true;
+}
+
+/**
+ * Complete oldest outstanding request.
+ *
+ * @param   c           Connection.
+ * @param   now         Current time (ns).
+ **/
+void connection_complete(Connection *c, int64_t now) {
+    Pending *p = &c->pending[c->head];
+
+    histogram_record(&Latency, now - p->intended);
+    histogram_record(&ServiceTime, now - p->sent);
+    Statuses[c->status / 100 < 6 ? c->status / 100 : 0]++;
+    Completed++;
+
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->count--;
+    c->header_length = 0;
+    c->in_body       = false;
+}
+
+/**
+ * Find end of response header block.
+ *
+ * @param   s           Header block so far.
+ * @return  Pointer past the blank line (or NULL if incomplete).
+ *
+ * Bare LF line endings are accepted, since CGI scripts often emit them.
+ **/
+char * header_end(char *s) {
+    char *crlf = strstr(s, "\r\n\r\n");
+    char *lf   = strstr(s, "\n\n");
+
+    if (lf != NULL && (crlf == NULL || lf < crlf)) {
+        return lf + 2;
+    }
+    return crlf ? crlf + 4 : NULL;
+}
+
+/**
+ * Parse response header block.
+ *
+ * @param   c           Connection.
+ * @return  Whether or not the header block is well-formed.
+ **/
+bool connection_parse_header(Connection *c) {
+    char *line  = c->header;
+    bool  http10 = strncmp(line, "HTTP/1.0", 8) == 0;
+
+    if (strncmp(line, "HTTP/1.", 7) != 0 || (c->status = atoi(line + 9)) <= 0) {
+        return false;
+    }
+
+    c->body_left = -1;
+    c->closing   = c->closing || http10 || !KeepAlive;
+    while ((line = strchr(line, '\n')) != NULL && line[1] != '\r' && line[1] != '\n') {
+        line += 1;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->body_left = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            char *value = line + 11 + strspn(line + 11, " \t");
+            if (strncasecmp(value, "close", 5) == 0) {
+                c->closing = true;
+            } else if (strncasecmp(value, "keep-alive", 10) == 0 && http10 && KeepAlive) {
+                c->closing = false;
+            }
+        }
+    }
+
+    /* Without a length the body is delimited by the server closing */
+    if (c->body_left < 0) {
+        c->closing = true;
+    }
+
+    /* Stop pipelining into a server that does not keep connections alive */
+    if (c->closing && KeepAlive && Persistent) {
+        fprintf(stderr, "Server closes connections; disabling keep-alive\n");
+        Persistent = false;
+    }
+    return true;
+}
+
+/**
+ * Read and parse responses.
+ *
+ * @param   c           Connection.
+ * @param   now         Current time (ns).
+ **/
+void connection_read(Connection *c, int64_t now) {
+    static char buffer[READ_SIZE];
+
+    while (c->fd >= 0) {
+        ssize_t n = read(c->fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            /* Close-delimited body is complete at end of stream */
+            if (n == 0 && c->in_body && c->body_left < 0 && c->count > 0) {
+                connection_complete(c, now);
+                connection_close(c, false);
+            } else {
+                connection_close(c, c->count > 0);
+            }
+            return;
+        }
+        BytesRead += n;
+
+        char *p   = buffer;
+        char *end = buffer + n;
+        while (p < end) {
+            if (c->count == 0) {
+                /* Unsolicited data */
+                connection_close(c, false);
+                return;
+            }
+
+            if (!c->in_body) {
+                /* Accumulate header block */
+                size_t old  = c->header_length;
+                size_t take = end - p;
+                if (take > HEADER_MAX - 1 - old) {
+                    take = HEADER_MAX - 1 - old;
+                }
+                memcpy(c->header + old, p, take);
+                c->header_length += take;
+                c->header[c->header_length] = '\0';
+
+                char *blank = header_end(c->header);
+                if (blank == NULL) {
+                    if (c->header_length >= HEADER_MAX - 1) {
+                        connection_close(c, true);
+                        return;
+                    }
+                    p += take;
+                    continue;
+                }
+                p += (blank - c->header) - old;
+                if (!connection_parse_header(c)) {
+                    connection_close(c, true);
+                    return;
+                }
+                c->in_body = true;
+            }
+
+            if (c->body_left < 0) {
+                p = end;
+            } else {
+                int64_t take = end - p < c->body_left ? end - p : c->body_left;
+                p            += take;
+                c->body_left -= take;
+                if (c->body_left == 0) {
+                    bool closing = c->closing;
+                    connection_complete(c, now);
+                    if (closing) {
+                        connection_close(c, false);
+                        return;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Handle readiness of connection.
+ *
+ * @param   c           Connection.
+ * @param   events      Ready events.
+ * @param   now         Current time (ns).
+ **/
+void connection_event(Connection *c, uint32_t events, int64_t now) {
+    if (!c->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int       error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            connection_close(c, true);
+            return;
+        }
+        c->connected = true;
+    }
+    if ((events & EPOLLOUT) && !connection_flush(c)) {
+        connection_close(c, true);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        connection_read(c, now);
+    }
+}
+
+/**
+ * Determine whether connection can take another request.
+ *
+ * @param   c           Connection.
+ * @return  Whether or not a request may be queued.
+ **/
+bool connection_ready(Connection *c) {
+    if (c->closing) {
+        return false;
+    }
+    return KeepAlive && Persistent ? c->count < Depth : c->fd < 0;
+}
+
+/**
+ * Generate load until the duration or request limit is reached.
+ *
+ * In constant throughput mode (-R) requests are due on a fixed timetable
+ * regardless of how quickly responses arrive.  Requests that cannot be sent
+ * on time (no connection has room) wait in the backlog, and their latency is
+ * still measured from when they were due.  This avoids coordinated
+ * omission: a stalled server delays every request that should have been sent
+ * during the stall, not just the one in flight.
+ **/
+void run(void) {
+    struct epoll_event events[MAX_EVENTS];
+    int64_t start    = now_ns();
+    int64_t deadline = start + (int64_t)(Duration * NS_PER_SEC);
+    int64_t timeout  = (int64_t)(Timeout * NS_PER_SEC);
+    int64_t interval = Rate > 0 ? (int64_t)(NS_PER_SEC / Rate) : 0;
+    int64_t next     = start;
+    size_t  cursor   = 0;
+
+    while (true) {
+        int64_t now     = now_ns();
+        bool    sending = now < deadline && (Limit == 0 || Issued < Limit);
+
+        /* Schedule requests: on a fixed timetable (open loop) or whenever a
+         * connection has room (closed loop) */
+        if (sending && interval > 0) {
+            for (; next <= now && (Limit == 0 || Issued < Limit); next += interval) {
+                Issued++;
+                schedule_push(&Backlog, next);
+            }
+        }
+
+        /* Dispatch requests to connections with room */
+        for (size_t scanned = 0; scanned < Connections; scanned++, cursor = (cursor + 1) % Connections) {
+            Connection *c = &Pool[cursor];
+            while (connection_ready(c)) {
+                int64_t intended = now;
+                if (Backlog.count > 0) {
+                    intended = schedule_pop(&Backlog);
+                } else if (interval == 0 && sending && (Limit == 0 || Issued < Limit)) {
+                    Issued++;
+                } else {
+                    break;
+                }
+                if (!connection_send(c, intended, now)) {
+                    Errors++;
+                    break;
+                }
+            }
+        }
+
+        /* Expire requests that have waited too long */
+        bool outstanding = false;
+        for (size_t i = 0; i < Connections; i++) {
+            Connection *c = &Pool[i];
+            if (c->count > 0 && now - c->pending[c->head].sent > timeout) {
+                connection_close(c, true);
+            }
+            outstanding = outstanding || c->count > 0;
+        }
+        if (!sending && !outstanding && Backlog.count == 0) {
+            break;
+        }
+
+        /* Wait for readiness (or the next scheduled send, with nanosecond
+         * precision so the timetable is not quantized to epoll's ms) */
+        if (sending && interval > 0) {
+            struct itimerspec due = {.it_value = {next / NS_PER_SEC, next % NS_PER_SEC}};
+            timerfd_settime(Timer, TFD_TIMER_ABSTIME, &due, NULL);
+        }
+        int n = epoll_wait(Epoll, events, MAX_EVENTS, 10);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            return;
+        }
+        now = now_ns();
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t expirations;
+                if (read(Timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    fprintf(stderr, "read timer failed: %s\n", strerror(errno));
+                }
+                continue;
+            }
+            connection_event(events[i].data.ptr, events[i].events, now);
+        }
+    }
+
+    Duration = (now_ns() - start) / (double)NS_PER_SEC;
+}
+
+/**
+ * Print latency percentiles.
+ *
+ * @param   name        Name of histogram.
+ * @param   h           Histogram.
+ **/
+void report_histogram(const char *name, Histogram *h) {
+    static const double Percentiles[] = {50, 90, 99, 99.9};
+
+    if (Json) {
+        printf(",\"%s_us\":{", name);
+        for (size_t i = 0; i < sizeof(Percentiles) / sizeof(Percentiles[0]); i++) {
+            printf("\"p%g\":%.3f,", Percentiles[i], histogram_percentile(h, Percentiles[i]) / 1e3);
+        }
+        printf("\"max\":%.3f}", h->max / 1e3);
+        return;
+    }
+
+    printf("%s:\n", name);
+    for (size_t i = 0; i < sizeof(Percentiles) / sizeof(Percentiles[0]); i++) {
+        printf("    p%-8g  %10.3f ms\n", Percentiles[i], histogram_percentile(h, Percentiles[i]) / 1e6);
+    }
+    printf("    %-9s  %10.3f ms\n", "max", h->max / 1e6);
+}
+
+/**
+ * Print results.
+ *
+ * Latency is measured from the intended send time; service time from when the
+ * request was actually written.  In closed loop mode they are the same.
+ **/
+void report(void) {
+    double throughput = Completed / Duration;
+
+    if (Json) {
+        printf("{\"host\":\"%s\",\"port\":\"%s\",\"urls\":%zu,\"connections\":%zu,\"depth\":%zu,\"keepalive\":%s,",
+            Host, Service, TargetCount, Connections, Depth, KeepAlive ? "true" : "false");
+        printf("\"rate\":%.3f,\"duration\":%.3f,\"requests\":%llu,\"errors\":%llu,\"retries\":%llu,",
+            Rate, Duration, (unsigned long long)Completed, (unsigned long long)Errors, (unsigned long long)Retries);
+        printf("\"throughput\":%.3f,\"bytes\":%llu,\"status\":{", throughput, (unsigned long long)BytesRead);
+        for (int i = 1; i < 6; i++) {
+            printf("%s\"%dxx\":%llu", i > 1 ? "," : "", i, (unsigned long long)Statuses[i]);
+        }
+        printf("}");
+        report_histogram("latency", &Latency);
+        report_histogram("service", &ServiceTime);
+        printf("}\n");
+        return;
+    }
+
+    printf("Target:       http://%s:%s (%zu URLs)\n", Host, Service, TargetCount);
+    printf("Connections:  %zu (pipeline %zu, keep-alive %s)\n", Connections, Depth, KeepAlive ? "yes" : "no");
+    if (Rate > 0) {
+        printf("Rate:         %.1f req/s (constant throughput)\n", Rate);
+    } else {
+        printf("Rate:         unlimited (closed loop)\n");
+    }
+    printf("Duration:     %.2f s\n", Duration);
+    printf("Requests:     %llu (%.1f req/s), %llu errors, %llu retries\n",
+        (unsigned long long)Completed, throughput, (unsigned long long)Errors, (unsigned long long)Retries);
+    printf("Transfer:     %.2f MB (%.2f MB/s)\n", BytesRead / 1e6, BytesRead / 1e6 / Duration);
+    printf("Status:      ");
+    for (int i = 1; i < 6; i++) {
+        if (Statuses[i]) {
+            printf(" %dxx: %llu", i, (unsigned long long)Statuses[i]);
+        }
+    }
+    printf("\n");
+    report_histogram("Latency", &Latency);
+    if (Rate > 0) {
+        report_histogram("Service", &ServiceTime);
+    }
+}
+
+/**
+ * Parses command line options, generates load, and reports results
+ **/
+int main(int argc, char *argv[]) {
+    if (!parse_options(argc, argv)) {
+        usage(argv[0], 1);
+    }
+
+    /* Lookup target address */
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    int status;
+    if ((status = getaddrinfo(Host, Service, &hints, &Address)) != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    /* Allocate connections */
+    if ((Epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if ((Timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "timerfd_create failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(Epoll, EPOLL_CTL_ADD, Timer, &event) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    size_t longest = 0;
+    for (size_t i = 0; i < TargetCount; i++) {
+        longest = Targets[i].length > longest ? Targets[i].length : longest;
+    }
+    Pool = calloc(Connections, sizeof(Connection));
+    if (Pool == NULL) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < Connections; i++) {
+        Pool[i].fd  = -1;
+        Pool[i].out = malloc(longest * Depth);
+        if (Pool[i].out == NULL) {
+            fprintf(stderr, "malloc failed: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    run();
+    report();
+    return Completed > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
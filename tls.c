@@ -0,0 +1,589 @@
+/* tls.c: TLS Termination */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <openssl/core_names.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define TLS_PREFIX          "tls:"      /* Listener address prefix (e.g. tls:443) */
+#define TLS_RECORD_SIZE     16384       /* Plaintext bytes per record (the maximum) */
+#define TLS_SESSION_CONTEXT "spidey"    /* Sessions are only resumed by this server */
+#define TLS_TICKET_ROTATION 3600        /* Seconds a ticket key issues tickets */
+#define TLS_TICKET_KEYS     3           /* Ticket keys kept (issuing, previous, next) */
+
+/* ALPN protocols in order of preference */
+
+static const unsigned char TLSProtocols[] = "\x02h2\x08http/1.1";
+
+/* Session ticket keys (shared by the server and its workers)
+ *
+ * The server writes a new key into the slot after the current one and then
+ * publishes its index, so workers (even long-lived ones) always find the
+ * issuing key and the one before it. */
+
+typedef struct {
+    unsigned char   name[16];           /*< Key name (sent in tickets) */
+    unsigned char   aes[32];            /*< AES-256-CBC key */
+    unsigned char   hmac[32];           /*< HMAC-SHA256 key */
+    time_t          created;            /*< Time key was generated (CLOCK_MONOTONIC seconds) */
+} TLSTicketKey;
+
+typedef struct {
+    TLSTicketKey    keys[TLS_TICKET_KEYS];
+    _Atomic unsigned current;           /*< Index of issuing key */
+} TLSTicketKeys;
+
+/* Internal Variables */
+
+SSL_CTX *TLSContext = NULL;
+int      TLSListeners[MAX_LISTENERS];
+size_t   TLSListenersCount = 0;
+TLSTicketKeys *TLSTickets = NULL;
+
+/* Internal Declarations */
+int     tls_port(const char *address);
+int     tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg);
+int     tls_ticket_key(TLSTicketKey *key);
+int     tls_ticket(SSL *ssl, unsigned char name[16], unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int encrypt);
+int     tls_wait(Request *r, short events);
+int     tls_send(SSL *ssl, const void *data, size_t size);
+const char *tls_reason(void);
+
+/**
+ * Set up TLS on listeners given with the tls: prefix.
+ *
+ * @param   fds         Server socket file descriptors.
+ * @param   nfds        Number of server sockets.
+ * @return  -1 on error and 0 on success (also when TLS is not used).
+ *
+ * Listeners are matched to Ports by their local port, so sockets inherited
+ * from systemd or a previous instance are served the same way.  The context
+ * is created before any workers are forked, and its session ticket keys are
+ * kept in shared memory: a client can resume its session with whichever
+ * worker accepts its next connection (see tls_rotate).  Sessions are not
+ * cached on the server.  Kernel TLS is enabled where the kernel supports it
+ * (see tls_accept).
+ **/
+int tls_init(const int *fds, size_t nfds) {
+    int ports[MAX_LISTENERS];
+    size_t nports = 0;
+
+    for (size_t i = 0; i < PortsCount; i++){
+        if (strncmp(Ports[i], TLS_PREFIX, strlen(TLS_PREFIX)) != 0){
+            continue;
+        }
+        if ((ports[nports++] = tls_port(Ports[i] + strlen(TLS_PREFIX))) < 0){
+            fprintf(stderr, "invalid TLS address: %s\n", Ports[i]);
+            return -1;
+        }
+    }
+    if (nports == 0){
+        return 0;
+    }
+    if (TLSCertificatePath == NULL){
+        fprintf(stderr, "TLS listeners need a certificate (-e)\n");
+        return -1;
+    }
+
+    /* Load certificate chain and key */
+    TLSContext = SSL_CTX_new(TLS_server_method());
+    if (TLSContext == NULL){
+        fprintf(stderr, "SSL_CTX_new failed: %s\n", tls_reason());
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(TLSContext, TLS1_2_VERSION);
+    if (SSL_CTX_use_certificate_chain_file(TLSContext, TLSCertificatePath) != 1){
+        fprintf(stderr, "Load certificate %s failed: %s\n", TLSCertificatePath, tls_reason());
+        goto fail;
+    }
+    const char *key = TLSKeyPath ? TLSKeyPath : TLSCertificatePath;
+    if (SSL_CTX_use_PrivateKey_file(TLSContext, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(TLSContext) != 1){
+        fprintf(stderr, "Load private key %s failed: %s\n", key, tls_reason());
+        goto fail;
+    }
+
+    /* Resume sessions only with tickets (stateless, so they work across
+     * workers, unlike a per-process session cache) and hand record
+     * encryption to the kernel where possible */
+    TLSTickets = mmap(NULL, sizeof(TLSTicketKeys), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (TLSTickets == MAP_FAILED){
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        TLSTickets = NULL;
+        goto fail;
+    }
+    if (tls_ticket_key(&TLSTickets->keys[0]) < 0){
+        goto fail;
+    }
+    SSL_CTX_set_session_id_context(TLSContext, (const unsigned char *)TLS_SESSION_CONTEXT, strlen(TLS_SESSION_CONTEXT));
+    SSL_CTX_set_session_cache_mode(TLSContext, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_timeout(TLSContext, 2 * TLS_TICKET_ROTATION);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(TLSContext, tls_ticket);
+    SSL_CTX_set_options(TLSContext, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_alpn_select_cb(TLSContext, tls_alpn, NULL);
+
+    /* Find listeners on TLS ports */
+    for (size_t i = 0; i < nfds; i++){
+        struct sockaddr_storage local;
+        socklen_t length = sizeof(local);
+        if (getsockname(fds[i], (struct sockaddr *)&local, &length) < 0 || local.ss_family == AF_UNIX){
+            continue;
+        }
+        int port = ntohs(local.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&local)->sin6_port : ((struct sockaddr_in *)&local)->sin_port);
+        for (size_t j = 0; j < nports; j++){
+            if (ports[j] == port){
+                TLSListeners[TLSListenersCount++] = fds[i];
+                break;
+            }
+        }
+    }
+    if (TLSListenersCount == 0){
+        fprintf(stderr, "no listeners on TLS ports\n");
+        goto fail;
+    }
+
+    log("Serving TLS on %zu listener%s (%s)", TLSListenersCount, TLSListenersCount == 1 ? "" : "s", OpenSSL_version(OPENSSL_VERSION));
+    return 0;
+
+fail:
+    if (TLSTickets != NULL){
+        munmap(TLSTickets, sizeof(TLSTicketKeys));
+        TLSTickets = NULL;
+    }
+    SSL_CTX_free(TLSContext);
+    TLSContext = NULL;
+    return -1;
+}
+
+/**
+ * Rotate session ticket keys when due.
+ *
+ * This is called by the server between connections.  Every
+ * TLS_TICKET_ROTATION seconds, a new key starts issuing tickets; the previous
+ * one is still accepted for another TLS_TICKET_ROTATION, so a ticket lasts at
+ * most twice that, and a leaked key exposes only a bounded window of
+ * sessions.
+ **/
+void tls_rotate(void) {
+    if (TLSTickets == NULL){
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned current = atomic_load(&TLSTickets->current);
+    if (now.tv_sec - TLSTickets->keys[current].created < TLS_TICKET_ROTATION){
+        return;
+    }
+
+    unsigned next = (current + 1) % TLS_TICKET_KEYS;
+    if (tls_ticket_key(&TLSTickets->keys[next]) == 0){
+        atomic_store(&TLSTickets->current, next);
+        debug("Rotated TLS session ticket key");
+    }
+}
+
+/**
+ * Generate session ticket key.
+ *
+ * @param   key         Ticket key to fill in.
+ * @return  -1 on error and 0 on success.
+ **/
+int tls_ticket_key(TLSTicketKey *key) {
+    struct timespec now;
+
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+        RAND_bytes(key->aes, sizeof(key->aes)) != 1 ||
+        RAND_bytes(key->hmac, sizeof(key->hmac)) != 1){
+        fprintf(stderr, "RAND_bytes failed: %s\n", tls_reason());
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    key->created = now.tv_sec;
+    return 0;
+}
+
+/**
+ * Encrypt or decrypt session ticket (OpenSSL ticket key callback).
+ *
+ * @return  1 to use the key, 2 to use it and issue a new ticket (the ticket
+ *          was made with the previous key), 0 to issue no ticket or ignore
+ *          the one received, or -1 on error.
+ *
+ * New tickets are made with the issuing key, unless it is overdue for
+ * rotation (the server has been idle).  Tickets made with the issuing or the
+ * previous key are accepted while that key is within its lifetime.
+ **/
+int tls_ticket(SSL *ssl, unsigned char name[16], unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int encrypt) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    unsigned      current = atomic_load(&TLSTickets->current);
+    unsigned      index   = current;
+    TLSTicketKey *key     = &TLSTickets->keys[current];
+
+    if (encrypt){
+        if (now.tv_sec - key->created >= 2 * TLS_TICKET_ROTATION || RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1){
+            return 0;
+        }
+        memcpy(name, key->name, sizeof(key->name));
+    } else {
+        index = (current + TLS_TICKET_KEYS - 1) % TLS_TICKET_KEYS;
+        if (memcmp(name, key->name, sizeof(key->name)) != 0){
+            key = &TLSTickets->keys[index];
+            if (memcmp(name, key->name, sizeof(key->name)) != 0){
+                return 0;
+            }
+        } else {
+            index = current;
+        }
+        if (now.tv_sec - key->created >= 2 * TLS_TICKET_ROTATION){
+            return 0;
+        }
+    }
+
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac, sizeof(key->hmac)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+    if (EVP_MAC_CTX_set_params(mac, params) != 1 ||
+        EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes, iv, encrypt) != 1){
+        return -1;
+    }
+    return index == current ? 1 : 2;
+}
+
+/**
+ * Parse port of TLS listener address.
+ *
+ * @param   address     Address of the form port, host:port or [host]:port.
+ * @return  Port number (or -1 if invalid, e.g. for a unix: address).
+ **/
+int tls_port(const char *address) {
+    const char *colon = strrchr(address, ':');
+    const char *port  = colon ? colon + 1 : address;
+    char       *end;
+
+    if (strncmp(address, "unix:", 5) == 0 || (colon != NULL && address[0] != '[' && strchr(address, ':') != colon)){
+        return -1;
+    }
+    long value = strtol(port, &end, 10);
+    if (end == port || *end != '\0' || value <= 0 || value > 65535){
+        return -1;
+    }
+    return value;
+}
+
+/**
+ * Whether server socket is a TLS listener.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  true if connections accepted on sfd speak TLS.
+ **/
+bool tls_listener(int sfd) {
+    for (size_t i = 0; i < TLSListenersCount; i++){
+        if (TLSListeners[i] == sfd){
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Select application protocol (ALPN callback).
+ *
+ * @return  SSL_TLSEXT_ERR_OK if a protocol was selected, or
+ *          SSL_TLSEXT_ERR_NOACK to go on without one (HTTP/1.1).
+ *
+ * h2 is preferred when the client offers it; the client then starts with the
+ * connection preface, which handle_request recognizes as for h2c.
+ **/
+int tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg) {
+    unsigned char *selected;
+
+    if (SSL_select_next_proto(&selected, outlen, TLSProtocols, sizeof(TLSProtocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED){
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Perform TLS handshake with client.
+ *
+ * @param   r           HTTP Request structure (accepted on a TLS listener).
+ * @return  -1 on error and 0 on success.
+ *
+ * This runs in the worker that handles the connection (see handle_request),
+ * so the accept loop never spends CPU on handshakes.  The handshake must
+ * complete by the request's header deadline: the socket is non-blocking
+ * while it runs, and each wait for the client is bounded by the time left
+ * (see tls_wait), so a client trickling its handshake cannot outlast it.
+ *
+ * Requests are read with SSL_read.  If the kernel took over encryption of
+ * sent records (kTLS), responses are written to the socket directly, so
+ * files are still sent with sendfile(2) and CGI output is spliced;
+ * otherwise the response builder writes through SSL_write.
+ **/
+int tls_accept(Request *r) {
+    if (TLSContext == NULL || (r->tls = SSL_new(TLSContext)) == NULL || SSL_set_fd(r->tls, r->fd) != 1){
+        fprintf(stderr, "SSL_new failed: %s\n", tls_reason());
+        return -1;
+    }
+
+    int flags = fcntl(r->fd, F_GETFL);
+    if (flags < 0 || fcntl(r->fd, F_SETFL, flags | O_NONBLOCK) < 0){
+        fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int status;
+    while ((status = SSL_accept(r->tls)) != 1){
+        int error = SSL_get_error(r->tls, status);
+        if (error == SSL_ERROR_SYSCALL && errno == EINTR){
+            continue;
+        }
+        if ((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) ||
+            tls_wait(r, error == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT) < 0){
+            break;
+        }
+    }
+    if (fcntl(r->fd, F_SETFL, flags) < 0){
+        fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (status != 1){
+        fprintf(stderr, "TLS handshake with %s:%s failed: %s\n", request_host(r), request_port(r), r->timed_out ? "timed out" : tls_reason());
+        return -1;
+    }
+
+    bool ktls = BIO_get_ktls_send(SSL_get_wbio(r->tls));
+    if (!ktls){
+        r->response.tls = r->tls;
+    }
+
+    const unsigned char *protocol;
+    unsigned int length;
+    SSL_get0_alpn_selected(r->tls, &protocol, &length);
+    debug("TLS handshake with %s:%s: %s %s%s, %.*s, kTLS send %s", request_host(r), request_port(r),
+          SSL_get_version(r->tls), SSL_get_cipher_name(r->tls), SSL_session_reused(r->tls) ? " (resumed)" : "",
+          length ? (int)length : 8, length ? (const char *)protocol : "http/1.1", ktls ? "on" : "off");
+    return 0;
+}
+
+/**
+ * Wait for client socket during handshake.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   events      Events to wait for (POLLIN or POLLOUT).
+ * @return  -1 on error or if the deadline passed (the request is then marked
+ *          as timed out), and 0 when the socket is ready.
+ *
+ * Signals interrupting the wait (e.g. SIGCHLD) only restart it.
+ **/
+int tls_wait(Request *r, short events) {
+    struct pollfd pfd = {.fd = r->fd, .events = events};
+    int ready;
+
+    do {
+        int64_t remaining = -1;
+        if (r->deadline.tv_sec != 0){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            remaining = (r->deadline.tv_sec - now.tv_sec) * 1000LL + (r->deadline.tv_nsec - now.tv_nsec) / 1000000;
+            remaining = remaining > 0 ? remaining : 0;
+        }
+        ready = remaining != 0 ? poll(&pfd, 1, remaining) : 0;
+    } while (ready < 0 && errno == EINTR);
+
+    if (ready < 0){
+        debug("poll failed: %s", strerror(errno));
+        return -1;
+    }
+    if (ready == 0){
+        r->timed_out = true;
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read decrypted data from client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   buffer      Buffer to store data.
+ * @param   size        Size of buffer.
+ * @return  Number of bytes read, 0 on end of file, or -1 on error (EINTR if
+ *          the read should be retried).
+ **/
+ssize_t tls_read(Request *r, void *buffer, size_t size) {
+    int nread = SSL_read(r->tls, buffer, size > INT_MAX ? INT_MAX : (int)size);
+    if (nread > 0){
+        return nread;
+    }
+
+    switch (SSL_get_error(r->tls, nread)){
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EINTR;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            return errno == 0 ? 0 : -1;
+        default:
+            debug("SSL_read failed: %s", tls_reason());
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+/**
+ * Whether decrypted data is waiting to be read.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  true if the next tls_read returns without reading the socket (so
+ *          polling it first may wait for nothing).
+ **/
+bool tls_pending(Request *r) {
+    return r->tls != NULL && SSL_pending(r->tls) > 0;
+}
+
+/**
+ * Write segments to client as TLS records.
+ *
+ * @param   ssl         TLS connection.
+ * @param   iov         Segments to write.
+ * @param   segments    Number of segments.
+ * @return  Number of bytes written (all of them) or -1 on error.
+ *
+ * Small segments (status line, headers) are gathered into full records
+ * rather than sent as one record each.
+ **/
+ssize_t tls_write(struct ssl_st *ssl, const struct iovec *iov, size_t segments) {
+    char    record[TLS_RECORD_SIZE];
+    size_t  used  = 0;
+    ssize_t total = 0;
+
+    for (size_t i = 0; i < segments; i++){
+        const char *data = iov[i].iov_base;
+        size_t      left = iov[i].iov_len;
+
+        total += left;
+        while (left > 0){
+            /* Write full records in place */
+            if (used == 0 && left >= TLS_RECORD_SIZE){
+                size_t size = left - left % TLS_RECORD_SIZE;
+                if (tls_send(ssl, data, size) < 0){
+                    return -1;
+                }
+                data += size;
+                left -= size;
+                continue;
+            }
+
+            size_t size = left < TLS_RECORD_SIZE - used ? left : TLS_RECORD_SIZE - used;
+            memcpy(record + used, data, size);
+            used += size;
+            data += size;
+            left -= size;
+            if (used == TLS_RECORD_SIZE){
+                if (tls_send(ssl, record, used) < 0){
+                    return -1;
+                }
+                used = 0;
+            }
+        }
+    }
+
+    if (used > 0 && tls_send(ssl, record, used) < 0){
+        return -1;
+    }
+    return total;
+}
+
+/**
+ * Write data to client.
+ *
+ * @param   ssl         TLS connection.
+ * @param   data        Data to write.
+ * @param   size        Number of bytes to write.
+ * @return  -1 on error and 0 on success.
+ **/
+int tls_send(SSL *ssl, const void *data, size_t size) {
+    while (size > 0){
+        int nwritten = SSL_write(ssl, data, size > INT_MAX ? INT_MAX : (int)size);
+        if (nwritten <= 0){
+            int error = SSL_get_error(ssl, nwritten);
+            if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE){
+                continue;
+            }
+            if (error != SSL_ERROR_SYSCALL){
+                debug("SSL_write failed: %s", tls_reason());
+                errno = EPROTO;
+            }
+            return -1;
+        }
+        data  = (const char *)data + nwritten;
+        size -= nwritten;
+    }
+    return 0;
+}
+
+/**
+ * Close TLS connection.
+ *
+ * @param   r           HTTP Request structure.
+ *
+ * A completed connection is closed with close_notify, so the client can
+ * tell the end of a response without a length from a truncated one.  The
+ * socket itself is left open.
+ **/
+void tls_close(Request *r) {
+    if (r->tls == NULL){
+        return;
+    }
+    if (SSL_is_init_finished(r->tls) && !r->response.failed){
+        SSL_shutdown(r->tls);
+    }
+    SSL_free(r->tls);
+    r->tls          = NULL;
+    r->response.tls = NULL;
+}
+
+/**
+ * Describe (and clear) the OpenSSL errors of the last call.
+ *
+ * @return  Reason of the earliest error (static buffer).
+ **/
+const char *tls_reason(void) {
+    static char buffer[256];
+    unsigned long error = ERR_get_error();
+
+    if (error == 0){
+        snprintf(buffer, sizeof(buffer), "%s", errno ? strerror(errno) : "connection closed");
+    } else {
+        ERR_error_string_n(error, buffer, sizeof(buffer));
+    }
+    ERR_clear_error();
+    return buffer;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
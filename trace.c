@@ -0,0 +1,258 @@
+/* trace.c: Sampling Span Recorder */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define TRACE_SLOTS     32              /* Slowest requests kept */
+
+/* Span of one request.  Each slot is guarded by a sequence number that is odd
+ * while the slot is being written, so recording never blocks: a writer that
+ * loses the race for a slot simply drops its span, and the dumper retries or
+ * skips slots that change underneath it. */
+
+typedef struct {
+    _Atomic uint32_t    sequence;
+    _Atomic int64_t     latency;        /*< Total nanoseconds (0 if empty) */
+    pid_t               pid;
+    int                 status;
+    struct timespec     start;
+    struct timespec     stage_start[METRICS_STAGES];
+    int64_t             stage_ns[METRICS_STAGES];
+    char                method[16];
+    char                uri[128];
+} __attribute__((aligned(64))) TraceSpan;
+
+typedef struct {
+    _Atomic uint64_t    requests;       /*< Requests seen (for sampling) */
+    TraceSpan           spans[TRACE_SLOTS];
+} TraceTable;
+
+/* Internal Variables */
+
+TraceTable             *Trace          = NULL;
+volatile sig_atomic_t   TraceRequested = 0;
+
+extern const char *MetricsStageNames[];
+
+/* Internal Declarations */
+void    trace_signal(int signum);
+bool    trace_copy(TraceSpan *span, TraceSpan *copy);
+void    trace_json_string(FILE *stream, const char *s);
+
+/**
+ * Initialize span recorder.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked, since the span table is
+ * allocated as anonymous shared memory.  Sending SIGUSR1 to the server dumps
+ * the recorded spans to TracePath.
+ **/
+int trace_init(void) {
+    Trace = mmap(NULL, sizeof(TraceTable), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (Trace == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        Trace = NULL;
+        return -1;
+    }
+
+    /* No SA_RESTART: the signal must interrupt accept so the loop can dump */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = trace_signal;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, NULL) < 0) {
+        fprintf(stderr, "sigaction failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Request dump of span table (signal handler).
+ *
+ * @param   signum      Signal number.
+ **/
+void trace_signal(int signum) {
+    TraceRequested = 1;
+}
+
+/**
+ * Record span of completed request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      HTTP status of response.
+ *
+ * Only one out of every TraceSampleRate requests is considered, and it is
+ * kept only if it is slower than the fastest span already in the table.
+ **/
+void trace_record(Request *r, HTTPStatus status) {
+    if (Trace == NULL) {
+        return;
+    }
+
+    uint64_t count = atomic_fetch_add_explicit(&Trace->requests, 1, memory_order_relaxed);
+    if (TraceSampleRate > 1 && count % TraceSampleRate != 0) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t latency = (now.tv_sec - r->start.tv_sec) * 1000000000LL + (now.tv_nsec - r->start.tv_nsec);
+
+    /* Find fastest span to replace */
+    TraceSpan *victim = NULL;
+    int64_t    minimum = latency;
+    for (size_t i = 0; i < TRACE_SLOTS; i++) {
+        int64_t current = atomic_load_explicit(&Trace->spans[i].latency, memory_order_relaxed);
+        if (current < minimum) {
+            minimum = current;
+            victim  = &Trace->spans[i];
+        }
+    }
+    if (victim == NULL) {
+        return;
+    }
+
+    /* Claim slot (odd sequence) */
+    uint32_t sequence = atomic_load_explicit(&victim->sequence, memory_order_relaxed);
+    if ((sequence & 1) || !atomic_compare_exchange_strong_explicit(&victim->sequence, &sequence, sequence + 1, memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+
+    victim->pid    = getpid();
+    victim->status = r->status_code ? r->status_code : http_status_code(status);
+    victim->start  = r->start;
+    memcpy(victim->stage_start, r->stage_start, sizeof(victim->stage_start));
+    memcpy(victim->stage_ns, r->stage_ns, sizeof(victim->stage_ns));
+    snprintf(victim->method, sizeof(victim->method), "%s", r->method ? r->method : "-");
+    snprintf(victim->uri, sizeof(victim->uri), "%s", r->uri ? r->uri : "-");
+    atomic_store_explicit(&victim->latency, latency, memory_order_relaxed);
+
+    /* Publish slot (even sequence) */
+    atomic_store_explicit(&victim->sequence, sequence + 2, memory_order_release);
+}
+
+/**
+ * Take consistent copy of span.
+ *
+ * @param   span        Span in shared table.
+ * @param   copy        Local copy of span.
+ * @return  Whether or not the copy is consistent and non-empty.
+ **/
+bool trace_copy(TraceSpan *span, TraceSpan *copy) {
+    for (int attempt = 0; attempt < 4; attempt++) {
+        uint32_t before = atomic_load_explicit(&span->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(copy, span, sizeof(TraceSpan));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&span->sequence, memory_order_relaxed) == before) {
+            return atomic_load_explicit(&copy->latency, memory_order_relaxed) > 0;
+        }
+    }
+    return false;
+}
+
+/**
+ * Write JSON string literal.
+ *
+ * @param   stream      Stream to write to.
+ * @param   s           String to quote.
+ **/
+void trace_json_string(FILE *stream, const char *s) {
+    fputc('"', stream);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(stream, "\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            fprintf(stream, "\\u%04x", *s);
+        } else {
+            fputc(*s, stream);
+        }
+    }
+    fputc('"', stream);
+}
+
+/**
+ * Dump recorded spans in Chrome trace event format.
+ *
+ * @param   path        Path of JSON file to write.
+ *
+ * Each request is written as a complete event on its own track, with one
+ * nested event per stage, so the file can be loaded directly into
+ * chrome://tracing or Perfetto.
+ **/
+void trace_dump(const char *path) {
+    if (Trace == NULL || path == NULL) {
+        return;
+    }
+
+    FILE *stream = fopen(path, "w");
+    if (stream == NULL) {
+        fprintf(stderr, "fopen %s failed: %s\n", path, strerror(errno));
+        return;
+    }
+
+    fprintf(stream, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    bool   first = true;
+    size_t spans = 0;
+    for (size_t i = 0; i < TRACE_SLOTS; i++) {
+        TraceSpan span;
+        if (!trace_copy(&Trace->spans[i], &span)) {
+            continue;
+        }
+
+        double start = span.start.tv_sec * 1e6 + span.start.tv_nsec / 1e3;
+        fprintf(stream, "%s\n{\"name\":", first ? "" : ",");
+        trace_json_string(stream, span.uri);
+        fprintf(stream, ",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%zu,\"args\":{\"method\":",
+            start, atomic_load_explicit(&span.latency, memory_order_relaxed) / 1e3, span.pid, i);
+        trace_json_string(stream, span.method);
+        fprintf(stream, ",\"status\":%d}}", span.status);
+        first = false;
+
+        for (MetricsStage stage = 0; stage < METRICS_STAGES; stage++) {
+            if (span.stage_start[stage].tv_sec == 0 && span.stage_start[stage].tv_nsec == 0) {
+                continue;
+            }
+            fprintf(stream, ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%zu}",
+                MetricsStageNames[stage],
+                span.stage_start[stage].tv_sec * 1e6 + span.stage_start[stage].tv_nsec / 1e3,
+                span.stage_ns[stage] / 1e3, span.pid, i);
+        }
+        spans++;
+    }
+    fprintf(stream, "\n]}\n");
+
+    if (fclose(stream) != 0) {
+        fprintf(stderr, "fclose %s failed: %s\n", path, strerror(errno));
+        return;
+    }
+    log("Dumped %zu spans to %s", spans, path);
+}
+
+/**
+ * Dump spans if requested by SIGUSR1.
+ *
+ * This is called from the server loops, outside of the signal handler.
+ **/
+void trace_poll(void) {
+    if (TraceRequested) {
+        TraceRequested = 0;
+        trace_dump(TracePath);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
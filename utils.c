@@ -1,5 +1,7 @@
 /* utils.c: spidey utilities */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <ctype.h>
@@ -9,75 +11,175 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define MIMETYPE_SLOTS  4096            /* Extensions in table (power of two) */
+
+/* Status lines are rendered at compile time */
+
+#define HTTP_STATUS_TEMPLATE(s) { s, "HTTP/1.0 " s "\r\n", sizeof("HTTP/1.0 " s "\r\n") - 1 }
+
+typedef struct {
+    const char *string;                 /*< Status (e.g. "200 OK") */
+    const char *line;                   /*< Status line */
+    size_t      length;                 /*< Length of status line */
+} HTTPStatusTemplate;
+
+static const HTTPStatusTemplate HTTPStatusTemplates[HTTP_STATUS_COUNT] = {
+    [HTTP_STATUS_OK]                    = HTTP_STATUS_TEMPLATE("200 OK"),
+    [HTTP_STATUS_BAD_REQUEST]           = HTTP_STATUS_TEMPLATE("400 Bad Request"),
+    [HTTP_STATUS_NOT_FOUND]             = HTTP_STATUS_TEMPLATE("404 Not Found"),
+    [HTTP_STATUS_REQUEST_TIMEOUT]       = HTTP_STATUS_TEMPLATE("408 Request Timeout"),
+    [HTTP_STATUS_PAYLOAD_TOO_LARGE]     = HTTP_STATUS_TEMPLATE("413 Payload Too Large"),
+    [HTTP_STATUS_TOO_MANY_REQUESTS]     = HTTP_STATUS_TEMPLATE("429 Too Many Requests"),
+    [HTTP_STATUS_HEADERS_TOO_LARGE]     = HTTP_STATUS_TEMPLATE("431 Request Header Fields Too Large"),
+    [HTTP_STATUS_INTERNAL_SERVER_ERROR] = HTTP_STATUS_TEMPLATE("500 Internal Server Error"),
+    [HTTP_STATUS_SERVICE_UNAVAILABLE]   = HTTP_STATUS_TEMPLATE("503 Service Unavailable"),
+};
+
+/* Internal Variables */
+
+MimeType MimeTypes[MIMETYPE_SLOTS];
+MimeType MimeTypeDefault;
+size_t   MimeTypesCount  = 0;
+bool     MimeTypesLoaded = false;
+
+/* Internal Declarations */
+void        mimetype_entry(MimeType *type, const char *mimetype);
+MimeType *  mimetype_slot(const char *extension);
+
 /**
- * Determine mime-type from file extension.
- *
- * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
- *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
+ * Load mime-type table from MimeTypesPath.
  *
  * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
  * following format:
  *
  *  <MIMETYPE>      <EXT1> <EXT2> ...
  *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
- *
- * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
+ * Every extension is entered into a hash table (linear probing), with the
+ * first rule for an extension taking precedence.  Each mime-type's
+ * Content-Type header line is rendered here once, so responses only append
+ * it.
  *
- * This function returns an allocated string that must be free'd.
+ * This is called once at startup, before any workers are forked (or on the
+ * first lookup).  If the file cannot be read, every file has DefaultMimeType.
  **/
-char * determine_mimetype(const char *path) {
-    char *ext;
-    char *mimetype;
-    char *token;
+void mimetypes_load(void) {
     char buffer[BUFSIZ];
-    FILE *fs = NULL;
+    FILE *fs;
 
-    if (path == NULL){
-        return DefaultMimeType;
-    }
-
-    /* Find file extension */
-    char *temp = strrchr(path, '.');
-    if (temp == NULL){
-        //fprintf(stderr, "Can't find file extenstion: %s\n", strerror(errno));
-        return DefaultMimeType;
-    }
-    ext = ++temp;
+    MimeTypesLoaded = true;
+    mimetype_entry(&MimeTypeDefault, DefaultMimeType);
 
     /* Open MimeTypesPath file */
     fs = fopen(MimeTypesPath, "r");
     if (fs == NULL) {
         fprintf(stderr, "fopen failed: %s\n", strerror(errno));
-        return DefaultMimeType;
-    }
-
-    /* Scan file for matching file extensions */
-    while(fgets(buffer, BUFSIZ, fs)){
-        char *c = buffer;
-        token = strtok(buffer, WHITESPACE);
-        while (token != NULL){
-            token = skip_whitespace(token);
-            if (streq(token, ext)){
-                char *back = c+strlen(c)-1;
-                while(c < back && isspace(*back)){
-                    back--;
-                }
-                *(back+1) = 0;
-                mimetype = strdup(c);
-                return mimetype;
+        return;
+    }
+
+    /* Enter each extension of each rule */
+    while (fgets(buffer, BUFSIZ, fs)){
+        if (buffer[0] == '#'){
+            continue;
+        }
+        char *mimetype = strtok(buffer, WHITESPACE);
+        char *token    = strtok(NULL, WHITESPACE);
+        if (mimetype == NULL || token == NULL){
+            continue;
+        }
+
+        MimeType type = {0};
+        for (; token != NULL && MimeTypesCount < MIMETYPE_SLOTS / 2; token = strtok(NULL, WHITESPACE)){
+            MimeType *slot = mimetype_slot(token);
+            if (slot->extension != NULL){
+                continue;
+            }
+            if (type.mimetype == NULL){
+                mimetype_entry(&type, mimetype);
             }
-            token = strtok(NULL, WHITESPACE);
+            *slot = type;
+            slot->extension = strdup(token);
+            MimeTypesCount++;
         }
+    }
 
+    fclose(fs);
+}
+
+/**
+ * Initialize mime-type table entry.
+ *
+ * @param   type        Entry to initialize.
+ * @param   mimetype    Mime-type of entry.
+ **/
+void mimetype_entry(MimeType *type, const char *mimetype) {
+    int length = asprintf(&type->header, "Content-Type: %s\r\n", mimetype);
+    if (length < 0){
+        type->header        = NULL;
+        type->header_length = 0;
+        type->mimetype      = "";
+        return;
+    }
+    type->header_length = length;
+    type->mimetype      = strndup(type->header + 14, length - 16);
+}
+
+/**
+ * Find hash table slot of extension.
+ *
+ * @param   extension   File extension.
+ * @return  Slot holding extension, or the empty slot where it belongs.
+ **/
+MimeType * mimetype_slot(const char *extension) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (const char *c = extension; *c; c++){
+        hash = (hash ^ (unsigned char)*c) * UINT64_C(1099511628211);
     }
 
-    return DefaultMimeType;
+    for (size_t i = hash & (MIMETYPE_SLOTS - 1); ; i = (i + 1) & (MIMETYPE_SLOTS - 1)){
+        MimeType *slot = &MimeTypes[i];
+        if (slot->extension == NULL || streq(slot->extension, extension)){
+            return slot;
+        }
+    }
+}
+
+/**
+ * Look up mime-type from file extension.
+ *
+ * @param   path        Path to file.
+ * @return  Table entry with the mime-type (and Content-Type header line) of
+ *          the specified file.
+ *
+ * If no extension exists or no matching mimetype is found, then return the
+ * entry for DefaultMimeType.
+ **/
+const MimeType * mimetype_lookup(const char *path) {
+    if (!MimeTypesLoaded){
+        mimetypes_load();
+    }
+
+    const char *ext = path ? strrchr(path, '.') : NULL;
+    if (ext == NULL){
+        return &MimeTypeDefault;
+    }
+
+    MimeType *slot = mimetype_slot(ext + 1);
+    return slot->extension ? slot : &MimeTypeDefault;
+}
+
+/**
+ * Determine mime-type from file extension.
+ *
+ * @param   path        Path to file.
+ * @return  An allocated string containing the mime-type of the specified file.
+ *
+ * This function returns an allocated string that must be free'd (see
+ * mimetype_lookup).
+ **/
+char * determine_mimetype(const char *path) {
+    return strdup(mimetype_lookup(path)->mimetype);
 }
 
 /**
@@ -109,6 +211,7 @@ char * determine_request_path(const char *uri) {
     *(combined_path + strlen(combined_path)) = '\0';
 
     if (strncmp(combined_path, RootPath, strlen(RootPath)) != 0){
+        free(combined_path);
         return NULL;
     }
 
@@ -124,27 +227,75 @@ char * determine_request_path(const char *uri) {
  * http://en.wikipedia.org/wiki/List_of_HTTP_status_codes
  **/
 const char * http_status_string(HTTPStatus status) {
-    static char *StatusStrings[] = {
-        "200 OK",
-        "400 Bad Request",
-        "404 Not Found",
-        "500 Internal Server Error",
-        "418 I'm A Teapot",
-    };
-    if (status == HTTP_STATUS_OK){
-        return StatusStrings[0];
+    if (status >= HTTP_STATUS_COUNT){
+        return NULL;
     }
-    else if (status == HTTP_STATUS_BAD_REQUEST){
-        return StatusStrings[1];
+    return HTTPStatusTemplates[status].string;
+}
+
+/**
+ * Return numeric code of HTTP status.
+ *
+ * @param   status      HTTP Status.
+ * @return  Status code (e.g. 404), or 0 if the status is not present.
+ **/
+int http_status_code(HTTPStatus status) {
+    if (status >= HTTP_STATUS_COUNT){
+        return 0;
+    }
+    return atoi(HTTPStatusTemplates[status].string);
+}
+
+/**
+ * Return ready-made HTTP status line.
+ *
+ * @param   status      HTTP Status.
+ * @param   length      Length of status line (output).
+ * @return  Status line (e.g. "HTTP/1.0 200 OK\r\n"), or NULL if the status is
+ *          not present.
+ **/
+const char * http_status_line(HTTPStatus status, size_t *length) {
+    if (status >= HTTP_STATUS_COUNT){
+        return NULL;
     }
-    else if (status == HTTP_STATUS_NOT_FOUND){
-        return StatusStrings[2];
+    *length = HTTPStatusTemplates[status].length;
+    return HTTPStatusTemplates[status].line;
+}
+
+/**
+ * Format unsigned integer in decimal.
+ *
+ * @param   value       Integer to format.
+ * @param   buffer      Buffer to store digits (at least 20 bytes, not
+ *                      NUL-terminated).
+ * @return  Number of digits.
+ *
+ * Digits are produced two at a time from a table, right to left.
+ **/
+size_t utoa(uint64_t value, char *buffer) {
+    static const char Digits[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char   digits[20];
+    char  *end = digits + sizeof(digits);
+    char  *p   = end;
+
+    while (value >= 100){
+        unsigned pair = (value % 100) * 2;
+        value /= 100;
+        *--p = Digits[pair + 1];
+        *--p = Digits[pair];
     }
-    else if (status == HTTP_STATUS_INTERNAL_SERVER_ERROR){
-        return StatusStrings[3];
+    if (value >= 10){
+        *--p = Digits[value * 2 + 1];
+        *--p = Digits[value * 2];
+    } else {
+        *--p = '0' + value;
     }
 
-    return NULL;
+    memcpy(buffer, p, end - p);
+    return end - p;
 }
 
 /**
@@ -0,0 +1,154 @@
+/* worker.c: Worker Processes */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Worker process forked by the server */
+
+typedef struct {
+    pid_t           pid;                /*< Worker process */
+    bool            admitted;           /*< Worker holds an admission slot */
+    struct timespec start;              /*< Time its request was accepted */
+} Worker;
+
+/* Internal Variables */
+
+Worker    *Workers          = NULL;     /* Running workers (see worker_reap) */
+size_t     WorkersCount     = 0;
+size_t     WorkersCapacity  = 0;
+const int *WorkerListeners  = NULL;     /* Server sockets (closed by workers) */
+size_t     WorkerListenersCount = 0;
+bool       WorkerProcess    = false;    /* This process is a worker */
+
+/**
+ * Record server sockets for workers to close.
+ *
+ * @param   sfds        Server socket file descriptors.
+ * @param   nsfds       Number of server sockets.
+ **/
+void worker_init(const int *sfds, size_t nsfds) {
+    WorkerListeners      = sfds;
+    WorkerListenersCount = nsfds;
+}
+
+/**
+ * Fork worker process to handle request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  0 in the worker, its pid in the server, or -1 on error.
+ *
+ * The server keeps the request's admission slot (if any) until it reaps the
+ * worker in worker_reap, so a worker that crashes or is killed still gives
+ * its slot back.  Neither process releases it with admission_release.
+ *
+ * Each worker leads its own process group, so it can be killed together with
+ * its CGI scripts (see worker_signal).
+ **/
+pid_t worker_fork(Request *r) {
+    if (WorkersCount == WorkersCapacity) {
+        size_t  capacity = WorkersCapacity ? WorkersCapacity * 2 : 64;
+        Worker *workers  = realloc(Workers, capacity * sizeof(Worker));
+        if (workers == NULL) {
+            fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+            return -1;
+        }
+        Workers         = workers;
+        WorkersCapacity = capacity;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        debug("fork failed %s", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        /* Finish request when the server is asked to stop (SIGTERM only
+         * sets Shutdown), but die with the server if it gives up */
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        signal(SIGCHLD, SIG_DFL);
+        setpgid(0, 0);
+
+        /* Close server sockets (not needed by the worker or its CGI) */
+        for (size_t i = 0; i < WorkerListenersCount; i++) {
+            close(WorkerListeners[i]);
+        }
+        free(Workers);
+        Workers         = NULL;
+        WorkersCount    = 0;
+        WorkersCapacity = 0;
+        WorkerProcess   = true;
+        r->admitted     = false;
+        return 0;
+    }
+
+    setpgid(pid, pid);
+    Workers[WorkersCount].pid      = pid;
+    Workers[WorkersCount].admitted = r->admitted;
+    Workers[WorkersCount].start    = r->start;
+    WorkersCount++;
+    r->admitted = false;
+    return pid;
+}
+
+/**
+ * Reap exited workers.
+ *
+ * Each reaped worker's admission slot is released (and its latency fed to
+ * the adaptive limit).  This never blocks.
+ **/
+void worker_reap(void) {
+    pid_t pid;
+
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (size_t i = 0; i < WorkersCount; i++) {
+            if (Workers[i].pid == pid) {
+                if (Workers[i].admitted) {
+                    admission_finish(&Workers[i].start);
+                }
+                Workers[i] = Workers[--WorkersCount];
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Signal running workers.
+ *
+ * @param   signum      Signal number.
+ * @param   group       Signal each worker's whole process group (including
+ *                      its CGI scripts) instead of only the worker.
+ **/
+void worker_signal(int signum, bool group) {
+    for (size_t i = 0; i < WorkersCount; i++) {
+        kill(group ? -Workers[i].pid : Workers[i].pid, signum);
+    }
+}
+
+/**
+ * Determine if this process is a worker.
+ *
+ * @return  Whether this process was forked by worker_fork (or by a worker).
+ **/
+bool worker_process(void) {
+    return WorkerProcess;
+}
+
+/**
+ * Count running workers.
+ *
+ * @return  Number of workers not reaped yet.
+ **/
+size_t worker_count(void) {
+    return WorkersCount;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */